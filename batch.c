@@ -0,0 +1,281 @@
+#include "batch.h"
+#include "input.h"
+#include "workers.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BATCH_SEPARATORS " \t\r"
+
+typedef struct {
+    char *output_path;
+    int w;
+    int h;
+    int b_stream;
+    char **inputs;
+    int n_inputs;
+} batch_job_t;
+
+struct batch_t {
+    batch_job_t *jobs;
+    batch_result_t *results;
+    int n_jobs;
+
+    // for the duration of batch_run
+    const compression_options_t *opts;
+    session_pool_t *pool;
+    int i_read_ahead;
+    double start;
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *prefixed(const char *prefix, const char *path) {
+    char *full_path = malloc(strlen(prefix) + strlen(path) + 1);
+    if (full_path) {
+        strcpy(full_path, prefix);
+        strcat(full_path, path);
+    }
+    return full_path;
+}
+
+// The whole manifest as a string, or NULL.
+static char *read_manifest(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    size_t size = 0;
+    size_t alloc = 4096;
+    char *text = malloc(alloc);
+    while (text) {
+        size += fread(text + size, 1, alloc - size - 1, f);
+        if (size < alloc - 1) {
+            break;
+        }
+        alloc *= 2;
+        char *grown = realloc(text, alloc);
+        if (!grown) {
+            free(text);
+        }
+        text = grown;
+    }
+    if (text) {
+        text[size] = 0;
+        if (ferror(f)) {
+            fprintf(stderr, "Can't read %s\n", path);
+            free(text);
+            text = NULL;
+        }
+    }
+    fclose(f);
+    return text;
+}
+
+// Fills in job from the whitespace separated words of one manifest line. Returns 0 on success.
+static int parse_job(batch_job_t *job, char **words, int n_words, const char *path_prefix) {
+    int i = 0;
+    if (i < n_words && strcmp(words[i], "-s") == 0) {
+        job->b_stream = 1;
+        i++;
+    }
+    if (n_words - i < 4) {
+        return 1;
+    }
+    job->output_path = prefixed(path_prefix, words[i++]);
+    job->w = atoi(words[i++]);
+    job->h = atoi(words[i++]);
+    job->n_inputs = n_words - i;
+    job->inputs = calloc(job->n_inputs, sizeof(char *));
+    if (!job->output_path || !job->inputs || job->w <= 0 || job->h <= 0) {
+        return 1;
+    }
+    for (int j = 0; j < job->n_inputs; j++) {
+        job->inputs[j] = prefixed(path_prefix, words[i + j]);
+        if (!job->inputs[j]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+batch_t *batch_load(const char *manifest_path, const char *path_prefix) {
+    char *text = read_manifest(manifest_path);
+    if (!text) {
+        return NULL;
+    }
+    batch_t *batch = calloc(1, sizeof(batch_t));
+    if (!batch) {
+        free(text);
+        return NULL;
+    }
+
+    int b_failed = 0;
+    int i_line = 0;
+    char **words = NULL;
+    int i_words_alloc = 0;
+    int i_jobs_alloc = 0;
+    char *line_save;
+    // strtok_r skips empty lines along with the newlines
+    for (char *line = strtok_r(text, "\n", &line_save); line && !b_failed; line = strtok_r(NULL, "\n", &line_save)) {
+        i_line++;
+        int n_words = 0;
+        char *word_save;
+        for (char *word = strtok_r(line, BATCH_SEPARATORS, &word_save); word; word = strtok_r(NULL, BATCH_SEPARATORS, &word_save)) {
+            if (n_words == i_words_alloc) {
+                i_words_alloc = i_words_alloc ? i_words_alloc * 2 : 64;
+                char **grown = realloc(words, i_words_alloc * sizeof(char *));
+                if (!grown) {
+                    b_failed = 1;
+                    break;
+                }
+                words = grown;
+            }
+            words[n_words++] = word;
+        }
+        if (b_failed || n_words == 0 || words[0][0] == '#') {
+            continue;
+        }
+
+        if (batch->n_jobs == i_jobs_alloc) {
+            i_jobs_alloc = i_jobs_alloc ? i_jobs_alloc * 2 : 64;
+            batch_job_t *grown = realloc(batch->jobs, i_jobs_alloc * sizeof(batch_job_t));
+            if (!grown) {
+                b_failed = 1;
+                break;
+            }
+            batch->jobs = grown;
+        }
+        batch_job_t *job = &batch->jobs[batch->n_jobs++];
+        memset(job, 0, sizeof(batch_job_t));
+        if (parse_job(job, words, n_words, path_prefix) != 0) {
+            fprintf(stderr, "%s:%d: expected [-s] output.mp4 width height input ...\n", manifest_path, i_line);
+            b_failed = 1;
+        }
+    }
+    free(words);
+    free(text);
+
+    if (!b_failed) {
+        batch->results = calloc(batch->n_jobs ? batch->n_jobs : 1, sizeof(batch_result_t));
+        b_failed = batch->results == NULL;
+    }
+    if (b_failed) {
+        batch_free(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+int batch_count(const batch_t *batch) {
+    return batch->n_jobs;
+}
+
+// One job, on whichever pool thread claimed it.
+static void batch_job(void *ctx, int i_job) {
+    batch_t *batch = ctx;
+    batch_job_t *job = &batch->jobs[i_job];
+    batch_result_t *result = &batch->results[i_job];
+    size_t frame_size = (size_t)job->w * job->h * 4;
+    double start = now_seconds();
+    result->f_start = start - batch->start;
+
+    compression_options_t opts = *batch->opts;
+    opts.pool = batch->pool;
+    opts.write = NULL;
+    opts.write_opaque = NULL;
+    opts.b_memory_output = 0;
+    // jobs finish at the same time, and the callback's state isn't per job
+    opts.on_finish_progress = NULL;
+    opts.finish_opaque = NULL;
+
+    session_t *s = session_open(job->output_path, job->w, job->h, &opts);
+    int b_failed = s == NULL;
+    for (int i = 0; i < (job->b_stream ? job->n_inputs : 1) && !b_failed; i++) {
+        input_t *in = job->b_stream
+            ? input_open_stream(job->inputs[i], frame_size, batch->i_read_ahead)
+            : input_open_files((const char *const *)job->inputs, job->n_inputs, frame_size, batch->i_read_ahead);
+        if (!in) {
+            b_failed = 1;
+            break;
+        }
+        const uint8_t *rgba;
+        // once the session has failed, reading the rest of the input is wasted work
+        while (!b_failed && (rgba = input_next(in))) {
+            // the session only reads the frame
+            b_failed |= session_add_frame(s, (uint8_t *)rgba) != 0;
+            result->n_frames++;
+        }
+        b_failed |= input_failed(in);
+        input_close(in);
+    }
+    if (s) {
+        b_failed |= session_finish(s) != 0;
+        session_destroy(s);
+    }
+
+    result->b_failed = b_failed;
+    result->f_seconds = now_seconds() - start;
+}
+
+int batch_run(batch_t *batch, const compression_options_t *opts, int i_jobs, int i_read_ahead) {
+    for (int i = 0; i < batch->n_jobs; i++) {
+        batch_result_t *result = &batch->results[i];
+        memset(result, 0, sizeof(batch_result_t));
+        result->output_path = batch->jobs[i].output_path;
+        result->w = batch->jobs[i].w;
+        result->h = batch->jobs[i].h;
+        result->b_failed = 1;
+    }
+
+    workers_t *workers = workers_create(i_jobs);
+    // one idle set per job in flight: enough for every finished job's buffers to wait for the next
+    // job of its size
+    session_pool_t *pool = workers ? session_pool_create(workers_count(workers)) : NULL;
+    if (workers && pool) {
+        batch->opts = opts;
+        batch->pool = pool;
+        batch->i_read_ahead = i_read_ahead;
+        batch->start = now_seconds();
+        workers_run(workers, batch_job, batch, batch->n_jobs);
+        batch->opts = NULL;
+        batch->pool = NULL;
+    }
+    session_pool_destroy(pool);
+    workers_destroy(workers);
+
+    int n_failed = 0;
+    for (int i = 0; i < batch->n_jobs; i++) {
+        n_failed += batch->results[i].b_failed;
+    }
+    return n_failed;
+}
+
+const batch_result_t *batch_result(const batch_t *batch, int i_job) {
+    return &batch->results[i_job];
+}
+
+void batch_free(batch_t *batch) {
+    if (!batch) {
+        return;
+    }
+    for (int i = 0; i < batch->n_jobs; i++) {
+        batch_job_t *job = &batch->jobs[i];
+        for (int j = 0; job->inputs && j < job->n_inputs; j++) {
+            free(job->inputs[j]);
+        }
+        free(job->inputs);
+        free(job->output_path);
+    }
+    free(batch->jobs);
+    free(batch->results);
+    free(batch);
+}
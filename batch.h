@@ -0,0 +1,48 @@
+#ifndef RAW2MP4_BATCH_H
+#define RAW2MP4_BATCH_H
+
+#include "raw2mp4.h"
+
+// Batch encoding for the command line tool, for running many short clips in one process.
+//
+// A manifest has one job per line, written like raw2mp4's own arguments after the options:
+//
+//     [-s] output.mp4 width height input ...
+//
+// where -s means each input is a stream of back to back frames rather than a single frame. Blank
+// lines and lines starting with # are skipped, and paths can't contain whitespace.
+//
+// Jobs run i_jobs at a time on a worker pool, each in a session of its own. The sessions share a
+// session pool, so a job takes over the pictures and conversion threads of a finished job of the
+// same size instead of allocating its own.
+
+typedef struct batch_t batch_t;
+
+// How one job went. Times are in seconds, start counting from batch_run being called.
+typedef struct {
+    const char *output_path;
+    int w;
+    int h;
+    int n_frames;
+    int b_failed;
+    double f_start;
+    double f_seconds;
+} batch_result_t;
+
+// Reads a manifest, putting path_prefix in front of every path in it. Returns NULL and says why
+// on stderr if it can't be read or a line doesn't make sense.
+batch_t *batch_load(const char *manifest_path, const char *path_prefix);
+int batch_count(const batch_t *batch);
+
+// Encodes every job with opts, i_jobs at a time (0 for one per CPU), reading i_read_ahead frames
+// ahead of each. The output fields of opts, its finish progress callback and its pool are ignored;
+// every job writes its own file.
+// Returns the number of jobs that failed.
+int batch_run(batch_t *batch, const compression_options_t *opts, int i_jobs, int i_read_ahead);
+
+// The result of job i_job of the last batch_run.
+const batch_result_t *batch_result(const batch_t *batch, int i_job);
+
+void batch_free(batch_t *batch);
+
+#endif
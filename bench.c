@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "raw2mp4.h"
+#include "convert.h"
+#include "frames.h"
+#include "json.h"
+
+// End to end benchmark: encodes synthetic scenes at several sizes through the CompressionSession
+// API and prints one JSON document on stdout, for comparing builds and commits. Each case runs in
+// its own process so peak RSS is per case.
+
+typedef struct {
+    const char *name;
+    int w;
+    int h;
+} bench_size_t;
+
+static const bench_size_t bench_sizes[] = {
+    { "480p", 640, 480 },
+    { "1080p", 1920, 1080 },
+    { "4k", 3840, 2160 },
+};
+#define N_BENCH_SIZES (int)(sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+// How x264 itself is threaded. frame and sliced only differ from single with an x264 built with
+// threads, i.e. bench-threaded. live is single in the session's live mode.
+typedef enum {
+    BENCH_MODE_SINGLE = 0,
+    BENCH_MODE_FRAME,
+    BENCH_MODE_SLICED,
+    BENCH_MODE_LIVE,
+    BENCH_MODE_COUNT
+} bench_mode_t;
+
+static const char *bench_mode_names[BENCH_MODE_COUNT] = { "single", "frame", "sliced", "live" };
+
+typedef struct {
+    int n_frames;
+    int b_pipeline;
+    int i_convert_threads;
+    int b_skip_duplicates;
+    int b_incremental_convert;
+    const char *preset;
+    double f_target_fps;
+    bench_mode_t mode;
+    int i_encoder_threads; // for the frame and sliced modes
+    int i_lookahead_threads;
+    int b_fast_start;
+    size_t i_memory_budget;
+} bench_config_t;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// nearest rank percentile of sorted values
+static double percentile(const double *sorted, int n, int pct) {
+    if (n == 0) {
+        return 0;
+    }
+    int rank = (pct * n + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static long peak_rss_kb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#if __APPLE__
+    return usage.ru_maxrss / 1024; // bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// Prints a double, or null when the measurement doesn't apply, so the output stays valid JSON.
+static void print_rate(FILE *out, const char *key, double value, int b_valid) {
+    if (b_valid && value > 0) {
+        fprintf(out, "\"%s\": %.3f", key, value);
+    } else {
+        fprintf(out, "\"%s\": null", key);
+    }
+}
+
+static int run_case(const bench_config_t *cfg, const bench_size_t *size, frames_scene_t scene, FILE *out) {
+    int w = size->w;
+    int h = size->h;
+    int n = cfg->n_frames;
+    size_t frame_size = (size_t)w * h * 4;
+
+    uint8_t *rgba = malloc(frame_size);
+    double *latency = calloc(n > 0 ? n : 1, sizeof(double));
+    if (!rgba || !latency) {
+        fprintf(stderr, "Out of memory for %s\n", size->name);
+        return 1;
+    }
+
+    compression_options_t opts;
+    CompressionSessionDefaultOptions(&opts);
+    opts.b_pipeline = cfg->b_pipeline;
+    opts.i_convert_threads = cfg->i_convert_threads;
+    opts.b_skip_duplicates = cfg->b_skip_duplicates;
+    opts.b_incremental_convert = cfg->b_incremental_convert;
+    if (cfg->preset) {
+        opts.preset = cfg->preset;
+    }
+    opts.f_target_fps = cfg->f_target_fps;
+    if (cfg->mode == BENCH_MODE_FRAME || cfg->mode == BENCH_MODE_SLICED) {
+        opts.i_encoder_threads = cfg->i_encoder_threads;
+        opts.b_sliced_threads = cfg->mode == BENCH_MODE_SLICED;
+    }
+    opts.i_lookahead_threads = cfg->i_lookahead_threads;
+    opts.b_live = cfg->mode == BENCH_MODE_LIVE;
+    opts.b_fast_start = cfg->b_fast_start;
+    opts.i_memory_budget = cfg->i_memory_budget;
+    // keeps disk speed out of the numbers
+    opts.b_memory_output = 1;
+
+    double open_start = now_seconds();
+    if (CompressionSessionOpenWithOptions("bench.mp4", w, h, &opts) != 0) {
+        fprintf(stderr, "Can't open a %dx%d session\n", w, h);
+        return 1;
+    }
+    double open_seconds = now_seconds() - open_start;
+
+    double add_seconds = 0;
+    int i_max_delay = 0;
+    compression_stats_t stats;
+    for (int i = 0; i < n; i++) {
+        frames_render(scene, i, rgba, w, h);
+
+        double start = now_seconds();
+        if (CompressionSessionAddFrame(rgba) != 0) {
+            fprintf(stderr, "Frame %d failed for %s\n", i, size->name);
+            return 1;
+        }
+        latency[i] = now_seconds() - start;
+        add_seconds += latency[i];
+        
+        // frames in x264 and not out yet: what frame threads cost in latency
+        if (CompressionSessionGetStats(&stats) == 0 && stats.i_encoder_delay > i_max_delay) {
+            i_max_delay = stats.i_encoder_delay;
+        }
+    }
+
+    // the breakdown while the encoder is still open; finishing frees most of it
+    compression_memory_t memory;
+    CompressionSessionGetMemory(&memory);
+
+    double finish_start = now_seconds();
+    if (CompressionSessionFinish() != 0) {
+        fprintf(stderr, "Finish failed\n");
+        return 1;
+    }
+    double finish_seconds = now_seconds() - finish_start;
+    size_t output_bytes = CompressionSessionOutputSize();
+    CompressionSessionReleaseOutput();
+    compression_memory_t finished;
+    if (CompressionSessionGetStats(&stats) != 0 || CompressionSessionGetMemory(&finished) != 0) {
+        fprintf(stderr, "No stats\n");
+        return 1;
+    }
+
+    qsort(latency, n, sizeof(double), compare_doubles);
+    double session_seconds = add_seconds + finish_seconds;
+    double convert_seconds = stats.i_convert_us / 1e6;
+    double encode_seconds = stats.i_encode_us / 1e6;
+    double mux_seconds = stats.i_mux_us / 1e6;
+
+    fprintf(out, "    {\"scene\": \"%s\", \"size\": \"%s\", \"width\": %d, \"height\": %d, \"frames\": %d, ",
+            frames_scene_name(scene), size->name, w, h, n);
+    fprintf(out, "\"encoder_mode\": \"%s\", \"encoder_threads\": %d, \"max_encoder_delay\": %d, ",
+            bench_mode_names[cfg->mode], stats.i_encoder_threads, i_max_delay);
+    fprintf(out, "\"open_ms\": %.3f, \"finish_ms\": %.3f, ", open_seconds * 1e3, finish_seconds * 1e3);
+    // stage rates are per frame that went through the stage, over the time spent in it
+    print_rate(out, "convert_fps", stats.i_frames_in / convert_seconds, convert_seconds > 0);
+    fprintf(out, ", ");
+    print_rate(out, "convert_mpixels_per_s", (double)stats.i_frames_in * w * h / 1e6 / convert_seconds,
+               convert_seconds > 0);
+    fprintf(out, ", ");
+    print_rate(out, "encode_fps", stats.i_frames_encoded / encode_seconds, encode_seconds > 0);
+    fprintf(out, ", ");
+    print_rate(out, "mux_fps", stats.i_frames_out / mux_seconds, mux_seconds > 0);
+    fprintf(out, ", ");
+    print_rate(out, "end_to_end_fps", n / session_seconds, session_seconds > 0);
+    fprintf(out, ", \"add_frame_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}, ",
+            percentile(latency, n, 50) * 1e3, percentile(latency, n, 90) * 1e3,
+            percentile(latency, n, 99) * 1e3, n ? latency[n - 1] * 1e3 : 0);
+    // from AddFrame to the sample being muxed, including any time spent waiting in x264
+    fprintf(out, "\"frame_latency_ms\": {\"average\": %.3f, \"max\": %.3f}, ",
+            stats.f_average_latency_us / 1e3, stats.i_max_latency_us / 1e3);
+    fprintf(out, "\"mp4_finish_ms\": %.3f, \"duplicates\": %llu, \"average_qp\": %.2f, ",
+            stats.i_finish_us / 1e3, (unsigned long long)stats.i_duplicates, stats.f_average_qp);
+    fprintf(out, "\"finish_moved_bytes\": %llu, \"finish_buffer_bytes\": %llu, ",
+            (unsigned long long)stats.i_finish_moved_bytes, (unsigned long long)stats.i_finish_buffer_bytes);
+    fprintf(out, "\"final_preset\": \"%s\", \"preset_changes\": %llu, ",
+            stats.preset ? stats.preset : "", (unsigned long long)stats.i_preset_changes);
+    // the session's own accounting, next to what the process as a whole peaked at
+    fprintf(out, "\"memory\": {\"peak_bytes\": %llu, \"encoder_bytes\": %llu, \"pictures_bytes\": %llu, "
+            "\"lookahead\": %d, \"bframes\": %d, \"refs\": %d}, ",
+            (unsigned long long)finished.i_peak, (unsigned long long)memory.i_encoder,
+            (unsigned long long)memory.i_pictures, memory.i_lookahead, memory.i_bframe, memory.i_frame_reference);
+    fprintf(out, "\"output_bytes\": %zu, \"peak_rss_kb\": %ld}", output_bytes, peak_rss_kb());
+
+    free(latency);
+    free(rgba);
+    return 0;
+}
+
+// Runs one case in a child and copies its JSON to stdout. Returns non-zero if the case failed.
+static int fork_case(const bench_config_t *cfg, const bench_size_t *size, frames_scene_t scene, int b_first) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return 1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return 1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        FILE *out = fdopen(fds[1], "w");
+        int result = out ? run_case(cfg, size, scene, out) : 1;
+        if (out) {
+            fclose(out);
+        }
+        _exit(result);
+    }
+
+    close(fds[1]);
+    char *json = NULL;
+    size_t len = 0;
+    size_t alloc = 0;
+    char buf[4096];
+    ssize_t got;
+    while ((got = read(fds[0], buf, sizeof(buf))) > 0) {
+        if (len + got + 1 > alloc) {
+            alloc = (len + got + 1) * 2;
+            char *grown = realloc(json, alloc);
+            if (!grown) {
+                break;
+            }
+            json = grown;
+        }
+        memcpy(json + len, buf, got);
+        len += got;
+    }
+    close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    int b_ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && len > 0;
+    if (b_ok) {
+        fprintf(stdout, "%s%.*s", b_first ? "" : ",\n", (int)len, json);
+    } else {
+        fprintf(stderr, "%s %s %s failed\n", frames_scene_name(scene), size->name, bench_mode_names[cfg->mode]);
+    }
+    free(json);
+    return !b_ok;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: bench [-n frames] [-r sizes] [-s scenes] [-t threads] [-p] [-d] [-i] [-e preset] [-g fps]\n"
+            "             [-m modes] [-x threads] [-a threads] [-f] [-b MB] [-l label]\n"
+            "  -n frames   frames per case, 60 by default\n"
+            "  -r sizes    comma separated from 480p,1080p,4k; all by default\n"
+            "  -s scenes   comma separated from ellipse,text,noise,static; all by default\n"
+            "  -t threads  conversion threads (i_convert_threads), 1 by default\n"
+            "  -p          pipelined sessions\n"
+            "  -d          skip duplicate frames\n"
+            "  -i          convert only changed tiles\n"
+            "  -e preset   x264 preset, veryfast by default\n"
+            "  -g fps      let the speed governor hold this many frames a second\n"
+            "  -m modes    comma separated from single,frame,sliced x264 threading, or live for live\n"
+            "              mode; single by default\n"
+            "  -x threads  x264 threads for the frame and sliced modes, 0 (one per CPU) by default\n"
+            "  -a threads  x264 lookahead threads, x264's choice by default\n"
+            "  -f          fast start: move the moov to the front when finishing\n"
+            "  -b MB       memory budget per session, e.g. 64 to see what fits the emscripten heap\n"
+            "  -l label    copied into the output, e.g. a commit hash\n");
+}
+
+// Parses a comma separated list of names into a bitmask of their indices in lookup.
+static int parse_list(const char *arg, int (*lookup)(const char *), unsigned *mask) {
+    char *copy = strdup(arg);
+    if (!copy) {
+        return 1;
+    }
+    *mask = 0;
+    int result = 0;
+    for (char *name = strtok(copy, ","); name; name = strtok(NULL, ",")) {
+        int i = lookup(name);
+        if (i < 0) {
+            fprintf(stderr, "Unknown name %s\n", name);
+            result = 1;
+            break;
+        }
+        *mask |= 1u << i;
+    }
+    free(copy);
+    return result;
+}
+
+static int mode_from_name(const char *name) {
+    for (int i = 0; i < BENCH_MODE_COUNT; i++) {
+        if (strcmp(name, bench_mode_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int size_from_name(const char *name) {
+    for (int i = 0; i < N_BENCH_SIZES; i++) {
+        if (strcmp(name, bench_sizes[i].name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    bench_config_t cfg = { 60, 0, 1, 0, 0, NULL, 0, BENCH_MODE_SINGLE, 0, 0, 0, 0 };
+    unsigned mode_mask = 1u << BENCH_MODE_SINGLE;
+    unsigned size_mask = (1u << N_BENCH_SIZES) - 1;
+    unsigned scene_mask = (1u << FRAMES_SCENE_COUNT) - 1;
+    const char *label = "";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:s:t:pdie:g:m:x:a:fb:l:")) != -1) {
+        switch (opt) {
+            case 'n': cfg.n_frames = atoi(optarg); break;
+            case 'r':
+                if (parse_list(optarg, size_from_name, &size_mask) != 0) {
+                    return 1;
+                }
+                break;
+            case 's':
+                if (parse_list(optarg, frames_scene_from_name, &scene_mask) != 0) {
+                    return 1;
+                }
+                break;
+            case 't': cfg.i_convert_threads = atoi(optarg); break;
+            case 'p': cfg.b_pipeline = 1; break;
+            case 'd': cfg.b_skip_duplicates = 1; break;
+            case 'i': cfg.b_incremental_convert = 1; break;
+            case 'e': cfg.preset = optarg; break;
+            case 'g': cfg.f_target_fps = atof(optarg); break;
+            case 'm':
+                if (parse_list(optarg, mode_from_name, &mode_mask) != 0) {
+                    return 1;
+                }
+                break;
+            case 'x': cfg.i_encoder_threads = atoi(optarg); break;
+            case 'a': cfg.i_lookahead_threads = atoi(optarg); break;
+            case 'f': cfg.b_fast_start = 1; break;
+            case 'b': cfg.i_memory_budget = (size_t)(atof(optarg) * 1024 * 1024); break;
+            case 'l': label = optarg; break;
+            default: usage(); return 1;
+        }
+    }
+    if (cfg.n_frames <= 0 || optind != argc) {
+        usage();
+        return 1;
+    }
+
+    printf("{\n  \"label\": ");
+    json_print_string(stdout, label);
+    printf(",\n  \"convert_backend\": \"%s\", \"convert_threads\": %d, \"pipeline\": %d, "
+           "\"skip_duplicates\": %d, \"incremental_convert\": %d, \"preset\": \"%s\", \"target_fps\": %.3f,\n"
+           "  \"encoder_threads\": %d, \"lookahead_threads\": %d, \"fast_start\": %d, \"memory_budget\": %zu,\n"
+           "  \"results\": [\n",
+           convert_backend_name(convert_get_backend()), cfg.i_convert_threads, cfg.b_pipeline,
+           cfg.b_skip_duplicates, cfg.b_incremental_convert, cfg.preset ? cfg.preset : "veryfast",
+           cfg.f_target_fps, cfg.i_encoder_threads, cfg.i_lookahead_threads, cfg.b_fast_start, cfg.i_memory_budget);
+
+    int n_failed = 0;
+    int b_first = 1;
+    for (int i = 0; i < N_BENCH_SIZES; i++) {
+        if (!(size_mask & (1u << i))) {
+            continue;
+        }
+        for (int scene = 0; scene < FRAMES_SCENE_COUNT; scene++) {
+            if (!(scene_mask & (1u << scene))) {
+                continue;
+            }
+            for (int mode = 0; mode < BENCH_MODE_COUNT; mode++) {
+                if (!(mode_mask & (1u << mode))) {
+                    continue;
+                }
+                cfg.mode = mode;
+                if (fork_case(&cfg, &bench_sizes[i], scene, b_first) != 0) {
+                    n_failed++;
+                } else {
+                    b_first = 0;
+                }
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    return n_failed ? 1 : 0;
+}
@@ -0,0 +1,565 @@
+#include "capture.h"
+#include "tiles.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 40
+#define CAPTURE_INDEX_OFFSET_POS 32
+#define CAPTURE_FRAME_HEADER_SIZE 12
+#define CAPTURE_RUN_HEADER_SIZE 12
+#define CAPTURE_INDEX_ENTRY_SIZE 16
+#define CAPTURE_FLAG_KEYFRAME 1
+#define CAPTURE_DEFAULT_KEYFRAME_INTERVAL 150
+// pixels one RLE count byte covers at most
+#define CAPTURE_RLE_MAX 128
+
+static const uint8_t capture_magic[4] = { 'R', 'C', 'A', 'P' };
+
+typedef struct {
+    uint64_t i_offset;
+    uint32_t i_size; // payload, after the frame header
+    uint32_t i_flags;
+} capture_index_t;
+
+struct capture_writer_t {
+    FILE *f;
+    int w;
+    int h;
+    int i_keyframe_interval;
+    int n_across;
+    int n_down;
+    int i_tiles;
+    uint64_t *hashes;
+    uint64_t *prev_hashes;
+    int b_hashes_valid;
+    uint8_t *dirty;
+    uint8_t *frame; // header and payload of the frame being written
+    size_t i_frame_alloc;
+    capture_index_t *index;
+    int n_frames;
+    int i_index_alloc;
+    uint64_t i_offset;
+    int b_failed;
+};
+
+struct capture_t {
+    FILE *f;
+    int w;
+    int h;
+    compression_format_t format;
+    int i_fps_num;
+    int i_fps_den;
+    int i_tile_size;
+    int n_across;
+    int n_down;
+    capture_index_t *index;
+    int n_frames;
+    uint8_t *payload;
+    size_t i_payload_alloc;
+    uint8_t *pixels; // decoded regions, back to back; at most a whole frame since runs don't overlap
+    size_t i_pixels_size;
+    compression_region_t *regions;
+    uint64_t i_bytes_read;
+};
+
+static void put_u16(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    put_u16(p, v);
+    put_u16(p + 2, v >> 16);
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t get_u16(const uint8_t *p) {
+    return p[0] | (uint32_t)p[1] << 8;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return get_u16(p) | get_u16(p + 2) << 16;
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    return get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+static int same_pixel(const uint8_t *a, const uint8_t *b) {
+    return memcmp(a, b, 4) == 0;
+}
+
+// Encodes a row of n pixels. Repeats of two or more become runs; everything else goes out as
+// literals, which stop where a repeat starts. Writes at most 5 * n bytes.
+static uint8_t *rle_encode_row(const uint8_t *src, int n, uint8_t *out) {
+    int i = 0;
+    while (i < n) {
+        int run = 1;
+        while (i + run < n && run < CAPTURE_RLE_MAX && same_pixel(src + (size_t)(i + run) * 4, src + (size_t)i * 4)) {
+            run++;
+        }
+        if (run > 1) {
+            *out++ = 0x80 | (run - 1);
+            memcpy(out, src + (size_t)i * 4, 4);
+            out += 4;
+            i += run;
+            continue;
+        }
+        int literals = 1;
+        while (i + literals < n && literals < CAPTURE_RLE_MAX
+               && !(i + literals + 1 < n && same_pixel(src + (size_t)(i + literals) * 4, src + (size_t)(i + literals + 1) * 4))) {
+            literals++;
+        }
+        *out++ = literals - 1;
+        memcpy(out, src + (size_t)i * 4, (size_t)literals * 4);
+        out += (size_t)literals * 4;
+        i += literals;
+    }
+    return out;
+}
+
+// Decodes a row of n pixels from *p, which mustn't run past end. Returns 0 if the data is bad.
+static int rle_decode_row(const uint8_t **p, const uint8_t *end, uint8_t *dst, int n) {
+    const uint8_t *in = *p;
+    int i = 0;
+    while (i < n) {
+        if (in == end) {
+            return 0;
+        }
+        int c = *in++;
+        int count = (c & 0x7f) + 1;
+        if (count > n - i) {
+            return 0;
+        }
+        if (c & 0x80) {
+            if (end - in < 4) {
+                return 0;
+            }
+            for (int j = 0; j < count; j++) {
+                memcpy(dst + (size_t)(i + j) * 4, in, 4);
+            }
+            in += 4;
+        } else {
+            if (end - in < count * 4) {
+                return 0;
+            }
+            memcpy(dst + (size_t)i * 4, in, (size_t)count * 4);
+            in += (size_t)count * 4;
+        }
+        i += count;
+    }
+    *p = in;
+    return 1;
+}
+
+// Pixel rectangle of a run of n tiles from (tx, ty); tiles on the right and bottom edges cover
+// whatever is left of the frame.
+static compression_rect_t run_rect(int tile_size, int w, int h, int tx, int ty, int n) {
+    compression_rect_t r;
+    r.x = tx * tile_size;
+    r.y = ty * tile_size;
+    r.w = ((tx + n) * tile_size < w ? (tx + n) * tile_size : w) - r.x;
+    r.h = (ty + 1) * tile_size < h ? tile_size : h - r.y;
+    return r;
+}
+
+capture_writer_t *capture_writer_open(const char *path, int w, int h, compression_format_t format,
+                                      int i_fps_num, int i_fps_den, int i_keyframe_interval) {
+    if (w <= 0 || h <= 0 || format == COMPRESSION_FORMAT_RGB24) {
+        fprintf(stderr, "Can't capture %dx%d frames in format %d\n", w, h, format);
+        return NULL;
+    }
+    capture_writer_t *writer = calloc(1, sizeof(capture_writer_t));
+    if (!writer) {
+        return NULL;
+    }
+    writer->w = w;
+    writer->h = h;
+    writer->i_keyframe_interval = i_keyframe_interval > 0 ? i_keyframe_interval : CAPTURE_DEFAULT_KEYFRAME_INTERVAL;
+    writer->n_across = tiles_across(w);
+    writer->n_down = tiles_down(h);
+    writer->i_tiles = writer->n_across * writer->n_down;
+    writer->hashes = malloc(writer->i_tiles * sizeof(uint64_t));
+    writer->prev_hashes = malloc(writer->i_tiles * sizeof(uint64_t));
+    writer->dirty = malloc(writer->i_tiles);
+    // a run per tile at worst, and every pixel a literal
+    writer->i_frame_alloc = CAPTURE_FRAME_HEADER_SIZE + (size_t)writer->i_tiles * CAPTURE_RUN_HEADER_SIZE + (size_t)w * h * 5;
+    writer->frame = malloc(writer->i_frame_alloc);
+    writer->f = fopen(path, "wb");
+    if (!writer->hashes || !writer->prev_hashes || !writer->dirty || !writer->frame || !writer->f) {
+        if (!writer->f) {
+            fprintf(stderr, "Can't create %s: %s\n", path, strerror(errno));
+        }
+        writer->b_failed = 1;
+        capture_writer_close(writer);
+        return NULL;
+    }
+
+    uint8_t header[CAPTURE_HEADER_SIZE] = { 0 };
+    memcpy(header, capture_magic, 4);
+    put_u32(header + 4, CAPTURE_VERSION);
+    put_u32(header + 8, w);
+    put_u32(header + 12, h);
+    put_u32(header + 16, i_fps_num > 0 ? i_fps_num : 15);
+    put_u32(header + 20, i_fps_den > 0 ? i_fps_den : 1);
+    put_u32(header + 24, format);
+    put_u32(header + 28, TILE_SIZE);
+    writer->b_failed = fwrite(header, sizeof(header), 1, writer->f) != 1;
+    writer->i_offset = CAPTURE_HEADER_SIZE;
+    return writer;
+}
+
+// Marks the tiles rects touch, clipped to the frame.
+static void writer_dirty_from_rects(capture_writer_t *writer, const compression_rect_t *rects, int n_rects) {
+    memset(writer->dirty, 0, writer->i_tiles);
+    for (int i = 0; i < n_rects; i++) {
+        int x0 = rects[i].x < 0 ? 0 : rects[i].x;
+        int y0 = rects[i].y < 0 ? 0 : rects[i].y;
+        int x1 = rects[i].x + rects[i].w > writer->w ? writer->w : rects[i].x + rects[i].w;
+        int y1 = rects[i].y + rects[i].h > writer->h ? writer->h : rects[i].y + rects[i].h;
+        for (int ty = y0 / TILE_SIZE; y0 < y1 && ty <= (y1 - 1) / TILE_SIZE; ty++) {
+            for (int tx = x0 / TILE_SIZE; x0 < x1 && tx <= (x1 - 1) / TILE_SIZE; tx++) {
+                writer->dirty[ty * writer->n_across + tx] = 1;
+            }
+        }
+    }
+}
+
+int capture_writer_add_frame(capture_writer_t *writer, const uint8_t *data, int stride,
+                             const compression_rect_t *rects, int n_rects) {
+    if (writer->b_failed) {
+        return 1;
+    }
+    int b_keyframe = writer->n_frames % writer->i_keyframe_interval == 0;
+
+    if (!rects) {
+        tiles_hash(data, stride, 4, writer->w, writer->h, 0, writer->n_down, writer->hashes);
+    }
+    if (rects && !b_keyframe) {
+        writer_dirty_from_rects(writer, rects, n_rects);
+    } else if (!rects && !b_keyframe && writer->b_hashes_valid) {
+        for (int i = 0; i < writer->i_tiles; i++) {
+            writer->dirty[i] = writer->hashes[i] != writer->prev_hashes[i];
+        }
+    } else {
+        memset(writer->dirty, 1, writer->i_tiles);
+    }
+    if (rects) {
+        // the previous hashes are of a frame before this one now
+        writer->b_hashes_valid = 0;
+    } else {
+        uint64_t *swap = writer->prev_hashes;
+        writer->prev_hashes = writer->hashes;
+        writer->hashes = swap;
+        writer->b_hashes_valid = 1;
+    }
+
+    uint8_t *out = writer->frame + CAPTURE_FRAME_HEADER_SIZE;
+    uint32_t n_runs = 0;
+    for (int ty = 0; ty < writer->n_down; ty++) {
+        const uint8_t *dirty = writer->dirty + (size_t)ty * writer->n_across;
+        for (int tx = 0; tx < writer->n_across; tx++) {
+            if (!dirty[tx]) {
+                continue;
+            }
+            int tx_end = tx + 1;
+            while (tx_end < writer->n_across && dirty[tx_end]) {
+                tx_end++;
+            }
+            compression_rect_t r = run_rect(TILE_SIZE, writer->w, writer->h, tx, ty, tx_end - tx);
+            uint8_t *run = out;
+            out += CAPTURE_RUN_HEADER_SIZE;
+            for (int y = r.y; y < r.y + r.h; y++) {
+                out = rle_encode_row(data + (size_t)y * stride + (size_t)r.x * 4, r.w, out);
+            }
+            put_u16(run, tx);
+            put_u16(run + 2, ty);
+            put_u16(run + 4, tx_end - tx);
+            put_u16(run + 6, 0);
+            put_u32(run + 8, (uint32_t)(out - run - CAPTURE_RUN_HEADER_SIZE));
+            n_runs++;
+            tx = tx_end;
+        }
+    }
+    uint32_t i_payload = (uint32_t)(out - writer->frame - CAPTURE_FRAME_HEADER_SIZE);
+    uint32_t i_flags = b_keyframe ? CAPTURE_FLAG_KEYFRAME : 0;
+    put_u32(writer->frame, i_flags);
+    put_u32(writer->frame + 4, n_runs);
+    put_u32(writer->frame + 8, i_payload);
+
+    if (writer->n_frames == writer->i_index_alloc) {
+        int i_alloc = writer->i_index_alloc ? writer->i_index_alloc * 2 : 1024;
+        capture_index_t *index = realloc(writer->index, i_alloc * sizeof(capture_index_t));
+        if (!index) {
+            writer->b_failed = 1;
+            return 1;
+        }
+        writer->index = index;
+        writer->i_index_alloc = i_alloc;
+    }
+    size_t i_size = CAPTURE_FRAME_HEADER_SIZE + i_payload;
+    if (fwrite(writer->frame, 1, i_size, writer->f) != i_size) {
+        writer->b_failed = 1;
+        return 1;
+    }
+    capture_index_t *entry = &writer->index[writer->n_frames++];
+    entry->i_offset = writer->i_offset;
+    entry->i_size = i_payload;
+    entry->i_flags = i_flags;
+    writer->i_offset += i_size;
+    return 0;
+}
+
+int capture_writer_close(capture_writer_t *writer) {
+    if (!writer) {
+        return 1;
+    }
+    int b_failed = writer->b_failed;
+    if (writer->f && !b_failed) {
+        uint8_t entry[CAPTURE_INDEX_ENTRY_SIZE];
+        put_u32(entry, writer->n_frames);
+        b_failed |= fwrite(entry, 4, 1, writer->f) != 1;
+        for (int i = 0; i < writer->n_frames && !b_failed; i++) {
+            put_u64(entry, writer->index[i].i_offset);
+            put_u32(entry + 8, writer->index[i].i_size);
+            put_u32(entry + 12, writer->index[i].i_flags);
+            b_failed |= fwrite(entry, sizeof(entry), 1, writer->f) != 1;
+        }
+        // the index is only pointed to once it's all there
+        uint8_t offset[8];
+        put_u64(offset, writer->i_offset);
+        b_failed |= fflush(writer->f) != 0
+                  || fseeko(writer->f, CAPTURE_INDEX_OFFSET_POS, SEEK_SET) != 0
+                  || fwrite(offset, sizeof(offset), 1, writer->f) != 1;
+    }
+    if (writer->f) {
+        b_failed |= fclose(writer->f) != 0;
+    }
+    free(writer->hashes);
+    free(writer->prev_hashes);
+    free(writer->dirty);
+    free(writer->frame);
+    free(writer->index);
+    free(writer);
+    return b_failed;
+}
+
+static int read_exactly(capture_t *capture, uint8_t *buf, size_t len) {
+    size_t got = fread(buf, 1, len, capture->f);
+    capture->i_bytes_read += got;
+    return got == len;
+}
+
+// Reads the index the writer left at index_offset.
+static int load_index(capture_t *capture, uint64_t i_index_offset) {
+    uint8_t entry[CAPTURE_INDEX_ENTRY_SIZE];
+    if (fseeko(capture->f, (off_t)i_index_offset, SEEK_SET) != 0 || !read_exactly(capture, entry, 4)) {
+        return 0;
+    }
+    capture->n_frames = get_u32(entry);
+    if (capture->n_frames < 0) {
+        return 0;
+    }
+    capture->index = calloc(capture->n_frames ? capture->n_frames : 1, sizeof(capture_index_t));
+    if (!capture->index) {
+        return 0;
+    }
+    for (int i = 0; i < capture->n_frames; i++) {
+        if (!read_exactly(capture, entry, sizeof(entry))) {
+            return 0;
+        }
+        capture->index[i].i_offset = get_u64(entry);
+        capture->index[i].i_size = get_u32(entry + 8);
+        capture->index[i].i_flags = get_u32(entry + 12);
+    }
+    return 1;
+}
+
+// Rebuilds the index of a file whose writer never closed it, stopping at the first frame that
+// isn't all there.
+static int scan_index(capture_t *capture) {
+    uint64_t i_offset = CAPTURE_HEADER_SIZE;
+    int i_alloc = 0;
+    uint8_t header[CAPTURE_FRAME_HEADER_SIZE];
+
+    fseeko(capture->f, 0, SEEK_END);
+    uint64_t i_file_size = (uint64_t)ftello(capture->f);
+    while (fseeko(capture->f, (off_t)i_offset, SEEK_SET) == 0 && read_exactly(capture, header, sizeof(header))) {
+        uint32_t i_size = get_u32(header + 8);
+        if (i_offset + sizeof(header) + i_size > i_file_size) {
+            break;
+        }
+        if (capture->n_frames == i_alloc) {
+            i_alloc = i_alloc ? i_alloc * 2 : 1024;
+            capture_index_t *index = realloc(capture->index, i_alloc * sizeof(capture_index_t));
+            if (!index) {
+                return 0;
+            }
+            capture->index = index;
+        }
+        capture_index_t *entry = &capture->index[capture->n_frames++];
+        entry->i_offset = i_offset;
+        entry->i_size = i_size;
+        entry->i_flags = get_u32(header);
+        i_offset += sizeof(header) + i_size;
+    }
+    return 1;
+}
+
+capture_t *capture_open(const char *path) {
+    capture_t *capture = calloc(1, sizeof(capture_t));
+    if (!capture) {
+        return NULL;
+    }
+    capture->f = fopen(path, "rb");
+    if (!capture->f) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        capture_close(capture);
+        return NULL;
+    }
+
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    if (!read_exactly(capture, header, sizeof(header)) || memcmp(header, capture_magic, 4) != 0
+        || get_u32(header + 4) != CAPTURE_VERSION) {
+        fprintf(stderr, "%s isn't a capture file\n", path);
+        capture_close(capture);
+        return NULL;
+    }
+    capture->w = get_u32(header + 8);
+    capture->h = get_u32(header + 12);
+    capture->i_fps_num = get_u32(header + 16);
+    capture->i_fps_den = get_u32(header + 20);
+    capture->format = get_u32(header + 24);
+    capture->i_tile_size = get_u32(header + 28);
+    uint64_t i_index_offset = get_u64(header + CAPTURE_INDEX_OFFSET_POS);
+    if (capture->w <= 0 || capture->h <= 0 || capture->i_tile_size <= 0 || capture->i_tile_size & 1
+        || capture->format == COMPRESSION_FORMAT_RGB24 || capture->format > COMPRESSION_FORMAT_RGB24) {
+        fprintf(stderr, "%s has a bad header\n", path);
+        capture_close(capture);
+        return NULL;
+    }
+    capture->n_across = (capture->w + capture->i_tile_size - 1) / capture->i_tile_size;
+    capture->n_down = (capture->h + capture->i_tile_size - 1) / capture->i_tile_size;
+
+    int b_index = i_index_offset ? load_index(capture, i_index_offset) : scan_index(capture);
+    capture->i_pixels_size = (size_t)capture->w * capture->h * 4;
+    capture->pixels = malloc(capture->i_pixels_size);
+    capture->regions = malloc((size_t)capture->n_across * capture->n_down * sizeof(compression_region_t));
+    if (!b_index || !capture->pixels || !capture->regions) {
+        fprintf(stderr, "Can't read the index of %s\n", path);
+        capture_close(capture);
+        return NULL;
+    }
+    return capture;
+}
+
+void capture_info(const capture_t *capture, int *w, int *h, compression_format_t *format,
+                  int *i_fps_num, int *i_fps_den) {
+    *w = capture->w;
+    *h = capture->h;
+    *format = capture->format;
+    *i_fps_num = capture->i_fps_num;
+    *i_fps_den = capture->i_fps_den;
+}
+
+int capture_frame_count(const capture_t *capture) {
+    return capture->n_frames;
+}
+
+int capture_keyframe_before(const capture_t *capture, int i_frame) {
+    if (i_frame >= capture->n_frames) {
+        i_frame = capture->n_frames - 1;
+    }
+    while (i_frame > 0 && !(capture->index[i_frame].i_flags & CAPTURE_FLAG_KEYFRAME)) {
+        i_frame--;
+    }
+    return i_frame > 0 ? i_frame : 0;
+}
+
+int capture_read_frame(capture_t *capture, int i_frame, const compression_region_t **regions, int *n_regions) {
+    if (i_frame < 0 || i_frame >= capture->n_frames) {
+        return 1;
+    }
+    const capture_index_t *entry = &capture->index[i_frame];
+    size_t i_size = CAPTURE_FRAME_HEADER_SIZE + (size_t)entry->i_size;
+    if (i_size > capture->i_payload_alloc) {
+        uint8_t *payload = realloc(capture->payload, i_size);
+        if (!payload) {
+            return 1;
+        }
+        capture->payload = payload;
+        capture->i_payload_alloc = i_size;
+    }
+    if (fseeko(capture->f, (off_t)entry->i_offset, SEEK_SET) != 0 || !read_exactly(capture, capture->payload, i_size)) {
+        return 1;
+    }
+
+    uint32_t n_runs = get_u32(capture->payload + 4);
+    if (get_u32(capture->payload + 8) != entry->i_size || n_runs > (uint32_t)(capture->n_across * capture->n_down)) {
+        return 1;
+    }
+    const uint8_t *p = capture->payload + CAPTURE_FRAME_HEADER_SIZE;
+    const uint8_t *end = capture->payload + i_size;
+    uint8_t *pixels = capture->pixels;
+    size_t i_pixels_left = capture->i_pixels_size;
+    for (uint32_t i = 0; i < n_runs; i++) {
+        if (end - p < CAPTURE_RUN_HEADER_SIZE) {
+            return 1;
+        }
+        int tx = get_u16(p);
+        int ty = get_u16(p + 2);
+        int n = get_u16(p + 4);
+        uint32_t i_data_size = get_u32(p + 8);
+        p += CAPTURE_RUN_HEADER_SIZE;
+        if (n <= 0 || tx + n > capture->n_across || ty >= capture->n_down || i_data_size > (size_t)(end - p)) {
+            return 1;
+        }
+        compression_region_t *region = &capture->regions[i];
+        region->rect = run_rect(capture->i_tile_size, capture->w, capture->h, tx, ty, n);
+        region->stride = region->rect.w * 4;
+        region->data = pixels;
+        size_t i_region_size = (size_t)region->stride * region->rect.h;
+        if (i_region_size > i_pixels_left) {
+            return 1;
+        }
+        const uint8_t *data_end = p + i_data_size;
+        for (int y = 0; y < region->rect.h; y++) {
+            if (!rle_decode_row(&p, data_end, pixels + (size_t)y * region->stride, region->rect.w)) {
+                return 1;
+            }
+        }
+        p = data_end;
+        pixels += i_region_size;
+        i_pixels_left -= i_region_size;
+    }
+    *regions = capture->regions;
+    *n_regions = (int)n_runs;
+    return 0;
+}
+
+uint64_t capture_bytes_read(const capture_t *capture) {
+    return capture->i_bytes_read;
+}
+
+void capture_close(capture_t *capture) {
+    if (!capture) {
+        return;
+    }
+    if (capture->f) {
+        fclose(capture->f);
+    }
+    free(capture->index);
+    free(capture->payload);
+    free(capture->pixels);
+    free(capture->regions);
+    free(capture);
+}
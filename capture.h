@@ -0,0 +1,65 @@
+#ifndef RAW2MP4_CAPTURE_H
+#define RAW2MP4_CAPTURE_H
+
+#include <stdint.h>
+
+#include "raw2mp4.h"
+
+// Capture files: a screen recording in one file, holding for each frame only the tiles that
+// changed since the one before, instead of a full w * h * 4 byte frame.
+//
+// The file starts with a header, then the frames, then an index of where each frame is, so any
+// frame can be found without reading the ones before it. A frame is a list of runs, each run a
+// horizontal strip of changed TILE_SIZE x TILE_SIZE tiles within one row of tiles, and each run's
+// pixels are run length encoded: flat areas, which screens are mostly made of, shrink to a few
+// bytes, and decoding is a copy loop. Every so often a keyframe holds every tile, so decoding can
+// start there. All numbers are little endian.
+//
+//     header  "RCAP", version, width, height, fps_num, fps_den, format, tile_size (u32 each),
+//             index_offset (u64, 0 until the file is closed)
+//     frame   flags (1 = keyframe), n_runs, payload_size (u32 each), then n_runs of:
+//     run     tile_x, tile_y, n_tiles, 0 (u16 each), data_size (u32), then data_size bytes of
+//             RLE, which is a sequence of a count byte c followed by, when c & 0x80, one pixel
+//             repeated (c & 0x7f) + 1 times, or else c + 1 literal pixels
+//     index   n_frames (u32), then per frame its offset (u64), payload_size and flags (u32 each)
+//
+// A file whose writer never closed it has no index; the reader rebuilds it by walking the frames.
+
+typedef struct capture_writer_t capture_writer_t;
+
+// Writes w x h frames in format, which must be a 4 byte one, timed at fps_num / fps_den. Every
+// i_keyframe_interval frames is a keyframe, 0 for the default of 150. Returns NULL if the file
+// can't be created.
+capture_writer_t *capture_writer_open(const char *path, int w, int h, compression_format_t format,
+                                      int i_fps_num, int i_fps_den, int i_keyframe_interval);
+
+// Adds a frame, rows stride bytes apart. When the capture source knows what changed, rects lists
+// it and only those tiles are looked at; with rects NULL, changes are found by comparing tile
+// hashes with the previous frame. n_rects == 0 means nothing changed. Returns 0 on success.
+int capture_writer_add_frame(capture_writer_t *writer, const uint8_t *data, int stride,
+                             const compression_rect_t *rects, int n_rects);
+
+// Writes the index and closes the file. Returns 0 on success, and frees the writer either way.
+int capture_writer_close(capture_writer_t *writer);
+
+// Opens a capture for reading. Returns NULL, saying why on stderr, if it isn't one.
+capture_t *capture_open(const char *path);
+
+void capture_info(const capture_t *capture, int *w, int *h, compression_format_t *format,
+                  int *i_fps_num, int *i_fps_den);
+int capture_frame_count(const capture_t *capture);
+
+// The latest keyframe at or before i_frame, where decoding has to start to get i_frame right.
+int capture_keyframe_before(const capture_t *capture, int i_frame);
+
+// Decodes frame i_frame into the regions that changed since frame i_frame - 1, or into the whole
+// frame for a keyframe. The regions are tile aligned, don't overlap and point into the capture's
+// own buffer, valid until the next call. Returns 0 on success.
+int capture_read_frame(capture_t *capture, int i_frame, const compression_region_t **regions, int *n_regions);
+
+// Bytes read from the file so far.
+uint64_t capture_bytes_read(const capture_t *capture);
+
+void capture_close(capture_t *capture);
+
+#endif
@@ -0,0 +1,589 @@
+#include "convert.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define CONVERT_HAVE_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__wasm_simd128__)
+#define CONVERT_HAVE_WASM_SIMD 1
+#include <wasm_simd128.h>
+#endif
+
+// Coefficients. Luma is (77 R + 150 G + 29 B + 128) >> 8, which peaks at 65408 and so fits an
+// unsigned 16 bit lane. Chroma is computed from the 2x2 averaged R, G, B with 7 bit coefficients
+// and a bias of 128 << 7 plus rounding, which keeps every intermediate in [128, 32768]; the final
+// value can reach 256 and is saturated to 255.
+#define Y_R 77
+#define Y_G 150
+#define Y_B 29
+#define Y_ROUND 128
+
+#define U_R 22
+#define U_G 42
+#define U_B 64
+#define V_R 64
+#define V_G 54
+#define V_B 10
+#define UV_BIAS ((128 << 7) + 64)
+
+// Byte offsets of R, G and B within a 4 byte pixel.
+typedef struct {
+    int r;
+    int g;
+    int b;
+} swizzle_t;
+
+static const swizzle_t swizzle_rgba = { 0, 1, 2 };
+static const swizzle_t swizzle_bgra = { 2, 1, 0 };
+static const swizzle_t swizzle_argb = { 1, 2, 3 };
+
+// Converts one pair of 4 byte per pixel source rows into two luma rows and one row of each
+// chroma plane.
+typedef void (*convert_rows_fn)(const uint8_t *src0, const uint8_t *src1,
+                                uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                                int x, int w, const swizzle_t *sw);
+
+static inline uint8_t luma(const uint8_t *p, const swizzle_t *sw) {
+    return (uint8_t)((Y_R * p[sw->r] + Y_G * p[sw->g] + Y_B * p[sw->b] + Y_ROUND) >> 8);
+}
+
+static inline uint8_t sat_u8(int v) {
+    return v > 255 ? 255 : (uint8_t)v;
+}
+
+// Handles columns [x, w) one 2x2 block at a time. Also used by the SIMD kernels for the tail.
+static void convert_rows_scalar(const uint8_t *src0, const uint8_t *src1,
+                                uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                                int x, int w, const swizzle_t *sw) {
+    for (; x < w; x += 2) {
+        const uint8_t *a = src0 + x * 4;
+        const uint8_t *b = src1 + x * 4;
+
+        y0[x]     = luma(a, sw);
+        y0[x + 1] = luma(a + 4, sw);
+        y1[x]     = luma(b, sw);
+        y1[x + 1] = luma(b + 4, sw);
+
+        int r = (a[sw->r] + a[sw->r + 4] + b[sw->r] + b[sw->r + 4] + 2) >> 2;
+        int g = (a[sw->g] + a[sw->g + 4] + b[sw->g] + b[sw->g + 4] + 2) >> 2;
+        int bl = (a[sw->b] + a[sw->b + 4] + b[sw->b] + b[sw->b + 4] + 2) >> 2;
+
+        u[x / 2] = sat_u8((U_B * bl - U_R * r - U_G * g + UV_BIAS) >> 7);
+        v[x / 2] = sat_u8((V_R * r - V_G * g - V_B * bl + UV_BIAS) >> 7);
+    }
+}
+
+#if CONVERT_HAVE_X86
+
+// Per channel shift counts for _mm_srl_epi32 and friends.
+typedef struct {
+    __m128i r;
+    __m128i g;
+    __m128i b;
+} sse2_shifts_t;
+
+static inline sse2_shifts_t sse2_shifts(const swizzle_t *sw) {
+    sse2_shifts_t shifts = { _mm_cvtsi32_si128(sw->r * 8), _mm_cvtsi32_si128(sw->g * 8), _mm_cvtsi32_si128(sw->b * 8) };
+    return shifts;
+}
+
+// Splits 8 pixels into R, G, B as 8 x 16 bit lanes.
+static inline void sse2_load8(const uint8_t *p, const sse2_shifts_t *sh, __m128i *r, __m128i *g, __m128i *b) {
+    const __m128i mask = _mm_set1_epi32(0xff);
+    __m128i lo = _mm_loadu_si128((const __m128i *)p);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(p + 16));
+    *r = _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(lo, sh->r), mask), _mm_and_si128(_mm_srl_epi32(hi, sh->r), mask));
+    *g = _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(lo, sh->g), mask), _mm_and_si128(_mm_srl_epi32(hi, sh->g), mask));
+    *b = _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(lo, sh->b), mask), _mm_and_si128(_mm_srl_epi32(hi, sh->b), mask));
+}
+
+static inline __m128i sse2_luma8(__m128i r, __m128i g, __m128i b) {
+    __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(Y_R)), _mm_mullo_epi16(g, _mm_set1_epi16(Y_G)));
+    y = _mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(Y_B)));
+    return _mm_srli_epi16(_mm_add_epi16(y, _mm_set1_epi16(Y_ROUND)), 8);
+}
+
+// Sums horizontally adjacent pairs of two 8 lane vectors: 16 pixels in, 8 pair sums out.
+static inline __m128i sse2_pairs(__m128i a, __m128i b) {
+    const __m128i ones = _mm_set1_epi16(1);
+    return _mm_packs_epi32(_mm_madd_epi16(a, ones), _mm_madd_epi16(b, ones));
+}
+
+static void convert_rows_sse2(const uint8_t *src0, const uint8_t *src1,
+                              uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                              int x, int w, const swizzle_t *sw) {
+    const sse2_shifts_t sh = sse2_shifts(sw);
+    for (; x + 16 <= w; x += 16) {
+        __m128i r0a, g0a, b0a, r0b, g0b, b0b, r1a, g1a, b1a, r1b, g1b, b1b;
+        sse2_load8(src0 + x * 4, &sh, &r0a, &g0a, &b0a);
+        sse2_load8(src0 + x * 4 + 32, &sh, &r0b, &g0b, &b0b);
+        sse2_load8(src1 + x * 4, &sh, &r1a, &g1a, &b1a);
+        sse2_load8(src1 + x * 4 + 32, &sh, &r1b, &g1b, &b1b);
+
+        _mm_storeu_si128((__m128i *)(y0 + x), _mm_packus_epi16(sse2_luma8(r0a, g0a, b0a), sse2_luma8(r0b, g0b, b0b)));
+        _mm_storeu_si128((__m128i *)(y1 + x), _mm_packus_epi16(sse2_luma8(r1a, g1a, b1a), sse2_luma8(r1b, g1b, b1b)));
+
+        const __m128i two = _mm_set1_epi16(2);
+        __m128i r = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(sse2_pairs(r0a, r0b), sse2_pairs(r1a, r1b)), two), 2);
+        __m128i g = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(sse2_pairs(g0a, g0b), sse2_pairs(g1a, g1b)), two), 2);
+        __m128i b = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(sse2_pairs(b0a, b0b), sse2_pairs(b1a, b1b)), two), 2);
+
+        const __m128i bias = _mm_set1_epi16(UV_BIAS);
+        __m128i cu = _mm_sub_epi16(_mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(U_B)), bias),
+                                   _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(U_R)), _mm_mullo_epi16(g, _mm_set1_epi16(U_G))));
+        __m128i cv = _mm_sub_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(V_R)), bias),
+                                   _mm_add_epi16(_mm_mullo_epi16(g, _mm_set1_epi16(V_G)), _mm_mullo_epi16(b, _mm_set1_epi16(V_B))));
+        __m128i uv = _mm_packus_epi16(_mm_srli_epi16(cu, 7), _mm_srli_epi16(cv, 7));
+        _mm_storel_epi64((__m128i *)(u + x / 2), uv);
+        _mm_storel_epi64((__m128i *)(v + x / 2), _mm_srli_si128(uv, 8));
+    }
+    convert_rows_scalar(src0, src1, y0, y1, u, v, x, w, sw);
+}
+
+#define AVX2_FN __attribute__((target("avx2")))
+
+// Splits 16 pixels into R, G, B as 16 x 16 bit lanes in pixel order.
+static inline AVX2_FN void avx2_load16(const uint8_t *p, const sse2_shifts_t *sh, __m256i *r, __m256i *g, __m256i *b) {
+    const __m256i mask = _mm256_set1_epi32(0xff);
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    // packs works per 128 bit lane; the permute puts the quadwords back in pixel order
+    *r = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_and_si256(_mm256_srl_epi32(lo, sh->r), mask),
+                                                     _mm256_and_si256(_mm256_srl_epi32(hi, sh->r), mask)), 0xd8);
+    *g = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_and_si256(_mm256_srl_epi32(lo, sh->g), mask),
+                                                     _mm256_and_si256(_mm256_srl_epi32(hi, sh->g), mask)), 0xd8);
+    *b = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_and_si256(_mm256_srl_epi32(lo, sh->b), mask),
+                                                     _mm256_and_si256(_mm256_srl_epi32(hi, sh->b), mask)), 0xd8);
+}
+
+static inline AVX2_FN __m256i avx2_luma16(__m256i r, __m256i g, __m256i b) {
+    __m256i y = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(Y_R)), _mm256_mullo_epi16(g, _mm256_set1_epi16(Y_G)));
+    y = _mm256_add_epi16(y, _mm256_mullo_epi16(b, _mm256_set1_epi16(Y_B)));
+    return _mm256_srli_epi16(_mm256_add_epi16(y, _mm256_set1_epi16(Y_ROUND)), 8);
+}
+
+static inline AVX2_FN __m256i avx2_pairs(__m256i a, __m256i b) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    return _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_madd_epi16(a, ones), _mm256_madd_epi16(b, ones)), 0xd8);
+}
+
+static AVX2_FN void convert_rows_avx2(const uint8_t *src0, const uint8_t *src1,
+                                      uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                                      int x, int w, const swizzle_t *sw) {
+    const sse2_shifts_t sh = sse2_shifts(sw);
+    for (; x + 32 <= w; x += 32) {
+        __m256i r0a, g0a, b0a, r0b, g0b, b0b, r1a, g1a, b1a, r1b, g1b, b1b;
+        avx2_load16(src0 + x * 4, &sh, &r0a, &g0a, &b0a);
+        avx2_load16(src0 + x * 4 + 64, &sh, &r0b, &g0b, &b0b);
+        avx2_load16(src1 + x * 4, &sh, &r1a, &g1a, &b1a);
+        avx2_load16(src1 + x * 4 + 64, &sh, &r1b, &g1b, &b1b);
+
+        __m256i ya = _mm256_packus_epi16(avx2_luma16(r0a, g0a, b0a), avx2_luma16(r0b, g0b, b0b));
+        __m256i yb = _mm256_packus_epi16(avx2_luma16(r1a, g1a, b1a), avx2_luma16(r1b, g1b, b1b));
+        _mm256_storeu_si256((__m256i *)(y0 + x), _mm256_permute4x64_epi64(ya, 0xd8));
+        _mm256_storeu_si256((__m256i *)(y1 + x), _mm256_permute4x64_epi64(yb, 0xd8));
+
+        const __m256i two = _mm256_set1_epi16(2);
+        __m256i r = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(avx2_pairs(r0a, r0b), avx2_pairs(r1a, r1b)), two), 2);
+        __m256i g = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(avx2_pairs(g0a, g0b), avx2_pairs(g1a, g1b)), two), 2);
+        __m256i b = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(avx2_pairs(b0a, b0b), avx2_pairs(b1a, b1b)), two), 2);
+
+        const __m256i bias = _mm256_set1_epi16(UV_BIAS);
+        __m256i cu = _mm256_sub_epi16(_mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(U_B)), bias),
+                                      _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(U_R)), _mm256_mullo_epi16(g, _mm256_set1_epi16(U_G))));
+        __m256i cv = _mm256_sub_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(V_R)), bias),
+                                      _mm256_add_epi16(_mm256_mullo_epi16(g, _mm256_set1_epi16(V_G)), _mm256_mullo_epi16(b, _mm256_set1_epi16(V_B))));
+        __m256i uv = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(cu, 7), _mm256_srli_epi16(cv, 7)), 0xd8);
+        _mm_storeu_si128((__m128i *)(u + x / 2), _mm256_castsi256_si128(uv));
+        _mm_storeu_si128((__m128i *)(v + x / 2), _mm256_extracti128_si256(uv, 1));
+    }
+    convert_rows_sse2(src0, src1, y0, y1, u, v, x, w, sw);
+}
+
+#endif // CONVERT_HAVE_X86
+
+#if CONVERT_HAVE_WASM_SIMD
+
+static inline void wasm_load8(const uint8_t *p, const swizzle_t *sw, v128_t *r, v128_t *g, v128_t *b) {
+    const v128_t mask = wasm_i32x4_splat(0xff);
+    v128_t lo = wasm_v128_load(p);
+    v128_t hi = wasm_v128_load(p + 16);
+    *r = wasm_i16x8_narrow_i32x4(wasm_v128_and(wasm_u32x4_shr(lo, sw->r * 8), mask), wasm_v128_and(wasm_u32x4_shr(hi, sw->r * 8), mask));
+    *g = wasm_i16x8_narrow_i32x4(wasm_v128_and(wasm_u32x4_shr(lo, sw->g * 8), mask), wasm_v128_and(wasm_u32x4_shr(hi, sw->g * 8), mask));
+    *b = wasm_i16x8_narrow_i32x4(wasm_v128_and(wasm_u32x4_shr(lo, sw->b * 8), mask), wasm_v128_and(wasm_u32x4_shr(hi, sw->b * 8), mask));
+}
+
+static inline v128_t wasm_luma8(v128_t r, v128_t g, v128_t b) {
+    v128_t y = wasm_i16x8_add(wasm_i16x8_mul(r, wasm_i16x8_splat(Y_R)), wasm_i16x8_mul(g, wasm_i16x8_splat(Y_G)));
+    y = wasm_i16x8_add(y, wasm_i16x8_mul(b, wasm_i16x8_splat(Y_B)));
+    return wasm_u16x8_shr(wasm_i16x8_add(y, wasm_i16x8_splat(Y_ROUND)), 8);
+}
+
+static inline v128_t wasm_pairs(v128_t a, v128_t b) {
+    return wasm_i16x8_narrow_i32x4(wasm_i32x4_extadd_pairwise_i16x8(a), wasm_i32x4_extadd_pairwise_i16x8(b));
+}
+
+static void convert_rows_wasm(const uint8_t *src0, const uint8_t *src1,
+                              uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                              int x, int w, const swizzle_t *sw) {
+    for (; x + 16 <= w; x += 16) {
+        v128_t r0a, g0a, b0a, r0b, g0b, b0b, r1a, g1a, b1a, r1b, g1b, b1b;
+        wasm_load8(src0 + x * 4, sw, &r0a, &g0a, &b0a);
+        wasm_load8(src0 + x * 4 + 32, sw, &r0b, &g0b, &b0b);
+        wasm_load8(src1 + x * 4, sw, &r1a, &g1a, &b1a);
+        wasm_load8(src1 + x * 4 + 32, sw, &r1b, &g1b, &b1b);
+
+        wasm_v128_store(y0 + x, wasm_u8x16_narrow_i16x8(wasm_luma8(r0a, g0a, b0a), wasm_luma8(r0b, g0b, b0b)));
+        wasm_v128_store(y1 + x, wasm_u8x16_narrow_i16x8(wasm_luma8(r1a, g1a, b1a), wasm_luma8(r1b, g1b, b1b)));
+
+        const v128_t two = wasm_i16x8_splat(2);
+        v128_t r = wasm_u16x8_shr(wasm_i16x8_add(wasm_i16x8_add(wasm_pairs(r0a, r0b), wasm_pairs(r1a, r1b)), two), 2);
+        v128_t g = wasm_u16x8_shr(wasm_i16x8_add(wasm_i16x8_add(wasm_pairs(g0a, g0b), wasm_pairs(g1a, g1b)), two), 2);
+        v128_t b = wasm_u16x8_shr(wasm_i16x8_add(wasm_i16x8_add(wasm_pairs(b0a, b0b), wasm_pairs(b1a, b1b)), two), 2);
+
+        const v128_t bias = wasm_i16x8_splat(UV_BIAS);
+        v128_t cu = wasm_i16x8_sub(wasm_i16x8_add(wasm_i16x8_mul(b, wasm_i16x8_splat(U_B)), bias),
+                                   wasm_i16x8_add(wasm_i16x8_mul(r, wasm_i16x8_splat(U_R)), wasm_i16x8_mul(g, wasm_i16x8_splat(U_G))));
+        v128_t cv = wasm_i16x8_sub(wasm_i16x8_add(wasm_i16x8_mul(r, wasm_i16x8_splat(V_R)), bias),
+                                   wasm_i16x8_add(wasm_i16x8_mul(g, wasm_i16x8_splat(V_G)), wasm_i16x8_mul(b, wasm_i16x8_splat(V_B))));
+        v128_t uv = wasm_u8x16_narrow_i16x8(wasm_u16x8_shr(cu, 7), wasm_u16x8_shr(cv, 7));
+        wasm_v128_store64_lane(u + x / 2, uv, 0);
+        wasm_v128_store64_lane(v + x / 2, uv, 1);
+    }
+    convert_rows_scalar(src0, src1, y0, y1, u, v, x, w, sw);
+}
+
+#endif // CONVERT_HAVE_WASM_SIMD
+
+static convert_backend_t selected_backend = CONVERT_BACKEND_AUTO;
+static convert_rows_fn selected_rows;
+
+int convert_backend_available(convert_backend_t backend) {
+    switch (backend) {
+        case CONVERT_BACKEND_AUTO:
+        case CONVERT_BACKEND_SCALAR:
+            return 1;
+#if CONVERT_HAVE_X86
+        case CONVERT_BACKEND_SSE2:
+            return 1;
+        case CONVERT_BACKEND_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+#if CONVERT_HAVE_WASM_SIMD
+        case CONVERT_BACKEND_WASM_SIMD128:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+const char *convert_backend_name(convert_backend_t backend) {
+    switch (backend) {
+        case CONVERT_BACKEND_AUTO: return "auto";
+        case CONVERT_BACKEND_SCALAR: return "scalar";
+        case CONVERT_BACKEND_SSE2: return "sse2";
+        case CONVERT_BACKEND_AVX2: return "avx2";
+        case CONVERT_BACKEND_WASM_SIMD128: return "wasm-simd128";
+        default: return "unknown";
+    }
+}
+
+int convert_set_backend(convert_backend_t backend) {
+    if (!convert_backend_available(backend)) {
+        return 1;
+    }
+
+    if (backend == CONVERT_BACKEND_AUTO) {
+        backend = CONVERT_BACKEND_SCALAR;
+        for (int b = CONVERT_BACKEND_SSE2; b < CONVERT_BACKEND_COUNT; b++) {
+            if (convert_backend_available(b)) {
+                backend = b;
+            }
+        }
+    }
+
+    switch (backend) {
+#if CONVERT_HAVE_X86
+        case CONVERT_BACKEND_SSE2: selected_rows = convert_rows_sse2; break;
+        case CONVERT_BACKEND_AVX2: selected_rows = convert_rows_avx2; break;
+#endif
+#if CONVERT_HAVE_WASM_SIMD
+        case CONVERT_BACKEND_WASM_SIMD128: selected_rows = convert_rows_wasm; break;
+#endif
+        default: selected_rows = convert_rows_scalar; break;
+    }
+    selected_backend = backend;
+    return 0;
+}
+
+convert_backend_t convert_get_backend(void) {
+    if (!selected_rows) {
+        convert_set_backend(CONVERT_BACKEND_AUTO);
+    }
+    return selected_backend;
+}
+
+// RGB24 rows are widened to RGBA this many pixels at a time so the 4 byte kernels can run on them.
+#define RGB24_CHUNK 256
+
+static void convert_rows_rgb24(const uint8_t *src0, const uint8_t *src1,
+                               uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int w) {
+    uint8_t rgba0[RGB24_CHUNK * 4];
+    uint8_t rgba1[RGB24_CHUNK * 4];
+
+    for (int x = 0; x < w; x += RGB24_CHUNK) {
+        int n = w - x < RGB24_CHUNK ? w - x : RGB24_CHUNK;
+        for (int i = 0; i < n; i++) {
+            const uint8_t *a = src0 + (size_t)(x + i) * 3;
+            const uint8_t *b = src1 + (size_t)(x + i) * 3;
+            rgba0[i * 4] = a[0];
+            rgba0[i * 4 + 1] = a[1];
+            rgba0[i * 4 + 2] = a[2];
+            rgba0[i * 4 + 3] = 0xff;
+            rgba1[i * 4] = b[0];
+            rgba1[i * 4 + 1] = b[1];
+            rgba1[i * 4 + 2] = b[2];
+            rgba1[i * 4 + 3] = 0xff;
+        }
+        selected_rows(rgba0, rgba1, y0 + x, y1 + x, u + x / 2, v + x / 2, 0, n, &swizzle_rgba);
+    }
+}
+
+void convert_packed_to_i420(const uint8_t *src, int src_stride, convert_format_t format,
+                            uint8_t *const plane[3], const int stride[3],
+                            int w, int h) {
+    if (!selected_rows) {
+        convert_set_backend(CONVERT_BACKEND_AUTO);
+    }
+
+    const swizzle_t *sw = format == CONVERT_FORMAT_BGRA ? &swizzle_bgra
+                        : format == CONVERT_FORMAT_ARGB ? &swizzle_argb
+                        : &swizzle_rgba;
+
+    for (int y = 0; y < h; y += 2) {
+        const uint8_t *row = src + (size_t)y * src_stride;
+        uint8_t *y0 = plane[0] + (size_t)y * stride[0];
+        uint8_t *y1 = y0 + stride[0];
+        uint8_t *u = plane[1] + (size_t)(y / 2) * stride[1];
+        uint8_t *v = plane[2] + (size_t)(y / 2) * stride[2];
+        if (format == CONVERT_FORMAT_RGB24) {
+            convert_rows_rgb24(row, row + src_stride, y0, y1, u, v, w);
+        } else {
+            selected_rows(row, row + src_stride, y0, y1, u, v, 0, w, sw);
+        }
+    }
+}
+
+// Downscaled rows are built this many output pixels at a time, as 4 byte pixels, and handed to
+// the kernels above. Only the source rows under the output rows are read, so no full size image is made.
+#define SCALE_CHUNK 256
+
+typedef struct {
+    const uint8_t *src;
+    int src_stride;
+    int bpp;
+    swizzle_t sw; // where R, G and B are, in the source and in the scaled 4 byte pixels
+    int src_w;
+    int src_h;
+    int w;
+    int h;
+} scale_t;
+
+typedef void (*scale_row_fn)(const scale_t *sc, int y, int x0, int n, uint8_t *out);
+
+// 2:1 both ways from a 4 byte format, the HiDPI case: every byte, alpha included, becomes the
+// rounded mean of the same byte in a 2x2 block, so the pixels keep the source's layout.
+static void box2_rows_scalar(const uint8_t *a, const uint8_t *b, uint8_t *out, int i, int n) {
+    for (; i < n; i++) {
+        for (int c = 0; c < 4; c++) {
+            out[i * 4 + c] = (a[i * 8 + c] + a[i * 8 + 4 + c] + b[i * 8 + c] + b[i * 8 + 4 + c] + 2) >> 2;
+        }
+    }
+}
+
+#if CONVERT_HAVE_X86
+
+// Four output pixels from 32 bytes of each row: widen to 16 bits, add the rows, then add each
+// pixel to its right hand neighbour by pairing up the 64 bit halves.
+static void box2_rows_sse2(const uint8_t *a, const uint8_t *b, uint8_t *out, int n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(a + i * 8));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(a + i * 8 + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(b + i * 8));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(b + i * 8 + 16));
+        __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+        __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+        __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+        __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+        __m128i p01 = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), _mm_unpackhi_epi64(s0, s1));
+        __m128i p23 = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), _mm_unpackhi_epi64(s2, s3));
+        p01 = _mm_srli_epi16(_mm_add_epi16(p01, two), 2);
+        p23 = _mm_srli_epi16(_mm_add_epi16(p23, two), 2);
+        _mm_storeu_si128((__m128i *)(out + i * 4), _mm_packus_epi16(p01, p23));
+    }
+    box2_rows_scalar(a, b, out, i, n);
+}
+
+#endif
+
+static void scale_row_box2(const scale_t *sc, int y, int x0, int n, uint8_t *out) {
+    const uint8_t *a = sc->src + (size_t)y * 2 * sc->src_stride + (size_t)x0 * 8;
+    const uint8_t *b = a + sc->src_stride;
+#if CONVERT_HAVE_X86
+    if (selected_backend != CONVERT_BACKEND_SCALAR) {
+        box2_rows_sse2(a, b, out, n);
+        return;
+    }
+#endif
+    box2_rows_scalar(a, b, out, 0, n);
+}
+
+// Box filter for other whole number ratios: each output pixel is the rounded mean of the kx x ky
+// block of source pixels it covers.
+static void scale_row_box(const scale_t *sc, int y, int x0, int n, uint8_t *out) {
+    int kx = sc->src_w / sc->w;
+    int ky = sc->src_h / sc->h;
+    int area = kx * ky;
+    const swizzle_t *sw = &sc->sw;
+    const uint8_t *row = sc->src + (size_t)y * ky * sc->src_stride + (size_t)x0 * kx * sc->bpp;
+
+    for (int i = 0; i < n; i++, out += 4) {
+        const uint8_t *block = row + (size_t)i * kx * sc->bpp;
+        int r = 0, g = 0, b = 0;
+        for (int dy = 0; dy < ky; dy++) {
+            const uint8_t *p = block + (size_t)dy * sc->src_stride;
+            for (int dx = 0; dx < kx; dx++, p += sc->bpp) {
+                r += p[sw->r];
+                g += p[sw->g];
+                b += p[sw->b];
+            }
+        }
+        out[sw->r] = (uint8_t)((r + area / 2) / area);
+        out[sw->g] = (uint8_t)((g + area / 2) / area);
+        out[sw->b] = (uint8_t)((b + area / 2) / area);
+    }
+}
+
+// Source position of output pixel i's centre with 8 fractional bits, clamped to the image.
+static inline int scale_pos(int i, int src_n, int n) {
+    int64_t p = ((int64_t)(2 * i + 1) * src_n * 256 / n - 256) / 2;
+    int64_t last = (int64_t)(src_n - 1) * 256;
+    return p < 0 ? 0 : p > last ? (int)last : (int)p;
+}
+
+static inline uint8_t lerp2(const uint8_t *a, const uint8_t *b, const uint8_t *c, const uint8_t *d,
+                            int off, int fx, int fy) {
+    int top = a[off] * (256 - fx) + b[off] * fx;
+    int bottom = c[off] * (256 - fx) + d[off] * fx;
+    return (uint8_t)((top * (256 - fy) + bottom * fy + 32768) >> 16);
+}
+
+// Bilinear for any other ratio. Past 2:1 it starts skipping source pixels and can alias.
+static void scale_row_bilinear(const scale_t *sc, int y, int x0, int n, uint8_t *out) {
+    const swizzle_t *sw = &sc->sw;
+    int py = scale_pos(y, sc->src_h, sc->h);
+    int sy = py >> 8;
+    int fy = py & 255;
+    const uint8_t *row0 = sc->src + (size_t)sy * sc->src_stride;
+    const uint8_t *row1 = sy + 1 < sc->src_h ? row0 + sc->src_stride : row0;
+
+    for (int i = 0; i < n; i++, out += 4) {
+        int px = scale_pos(x0 + i, sc->src_w, sc->w);
+        int sx = px >> 8;
+        int fx = px & 255;
+        int sx1 = sx + 1 < sc->src_w ? sx + 1 : sx;
+        const uint8_t *a = row0 + (size_t)sx * sc->bpp;
+        const uint8_t *b = row0 + (size_t)sx1 * sc->bpp;
+        const uint8_t *c = row1 + (size_t)sx * sc->bpp;
+        const uint8_t *d = row1 + (size_t)sx1 * sc->bpp;
+        out[sw->r] = lerp2(a, b, c, d, sw->r, fx, fy);
+        out[sw->g] = lerp2(a, b, c, d, sw->g, fx, fy);
+        out[sw->b] = lerp2(a, b, c, d, sw->b, fx, fy);
+    }
+}
+
+void convert_scaled_to_i420(const uint8_t *src, int src_stride, convert_format_t format, int src_w, int src_h,
+                            uint8_t *const plane[3], const int stride[3],
+                            int w, int h, int y0, int y1) {
+    if (src_w == w && src_h == h) {
+        uint8_t *planes[3] = {
+            plane[0] + (size_t)y0 * stride[0],
+            plane[1] + (size_t)(y0 / 2) * stride[1],
+            plane[2] + (size_t)(y0 / 2) * stride[2],
+        };
+        convert_packed_to_i420(src + (size_t)y0 * src_stride, src_stride, format, planes, stride, w, y1 - y0);
+        return;
+    }
+    if (!selected_rows) {
+        convert_set_backend(CONVERT_BACKEND_AUTO);
+    }
+
+    const swizzle_t *sw = format == CONVERT_FORMAT_BGRA ? &swizzle_bgra
+                        : format == CONVERT_FORMAT_ARGB ? &swizzle_argb
+                        : &swizzle_rgba;
+    int bpp = format == CONVERT_FORMAT_RGB24 ? 3 : 4;
+    scale_t sc = { src, src_stride, bpp, *sw, src_w, src_h, w, h };
+    scale_row_fn scale_row = scale_row_bilinear;
+    if (src_w % w == 0 && src_h % h == 0) {
+        scale_row = src_w == 2 * w && src_h == 2 * h && bpp == 4 ? scale_row_box2 : scale_row_box;
+    }
+    uint8_t rgba0[SCALE_CHUNK * 4];
+    uint8_t rgba1[SCALE_CHUNK * 4];
+
+    for (int y = y0; y < y1; y += 2) {
+        uint8_t *luma0 = plane[0] + (size_t)y * stride[0];
+        uint8_t *luma1 = luma0 + stride[0];
+        uint8_t *u = plane[1] + (size_t)(y / 2) * stride[1];
+        uint8_t *v = plane[2] + (size_t)(y / 2) * stride[2];
+        for (int x = 0; x < w; x += SCALE_CHUNK) {
+            int n = w - x < SCALE_CHUNK ? w - x : SCALE_CHUNK;
+            scale_row(&sc, y, x, n, rgba0);
+            scale_row(&sc, y + 1, x, n, rgba1);
+            selected_rows(rgba0, rgba1, luma0 + x, luma1 + x, u + x / 2, v + x / 2, 0, n, sw);
+        }
+    }
+}
+
+void convert_rgba_to_i420(const uint8_t *rgba, int rgba_stride,
+                          uint8_t *const plane[3], const int stride[3],
+                          int w, int h) {
+    convert_packed_to_i420(rgba, rgba_stride, CONVERT_FORMAT_RGBA, plane, stride, w, h);
+}
+
+static void copy_plane(const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int w, int h) {
+    for (int y = 0; y < h; y++) {
+        memcpy(dst + (size_t)y * dst_stride, src + (size_t)y * src_stride, w);
+    }
+}
+
+void convert_copy_i420(const uint8_t *const src[3], const int src_stride[3],
+                       uint8_t *const plane[3], const int stride[3],
+                       int w, int h) {
+    copy_plane(src[0], src_stride[0], plane[0], stride[0], w, h);
+    copy_plane(src[1], src_stride[1], plane[1], stride[1], w / 2, h / 2);
+    copy_plane(src[2], src_stride[2], plane[2], stride[2], w / 2, h / 2);
+}
+
+void convert_nv12_to_i420(const uint8_t *y_src, int y_stride, const uint8_t *uv_src, int uv_stride,
+                          uint8_t *const plane[3], const int stride[3],
+                          int w, int h) {
+    copy_plane(y_src, y_stride, plane[0], stride[0], w, h);
+    for (int y = 0; y < h / 2; y++) {
+        const uint8_t *uv = uv_src + (size_t)y * uv_stride;
+        uint8_t *u = plane[1] + (size_t)y * stride[1];
+        uint8_t *v = plane[2] + (size_t)y * stride[2];
+        for (int x = 0; x < w / 2; x++) {
+            u[x] = uv[x * 2];
+            v[x] = uv[x * 2 + 1];
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef RAW2MP4_CONVERT_H
+#define RAW2MP4_CONVERT_H
+
+#include <stdint.h>
+
+// Packed RGB -> I420 colour conversion.
+//
+// Full range BT.601 (JFIF) in fixed point: luma uses 8 fractional bits, chroma 7, and each chroma
+// sample is the rounded mean of its 2x2 block of source pixels. Every backend implements exactly
+// the same integer arithmetic, so the output is bit-identical whichever one is selected.
+
+typedef enum {
+    CONVERT_BACKEND_AUTO = 0,
+    CONVERT_BACKEND_SCALAR,
+    CONVERT_BACKEND_SSE2,
+    CONVERT_BACKEND_AVX2,
+    CONVERT_BACKEND_WASM_SIMD128,
+    CONVERT_BACKEND_COUNT
+} convert_backend_t;
+
+typedef enum {
+    CONVERT_FORMAT_RGBA = 0,
+    CONVERT_FORMAT_BGRA,
+    CONVERT_FORMAT_ARGB,
+    CONVERT_FORMAT_RGB24,
+} convert_format_t;
+
+// Picks the kernel used by convert_rgba_to_i420. CONVERT_BACKEND_AUTO selects the fastest one this
+// build and CPU support, and is what you get if this is never called. The selection is lazy and
+// unsynchronised, so call this or convert_get_backend once before converting on several threads.
+// Returns non-zero if the requested backend isn't available.
+int convert_set_backend(convert_backend_t backend);
+convert_backend_t convert_get_backend(void);
+int convert_backend_available(convert_backend_t backend);
+const char *convert_backend_name(convert_backend_t backend);
+
+// Converts a w x h packed image into the three I420 planes. w and h must be even; strides are
+// in bytes and may include padding.
+void convert_packed_to_i420(const uint8_t *src, int src_stride, convert_format_t format,
+                            uint8_t *const plane[3], const int stride[3],
+                            int w, int h);
+void convert_rgba_to_i420(const uint8_t *rgba, int rgba_stride,
+                          uint8_t *const plane[3], const int stride[3],
+                          int w, int h);
+
+// Converts output rows [y0, y1) of a src_w x src_h packed image scaled down to w x h, reading the
+// source once and building each output row pair's RGB on the way into the kernel above. Whole
+// number ratios use a box filter and anything else bilinear. src and plane are the whole images;
+// w, h, y0 and y1 must be even and w and h no larger than the source. Same size is a plain convert.
+void convert_scaled_to_i420(const uint8_t *src, int src_stride, convert_format_t format, int src_w, int src_h,
+                            uint8_t *const plane[3], const int stride[3],
+                            int w, int h, int y0, int y1);
+
+// Plane copies for YUV input that can't be handed to x264 in place.
+void convert_copy_i420(const uint8_t *const src[3], const int src_stride[3],
+                       uint8_t *const plane[3], const int stride[3],
+                       int w, int h);
+void convert_nv12_to_i420(const uint8_t *y_src, int y_stride, const uint8_t *uv_src, int uv_stride,
+                          uint8_t *const plane[3], const int stride[3],
+                          int w, int h);
+
+#endif
@@ -0,0 +1,214 @@
+#include "frames.h"
+
+#include <string.h>
+
+static const char *scene_names[FRAMES_SCENE_COUNT] = {
+    "ellipse",
+    "text",
+    "noise",
+    "static",
+};
+
+// glyphs are 5x7 on a 6x10 pitch, like a small terminal font
+#define GLYPH_W 5
+#define GLYPH_H 7
+#define GLYPH_PITCH_X 6
+#define GLYPH_PITCH_Y 10
+
+const char *frames_scene_name(frames_scene_t scene) {
+    if ((int)scene < 0 || scene >= FRAMES_SCENE_COUNT) {
+        return NULL;
+    }
+    return scene_names[scene];
+}
+
+int frames_scene_from_name(const char *name) {
+    for (int i = 0; i < FRAMES_SCENE_COUNT; i++) {
+        if (strcmp(name, scene_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static inline uint32_t hash32(uint32_t v) {
+    v ^= v >> 16;
+    v *= 0x7feb352du;
+    v ^= v >> 15;
+    v *= 0x846ca68bu;
+    v ^= v >> 16;
+    return v;
+}
+
+static inline void put_pixel(uint8_t *p, uint32_t rgb) {
+    p[0] = rgb >> 16;
+    p[1] = rgb >> 8;
+    p[2] = rgb;
+    p[3] = 0xff;
+}
+
+static inline int clamp_byte(int v) {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Scenes were designed at 640x480; larger frames scale sizes and speeds by whole pixels.
+static int scene_scale(int h) {
+    return h >= 960 ? h / 480 : 1;
+}
+
+static void fill_rect(uint8_t *rgba, int w, int h, int x0, int y0, int x1, int y1, uint32_t rgb) {
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 > w ? w : x1;
+    y1 = y1 > h ? h : y1;
+    for (int y = y0; y < y1; y++) {
+        uint8_t *row = rgba + ((size_t)y * w + x0) * 4;
+        for (int x = x0; x < x1; x++, row += 4) {
+            put_pixel(row, rgb);
+        }
+    }
+}
+
+// Moves from start at velocity pixels a frame, reflecting off 0 and range.
+static int bounce(int start, int velocity, int i, int range) {
+    if (range <= 0) {
+        return 0;
+    }
+    int64_t period = 2 * (int64_t)range;
+    int64_t p = ((int64_t)start + (int64_t)velocity * i) % period;
+    if (p < 0) {
+        p += period;
+    }
+    return (int)(p <= range ? p : period - p);
+}
+
+// Draws rows of text in the box [x0, x1) x [y0, y1), scrolled up by scroll pixels. The glyphs are
+// random bit patterns rather than letters, which is all the encoder can tell apart: sharp edges on
+// a regular pitch, gaps between words and ragged line ends. Each line's text depends only on its
+// line number, so scrolling moves the same text up the box.
+static void draw_text(uint8_t *rgba, int w, int h, int x0, int y0, int x1, int y1,
+                      int scale, int scroll, uint32_t seed, uint32_t ink) {
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 > w ? w : x1;
+    y1 = y1 > h ? h : y1;
+    int n_cols = (x1 - x0) / (GLYPH_PITCH_X * scale);
+    if (n_cols <= 0) {
+        return;
+    }
+
+    for (int y = y0; y < y1; y++) {
+        int ty = (y - y0 + scroll) / scale;
+        int line = ty / GLYPH_PITCH_Y;
+        int gy = ty % GLYPH_PITCH_Y;
+        if (gy >= GLYPH_H) {
+            continue;
+        }
+        uint32_t line_hash = hash32((uint32_t)line * 0x9e3779b9u ^ seed);
+        if ((line_hash >> 28) == 0) {
+            continue; // blank line
+        }
+        int line_len = n_cols / 4 + (int)(line_hash % (uint32_t)(n_cols - n_cols / 4 + 1));
+
+        uint8_t *row = rgba + (size_t)y * w * 4;
+        for (int col = 0; col < line_len; col++) {
+            uint32_t glyph = hash32(line_hash ^ hash32(col + 1));
+            if (glyph % 6 == 0) {
+                continue; // space between words
+            }
+            uint32_t bits = hash32(glyph + gy) & ((1u << GLYPH_W) - 1);
+            int gx0 = x0 + col * GLYPH_PITCH_X * scale;
+            for (int gx = 0; gx < GLYPH_W * scale; gx++) {
+                if (bits & (1u << (gx / scale))) {
+                    put_pixel(row + (size_t)(gx0 + gx) * 4, ink);
+                }
+            }
+        }
+    }
+}
+
+// The frames the original CoreGraphics generator drew: a black circle of radius 32 bouncing around
+// a white 640x480 frame at 10 pixels a frame in each direction.
+static void render_ellipse(int i, uint8_t *rgba, int w, int h) {
+    int scale = scene_scale(h);
+    int r = 32 * scale;
+    if (2 * r > w || 2 * r > h) {
+        r = (w < h ? w : h) / 2;
+    }
+    int v = 10 * scale;
+    int ex = bounce(w / 2 - r, v, i, w - 2 * r);
+    int ey = bounce(h / 2 - r, v, i, h - 2 * r);
+
+    memset(rgba, 0xff, (size_t)w * h * 4);
+    // pixel centres inside the circle, in doubled coordinates to stay in integers
+    int64_t r2 = 4 * (int64_t)r * r;
+    for (int y = ey; y < ey + 2 * r; y++) {
+        int64_t dy = 2 * (y - ey) + 1 - 2 * r;
+        for (int x = ex; x < ex + 2 * r; x++) {
+            int64_t dx = 2 * (x - ex) + 1 - 2 * r;
+            if (dx * dx + dy * dy <= r2) {
+                put_pixel(rgba + ((size_t)y * w + x) * 4, 0x000000);
+            }
+        }
+    }
+}
+
+// An editor or terminal scrolling steadily: a fixed title bar over text moving up 2 pixels a frame.
+static void render_text(int i, uint8_t *rgba, int w, int h) {
+    int scale = scene_scale(h);
+    int bar = 24 * scale;
+    int margin = 8 * scale;
+    fill_rect(rgba, w, h, 0, 0, w, bar, 0x2d3e50);
+    fill_rect(rgba, w, h, 0, bar, w, h, 0xfafafa);
+    draw_text(rgba, w, h, margin, bar / 4, w / 3, bar - bar / 4, scale, 0, 0x5eed, 0xffffff);
+    draw_text(rgba, w, h, margin, bar + margin, w - margin, h - margin, scale, i * 2 * scale,
+              0x7e47, 0x202020);
+}
+
+// Camera-like content: broad colour gradients drifting across the frame under grain that changes
+// every frame, so no block is ever identical to the one before.
+static void render_noise(int i, uint8_t *rgba, int w, int h) {
+    uint32_t frame_seed = hash32((uint32_t)i * 0x9e3779b9u + 1);
+    for (int y = 0; y < h; y++) {
+        uint8_t *row = rgba + (size_t)y * w * 4;
+        int gy = y * 512 / h;
+        for (int x = 0; x < w; x++, row += 4) {
+            int gx = x * 512 / w;
+            // triangle waves over 0..255
+            int r = (gx + i * 4) & 511;
+            int g = (gy + i * 3) & 511;
+            int b = ((gx + gy) / 2 - i * 2) & 511;
+            r = r > 255 ? 511 - r : r;
+            g = g > 255 ? 511 - g : g;
+            b = b > 255 ? 511 - b : b;
+            uint32_t grain = hash32(((uint32_t)y * (uint32_t)w + (uint32_t)x) ^ frame_seed);
+            row[0] = clamp_byte(r + (int)(grain & 31) - 16);
+            row[1] = clamp_byte(g + (int)((grain >> 8) & 31) - 16);
+            row[2] = clamp_byte(b + (int)((grain >> 16) & 31) - 16);
+            row[3] = 0xff;
+        }
+    }
+}
+
+// A desktop with a document window on it, the same every frame: an idle screen recording.
+static void render_static(int i, uint8_t *rgba, int w, int h) {
+    (void)i;
+    int scale = scene_scale(h);
+    int bar = 20 * scale;
+    int margin = 8 * scale;
+    int wx0 = w / 8, wy0 = h / 8, wx1 = w - w / 8, wy1 = h - h / 8;
+    fill_rect(rgba, w, h, 0, 0, w, h, 0x3a6ea5);
+    fill_rect(rgba, w, h, wx0, wy0, wx1, wy0 + bar, 0xdddddd);
+    fill_rect(rgba, w, h, wx0, wy0 + bar, wx1, wy1, 0xffffff);
+    draw_text(rgba, w, h, wx0 + margin, wy0 + bar + margin, wx1 - margin, wy1 - margin, scale, 0,
+              0x57a7, 0x000000);
+}
+
+void frames_render(frames_scene_t scene, int i, uint8_t *rgba, int w, int h) {
+    switch (scene) {
+        case FRAMES_SCENE_TEXT: render_text(i, rgba, w, h); break;
+        case FRAMES_SCENE_NOISE: render_noise(i, rgba, w, h); break;
+        case FRAMES_SCENE_STATIC: render_static(i, rgba, w, h); break;
+        default: render_ellipse(i, rgba, w, h); break;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef RAW2MP4_FRAMES_H
+#define RAW2MP4_FRAMES_H
+
+#include <stdint.h>
+
+// Synthetic RGBA frames for generate and bench, drawn in software so they build anywhere. Each
+// scene stands in for a kind of content the encoder sees in practice: a small moving object on a
+// flat background, scrolling text, busy camera-like video and a screen where nothing changes.
+// Frames are a pure function of the scene, size and frame index, so runs are repeatable.
+
+typedef enum {
+    FRAMES_SCENE_ELLIPSE = 0,
+    FRAMES_SCENE_TEXT,
+    FRAMES_SCENE_NOISE,
+    FRAMES_SCENE_STATIC,
+    FRAMES_SCENE_COUNT
+} frames_scene_t;
+
+// Name used on the command line and in bench output, or NULL if scene is out of range.
+const char *frames_scene_name(frames_scene_t scene);
+
+// Looks a scene up by name. Returns -1 if there is no such scene.
+int frames_scene_from_name(const char *name);
+
+// Draws frame i of scene into rgba, which is w * h * 4 bytes with no row padding.
+void frames_render(frames_scene_t scene, int i, uint8_t *rgba, int w, int h);
+
+#endif
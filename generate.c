@@ -1,56 +1,98 @@
 #include <stdio.h>
-#include <CoreGraphics/CoreGraphics.h>
-#include <ImageIO/ImageIO.h>
-#include <CoreServices/CoreServices.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-#define MAX(a, b) ((a) < (b) ? (b) : (a))
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#include "capture.h"
+#include "frames.h"
 
-int main(void) {
+static void usage(void) {
+  fprintf(stderr,
+          "usage: generate [-s scene] [-n frames] [-w width] [-h height] [-o dir] [-p] [-c file]\n"
+          "  -s scene   ellipse (default), text, noise or static\n"
+          "  -n frames  frames to write, 60 by default\n"
+          "  -w, -h     frame size, 640x480 by default\n"
+          "  -o dir     where to write image_000.raw etc, testdata by default\n"
+          "  -p         also write a .ppm of each frame for viewing\n"
+          "  -c file    write the frames to one capture file (see capture.h) instead of .raw files\n");
+}
+
+static int write_ppm(const char *name, const uint8_t *rgba, int w, int h) {
+  FILE *f = fopen(name, "wb");
+  if (!f) {
+    return 0;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", w, h);
+  for (size_t i = 0; i < (size_t)w * h; i++) {
+    fwrite(rgba + i * 4, 3, 1, f);
+  }
+  return fclose(f) == 0;
+}
+
+int main(int argc, char **argv) {
+  int scene = FRAMES_SCENE_ELLIPSE;
+  int frames = 60;
   int w = 640;
   int h = 480;
-  
-  int frames = 60;
-  
-  CGColorSpaceRef space = CGColorSpaceCreateDeviceRGB();
-  CGPoint velocity = { 10.0, 10.0 };
-  CGFloat radius = 32.0;
-  CGRect ellipse = CGRectMake(w/2.0 - radius, h/2.0 - radius, radius*2.0, radius*2.0);
+  const char *dir = "testdata";
+  int b_preview = 0;
+  const char *capture_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:n:w:h:o:pc:")) != -1) {
+    switch (opt) {
+      case 's':
+        scene = frames_scene_from_name(optarg);
+        if (scene < 0) {
+          fprintf(stderr, "Unknown scene %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'n': frames = atoi(optarg); break;
+      case 'w': w = atoi(optarg); break;
+      case 'h': h = atoi(optarg); break;
+      case 'o': dir = optarg; break;
+      case 'p': b_preview = 1; break;
+      case 'c': capture_path = optarg; break;
+      default: usage(); return 1;
+    }
+  }
+  if (w <= 0 || h <= 0 || frames < 0) {
+    usage();
+    return 1;
+  }
+
+  size_t data_len = (size_t)w * h * 4;
+  uint8_t *data = malloc(data_len);
+  if (!data) {
+    fprintf(stderr, "Out of memory for a %dx%d frame\n", w, h);
+    return 1;
+  }
 
-  size_t data_len = w * h * 4;
-  void *data = calloc(data_len, 1);
-  
-  for (int i = 0; i < 60; i++) {
-    CGContextRef ctx = CGBitmapContextCreate(data, w, h, 8, w * 4, space, kCGImageAlphaPremultipliedLast);
-    
-    CGContextSetFillColorWithColor(ctx, CGColorGetConstantColor(kCGColorWhite));
-    
-    CGContextFillRect(ctx, CGRectMake(0, 0, w, h));
-    
-    CGContextSetFillColorWithColor(ctx, CGColorGetConstantColor(kCGColorBlack));
-    
-    CGContextBeginPath(ctx);
-    CGContextAddEllipseInRect(ctx, ellipse);
-    CGContextFillPath(ctx);
-    
-    ellipse.origin.x += velocity.x;
-    ellipse.origin.y += velocity.y;
-    
-    if (CGRectGetMaxX(ellipse) >= w || CGRectGetMinX(ellipse) <= 0) {
-      velocity.x = -velocity.x;
-    } 
-    if (CGRectGetMaxY(ellipse) >= h || CGRectGetMinY(ellipse) <= 0) {
-      velocity.y = -velocity.y;
+  capture_writer_t *capture = NULL;
+  if (capture_path) {
+    capture = capture_writer_open(capture_path, w, h, COMPRESSION_FORMAT_RGBA, 15, 1, 0);
+    if (!capture) {
+      free(data);
+      return 1;
     }
-    
-    ellipse.origin.x = MAX(ellipse.origin.x, 0);
-    ellipse.origin.x = MIN(ellipse.origin.x, w - radius * 2.0);
-    ellipse.origin.y = MAX(ellipse.origin.y, 0);
-    ellipse.origin.y = MIN(ellipse.origin.y, h - radius * 2.0);
-    
-    char name[255] = { 0 };
-    sprintf(name, "testdata/image_%03d.raw", i);
-    
+  }
+
+  for (int i = 0; i < frames; i++) {
+    frames_render(scene, i, data, w, h);
+
+    if (capture) {
+      // the capture finds the tiles that changed itself
+      if (capture_writer_add_frame(capture, data, w * 4, NULL, 0) != 0) {
+        fprintf(stderr, "Couldn't write frame %d to %s\n", i, capture_path);
+        exit(1);
+      }
+      continue;
+    }
+
+    char name[1024] = { 0 };
+    snprintf(name, sizeof(name), "%s/image_%03d.raw", dir, i);
+
     FILE *f = fopen(name, "wb");
     if (!f) {
       perror("Couldn't open file for writing");
@@ -58,27 +100,20 @@ int main(void) {
     }
     fwrite(data, data_len, 1, f);
     fclose(f);
-        
-    CFMutableDataRef pngData = CFDataCreateMutable(NULL, 0);
-    CGImageDestinationRef dst = CGImageDestinationCreateWithData(pngData, kUTTypePNG, 1, NULL);
-    CGImageRef img = CGBitmapContextCreateImage(ctx);
-    CGImageDestinationAddImage(dst, img, NULL);
-    CGImageDestinationFinalize(dst);
-    
-    sprintf(name, "testdata/image_%03d.png", i);
-    f = fopen(name, "wb");
-    if (!f) {
-      perror("Couldn't open png file for writing");
-      exit(1);
+
+    if (b_preview) {
+      snprintf(name, sizeof(name), "%s/image_%03d.ppm", dir, i);
+      if (!write_ppm(name, data, w, h)) {
+        perror("Couldn't write ppm file");
+        exit(1);
+      }
     }
-    fwrite(CFDataGetBytePtr(pngData), CFDataGetLength(pngData), 1, f);
-    fclose(f);
-    CFRelease(pngData);
-    CFRelease(img);
-    CFRelease(dst);
-    
-    CFRelease(ctx);
   }
-  
+
+  free(data);
+  if (capture && capture_writer_close(capture) != 0) {
+    fprintf(stderr, "Couldn't finish %s\n", capture_path);
+    return 1;
+  }
   return 0;
 }
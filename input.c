@@ -0,0 +1,341 @@
+#include "input.h"
+#include "workers.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if RAW2MP4_HAVE_THREADS
+#include <pthread.h>
+#endif
+
+#define INPUT_DEFAULT_READ_AHEAD 4
+
+typedef struct {
+    const uint8_t *data;
+    void *map;      // mapping behind data, if the frame was mapped
+    uint8_t *buf;   // read buffer, allocated the first time the slot reads a frame rather than maps one
+} input_slot_t;
+
+struct input_t {
+    size_t frame_size;
+
+    // one of these is the source
+    const char *const *paths;
+    int n_paths;
+    FILE *stream;
+    const char *stream_path;
+
+    int i_next_load; // frames loaded so far, only touched by the loader
+
+    input_slot_t *slots;
+    int i_depth;
+    int i_head;
+    int i_count;
+    int b_holding; // the caller has slots[i_head]
+    int b_done;
+    int b_failed;
+
+    uint64_t bytes;
+    double load_seconds;
+
+#if RAW2MP4_HAVE_THREADS
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int b_threaded;
+    int b_quit;
+#endif
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void slot_release(input_t *in, input_slot_t *slot) {
+    if (slot->map) {
+        munmap(slot->map, in->frame_size);
+        slot->map = NULL;
+    }
+    slot->data = NULL;
+}
+
+static int read_exactly(FILE *f, uint8_t *buf, size_t len, size_t *got) {
+    *got = fread(buf, 1, len, f);
+    return *got == len;
+}
+
+// Gives slot a buffer to read a frame into. Mapped frames don't need one, so most file inputs never
+// allocate it.
+static int slot_alloc_buf(input_t *in, input_slot_t *slot) {
+    if (!slot->buf) {
+        slot->buf = malloc(in->frame_size);
+        if (!slot->buf) {
+            fprintf(stderr, "Out of memory for a %zu byte frame\n", in->frame_size);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Maps a single frame file, touching every page so the caller doesn't take the faults.
+static int load_file(input_t *in, const char *path, input_slot_t *slot) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Can't stat %s: %s\n", path, strerror(errno));
+        close(fd);
+        return 0;
+    }
+    if ((size_t)st.st_size < in->frame_size) {
+        fprintf(stderr, "Short read (%lld) from %s\n", (long long)st.st_size, path);
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, in->frame_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+        close(fd);
+#ifdef MADV_WILLNEED
+        madvise(map, in->frame_size, MADV_WILLNEED);
+#endif
+        const volatile uint8_t *p = map;
+        uint8_t sum = 0;
+        for (size_t i = 0; i < in->frame_size; i += 4096) {
+            sum += p[i];
+        }
+        (void)sum;
+        slot->map = map;
+        slot->data = map;
+        return 1;
+    }
+
+    // some file systems can't be mapped; read them instead
+    if (!slot_alloc_buf(in, slot)) {
+        close(fd);
+        return 0;
+    }
+    FILE *f = fdopen(fd, "rb");
+    size_t got = 0;
+    int ok = f && read_exactly(f, slot->buf, in->frame_size, &got);
+    if (!ok) {
+        fprintf(stderr, "Short read (%zu) from %s\n", got, path);
+    }
+    if (f) {
+        fclose(f);
+    } else {
+        close(fd);
+    }
+    slot->data = slot->buf;
+    return ok;
+}
+
+// Loads the next frame into slot. Returns 1 on success, 0 at the end of the input and -1 on error.
+static int load_frame(input_t *in, input_slot_t *slot) {
+    double start = now_seconds();
+    int result;
+    if (in->stream) {
+        size_t got = 0;
+        if (!slot_alloc_buf(in, slot)) {
+            result = -1;
+        } else if (read_exactly(in->stream, slot->buf, in->frame_size, &got)) {
+            slot->data = slot->buf;
+            result = 1;
+        } else if (got == 0 && !ferror(in->stream)) {
+            result = 0;
+        } else {
+            fprintf(stderr, "Short read (%zu) from %s\n", got, in->stream_path);
+            result = -1;
+        }
+    } else if (in->i_next_load < in->n_paths) {
+        result = load_file(in, in->paths[in->i_next_load], slot) ? 1 : -1;
+    } else {
+        result = 0;
+    }
+    in->load_seconds += now_seconds() - start;
+
+    if (result > 0) {
+        in->i_next_load++;
+    }
+    return result;
+}
+
+#if RAW2MP4_HAVE_THREADS
+
+static void *input_main(void *arg) {
+    input_t *in = arg;
+
+    pthread_mutex_lock(&in->lock);
+    for (;;) {
+        while (!in->b_quit && in->i_count == in->i_depth) {
+            pthread_cond_wait(&in->cond, &in->lock);
+        }
+        if (in->b_quit) {
+            break;
+        }
+        // the slot after the queued ones is free; nobody else touches it until i_count says so
+        input_slot_t *slot = &in->slots[(in->i_head + in->i_count) % in->i_depth];
+        pthread_mutex_unlock(&in->lock);
+        int result = load_frame(in, slot);
+        pthread_mutex_lock(&in->lock);
+
+        if (result > 0) {
+            in->i_count++;
+        } else {
+            in->b_done = 1;
+            in->b_failed = result < 0;
+        }
+        pthread_cond_broadcast(&in->cond);
+        if (in->b_done) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&in->lock);
+    return NULL;
+}
+
+#endif
+
+static input_t *input_open(size_t frame_size, int i_read_ahead) {
+    input_t *in = calloc(1, sizeof(input_t));
+    if (!in) {
+        return NULL;
+    }
+    in->frame_size = frame_size;
+#if RAW2MP4_HAVE_THREADS
+    // one slot more than the read ahead for the frame the caller is holding
+    in->i_depth = (i_read_ahead > 0 ? i_read_ahead : INPUT_DEFAULT_READ_AHEAD) + 1;
+#else
+    in->i_depth = 1;
+#endif
+    in->slots = calloc(in->i_depth, sizeof(input_slot_t));
+    if (!in->slots) {
+        free(in);
+        return NULL;
+    }
+    return in;
+}
+
+static input_t *input_start(input_t *in) {
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->cond, NULL);
+    in->b_threaded = pthread_create(&in->thread, NULL, input_main, in) == 0;
+#endif
+    return in;
+}
+
+input_t *input_open_files(const char *const *paths, int n_paths, size_t frame_size, int i_read_ahead) {
+    input_t *in = input_open(frame_size, i_read_ahead);
+    if (!in) {
+        return NULL;
+    }
+    in->paths = paths;
+    in->n_paths = n_paths;
+    return input_start(in);
+}
+
+input_t *input_open_stream(const char *path, size_t frame_size, int i_read_ahead) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    input_t *in = input_open(frame_size, i_read_ahead);
+    if (!in) {
+        if (f != stdin) {
+            fclose(f);
+        }
+        return NULL;
+    }
+    in->stream = f;
+    in->stream_path = path;
+    return input_start(in);
+}
+
+const uint8_t *input_next(input_t *in) {
+#if RAW2MP4_HAVE_THREADS
+    if (in->b_threaded) {
+        pthread_mutex_lock(&in->lock);
+        if (in->b_holding) {
+            slot_release(in, &in->slots[in->i_head]);
+            in->i_head = (in->i_head + 1) % in->i_depth;
+            in->i_count--;
+            in->b_holding = 0;
+            pthread_cond_broadcast(&in->cond);
+        }
+        while (in->i_count == 0 && !in->b_done) {
+            pthread_cond_wait(&in->cond, &in->lock);
+        }
+        const uint8_t *data = NULL;
+        if (in->i_count) {
+            in->b_holding = 1;
+            data = in->slots[in->i_head].data;
+            in->bytes += in->frame_size;
+        }
+        pthread_mutex_unlock(&in->lock);
+        return data;
+    }
+#endif
+
+    slot_release(in, &in->slots[0]);
+    if (in->b_done) {
+        return NULL;
+    }
+    int result = load_frame(in, &in->slots[0]);
+    if (result <= 0) {
+        in->b_done = 1;
+        in->b_failed = result < 0;
+        return NULL;
+    }
+    in->bytes += in->frame_size;
+    return in->slots[0].data;
+}
+
+int input_failed(const input_t *in) {
+    return in->b_failed;
+}
+
+void input_stats(const input_t *in, uint64_t *bytes, double *load_seconds) {
+    *bytes = in->bytes;
+    *load_seconds = in->load_seconds;
+}
+
+void input_close(input_t *in) {
+    if (!in) {
+        return;
+    }
+#if RAW2MP4_HAVE_THREADS
+    if (in->b_threaded) {
+        pthread_mutex_lock(&in->lock);
+        in->b_quit = 1;
+        pthread_cond_broadcast(&in->cond);
+        pthread_mutex_unlock(&in->lock);
+        pthread_join(in->thread, NULL);
+    }
+    pthread_cond_destroy(&in->cond);
+    pthread_mutex_destroy(&in->lock);
+#endif
+    for (int i = 0; i < in->i_depth; i++) {
+        slot_release(in, &in->slots[i]);
+        free(in->slots[i].buf);
+    }
+    free(in->slots);
+    if (in->stream && in->stream != stdin) {
+        fclose(in->stream);
+    }
+    free(in);
+}
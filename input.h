@@ -0,0 +1,32 @@
+#ifndef RAW2MP4_INPUT_H
+#define RAW2MP4_INPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Raw frame input for the command line tool.
+//
+// Frames come either from one file per frame, which are memory mapped, or from a single stream of
+// back to back frames (a file, or stdin when the path is "-"). In builds with pthreads a reader
+// thread keeps up to i_read_ahead frames loaded ahead of the caller, so the encoder doesn't wait
+// on disk; without pthreads each frame is loaded when it's asked for.
+
+typedef struct input_t input_t;
+
+// The paths array must stay valid until input_close. i_read_ahead <= 0 picks a default.
+input_t *input_open_files(const char *const *paths, int n_paths, size_t frame_size, int i_read_ahead);
+input_t *input_open_stream(const char *path, size_t frame_size, int i_read_ahead);
+
+// Returns the next frame, valid until the next call to input_next or input_close, or NULL once the
+// input is exhausted or a read failed. Problems are reported on stderr.
+const uint8_t *input_next(input_t *in);
+
+// Non-zero if input_next stopped because of an error rather than the end of the input.
+int input_failed(const input_t *in);
+
+// Bytes handed out so far and the time the reader spent loading them.
+void input_stats(const input_t *in, uint64_t *bytes, double *load_seconds);
+
+void input_close(input_t *in);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef RAW2MP4_JSON_H
+#define RAW2MP4_JSON_H
+
+#include <stdio.h>
+
+// Writes s to out as a quoted JSON string, escaping quotes, backslashes and control characters,
+// for the paths and labels the command line tools copy into their JSON output.
+void json_print_string(FILE *out, const char *s);
+
+#endif
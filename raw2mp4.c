@@ -2,33 +2,80 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <x264.h>
 #include <lsmash.h>
 
+#include "raw2mp4.h"
+#include "convert.h"
+#include "workers.h"
+#include "input.h"
+#include "tiles.h"
+#include "batch.h"
+#include "capture.h"
+#include "json.h"
+
 #if __EMSCRIPTEN__
 #include <emscripten.h>
+// functions only called from JS need keeping alive through dead code elimination
+#define EXPORT EMSCRIPTEN_KEEPALIVE
+#else
+#define EXPORT
 #endif
 
-// API
-// all API fns return zero on success, non-zero on failure.
-extern int CompressionSessionOpen(const char *output_path, int w, int h);
-extern int CompressionSessionAddFrame(uint8_t *rgba); // len must be w * h * 4
-extern int CompressionSessionFinish(void);
+#if RAW2MP4_HAVE_THREADS
+#include <pthread.h>
+#endif
 
-// Globals
+// Session state
 typedef struct {
     x264_param_t param;
-    x264_picture_t pic;
+    x264_picture_t *pic; // serial mode's input picture, buffers.pics[0]
     x264_t *h;
+    int i_src_width;  // packed frames as passed in; param has the size that's encoded
+    int i_src_height;
     int i_frame;
     int i_frames_written;
     int64_t first_dts;
     int64_t last_dts;
     int64_t largest_pts;
     int64_t second_largest_pts;
+    int64_t i_last_input_pts; // pts of the last frame handed to x264; later ones were duplicates
 } encoder_state_t;
-static encoder_state_t encoder_state;
+
+// An encoded frame on its way from the encode thread to the mux thread. x264 reuses its NAL
+// memory on the next encode call, so the encode thread copies the payload straight into the
+// lsmash sample the mux thread will append.
+typedef struct {
+    lsmash_sample_t *sample;
+    x264_picture_t pic_out;
+} encoded_packet_t;
+
+#if RAW2MP4_HAVE_THREADS
+// Pipelined mode: the caller converts into pics[], the encode thread feeds them to x264 and the
+// mux thread appends the results to the mp4, so all three stages run at once.
+// Both rings hold i_depth entries and are FIFOs: entry [head] is the oldest, [head + count] the
+// next free one. A picture stays counted until x264_encoder_encode has returned, because x264
+// reads it during that call.
+typedef struct {
+    int b_enabled;
+    int i_depth;
+    pthread_t encode_thread;
+    pthread_t mux_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // broadcast on every change below
+    x264_picture_t *pics;
+    int i_pic_head;
+    int i_pic_count;
+    encoded_packet_t *packets;
+    int i_packet_head;
+    int i_packet_count;
+    int b_input_done;
+    int b_encode_done;
+} pipeline_state_t;
+#endif
 
 typedef struct {
     lsmash_root_t *p_root;
@@ -50,10 +97,158 @@ typedef struct {
     int b_dts_compress;
     int i_dts_compress_multiplier;
     int b_use_recovery;
+    uint32_t i_recovery_frames; // from the start of an intra refresh to a clean picture
     int b_fragments;
     lsmash_file_parameters_t file_param;
+    
+    // Samples appended since lsmash last wrote any out, and their bytes, as far as memory
+    // accounting can tell: lsmash writes a chunk once the next sample would take it past
+    // max_chunk_size, and a fragment when one is flushed. With a memory budget, fragments are also
+    // flushed once i_pool_limit bytes are pooled.
+    uint64_t i_pooled_bytes;
+    uint64_t i_table_samples; // samples whose table entries lsmash still holds
+    uint32_t i_pool_limit;
+    
+    // b_fast_start, for lsmash_finish_movie
+    int b_fast_start;
+    uint32_t i_fast_start_buffer;
+    void (*on_finish_progress)(void *opaque, uint64_t i_done, uint64_t i_total);
+    void *finish_opaque;
+    
+    // caller supplied sink, used instead of a file when write is set
+    int (*write)(void *opaque, const uint8_t *data, int size);
+    void *write_opaque;
+    
+    // in memory output, used instead of a file when b_memory is set
+    int b_memory;
+    uint8_t *p_memory;
+    size_t i_memory_size;
+    size_t i_memory_alloc;
+    size_t i_memory_pos;
+    uint64_t i_memory_reallocs;
 } mp4_state_t;
-static mp4_state_t mp4_state;
+
+// Per tile change tracking, for duplicate frame detection and incremental conversion.
+// prev_hashes describe the last frame converted; hashes is scratch for the new one.
+typedef struct {
+    int b_skip_duplicates;
+    int b_incremental;
+    int i_tiles;
+    uint64_t *hashes;
+    uint64_t *prev_hashes;
+    uint8_t *dirty;
+    int b_hashes_valid;  // prev_hashes match the picture
+    int b_picture_valid; // the picture incremental conversion updates holds the previous frame
+    x264_picture_t pic;  // that picture in pipelined mode; serial mode uses encoder->pic
+} frame_tiles_t;
+
+// Frames remembered for latency, by pts. x264 holds on to far fewer than this, even with frame
+// threads and a long lookahead.
+#define LATENCY_FRAMES 256
+
+// What session memory is for, as compression_memory_t breaks it down.
+typedef enum {
+    MEMORY_ENCODER = 0,
+    MEMORY_PICTURES,
+    MEMORY_TILES,
+    MEMORY_MUX,
+    MEMORY_OUTPUT,
+    MEMORY_KINDS
+} memory_kind_t;
+
+// Counters behind session_get_stats. Pipelined stages update them from their own threads, so
+// everything here is read and written under lock; the derived fields of counters are only
+// filled in on the way out.
+typedef struct {
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_t lock;
+#endif
+    compression_stats_t counters;
+    uint64_t i_x264_frames_out; // frames x264 has returned, for the encoder delay
+    double f_qp_sum;
+    int i_interval;
+    // when recent frames were passed in, at [pts % LATENCY_FRAMES]
+    int64_t input_pts[LATENCY_FRAMES];
+    uint64_t input_us[LATENCY_FRAMES];
+    uint64_t i_latency_sum_us;
+    uint64_t i_latency_frames;
+    // bytes held, by memory_kind_t, and the most they've added up to
+    uint64_t memory[MEMORY_KINDS];
+    uint64_t i_memory_peak;
+    compression_memory_t memory_settings; // the budget and x264 settings; the rest is filled in on the way out
+} session_stats_t;
+
+// Presets the governor moves between, fastest first. ultrafast is left out because x264 can't
+// reconfigure its way back out of subme 0, and the slower presets mostly differ in settings that
+// are fixed once the encoder is open.
+static const char *const governor_presets[] = { "superfast", "veryfast", "faster", "fast", "medium", "slow" };
+#define GOVERNOR_PRESETS (int)(sizeof(governor_presets) / sizeof(governor_presets[0]))
+// frames averaged for each decision
+#define GOVERNOR_WINDOW 16
+
+// Speed governor state, only touched by the thread calling x264_encoder_encode.
+typedef struct {
+    int i_level; // index into governor_presets, -1 when the governor is off
+    char *tune;  // to rebuild presets with
+    x264_param_t param; // what the encoder is running with; encoder->param is read by other threads
+    double f_budget_us;
+    uint64_t i_window_us;
+    int i_window_frames;
+} governor_t;
+
+// Everything a session allocates that another session of the same size can reuse.
+// Serial mode uses pics[0]; pipelined mode uses all of pics[] and packets[] as its rings.
+typedef struct {
+    int i_width;
+    int i_height;
+    x264_picture_t *pics;
+    int i_pics;
+    encoded_packet_t *packets;
+    int i_packets;
+    workers_t *workers;
+    uint8_t *inputs[2]; // session_acquire_input's frames, i_input_size bytes each
+    size_t i_input_size;
+} session_buffers_t;
+
+struct session_t {
+    encoder_state_t encoder;
+    mp4_state_t mp4;
+#if RAW2MP4_HAVE_THREADS
+    pipeline_state_t pipeline;
+#endif
+    session_buffers_t buffers;
+    session_pool_t *pool;
+    frame_tiles_t tiles;
+    int b_finished;
+    int b_failed;         // muxing failed, so nothing more goes into the mp4; under the stats lock
+    session_stats_t stats;
+    governor_t governor;
+    int i_input;          // which of buffers.inputs is handed out next
+    int b_input_acquired; // and it has been, but not committed yet
+    void (*on_sample)(void *opaque, const compression_sample_t *sample);
+    void *sample_opaque;
+};
+
+// Idle buffers from destroyed sessions, handed to the next session_open at the same size.
+struct session_pool_t {
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_t lock;
+#endif
+    int i_max_idle;
+    int i_idle;
+    session_buffers_t *idle;
+};
+
+// Backs the CompressionSession* functions.
+static session_t *default_session;
+// the built-in session's in memory mp4, kept after CompressionSessionFinish for the caller to read
+static uint8_t *default_output;
+static size_t default_output_size;
+// and its stats
+static compression_stats_t default_stats;
+static int b_default_stats_valid;
+// and its memory
+static compression_memory_t default_memory;
 
 #define CHK(cond, msg, ...) \
 do { \
@@ -65,51 +260,889 @@ do { \
     } \
 } while (0);
 
-static int mp4_write_headers(x264_nal_t *p_nal);
+// CHK for failures the caller can recover from, like a session that can't be opened: says why on
+// stderr and returns 1 rather than aborting.
+#define CHK_RETURN(cond, msg, ...) \
+do { \
+    if (!(cond)) { \
+        fprintf(stderr, msg "\n", ##__VA_ARGS__); \
+        return 1; \
+    } \
+} while (0);
+
+static int mp4_write_headers(session_t *s, x264_nal_t *p_nal);
 
+#if RAW2MP4_HAVE_THREADS
+static pthread_once_t global_init_once = PTHREAD_ONCE_INIT;
+// x264_encoder_open/close touch process-wide tables in builds configured with --disable-thread,
+// so sessions on different threads take turns opening and closing their encoders.
+static pthread_mutex_t x264_open_lock = PTHREAD_MUTEX_INITIALIZER;
 
-int CompressionSessionOpen(const char *output_path, int w, int h) {
+static int pipeline_start(session_t *s, int i_depth);
+#endif
+
+static void global_init(void) {
+    // resolve the conversion kernel up front rather than racing to do it from the workers
+    convert_get_backend();
+}
+
+static x264_t *open_encoder(x264_param_t *param) {
+#if RAW2MP4_HAVE_THREADS
+    pthread_once(&global_init_once, global_init);
+    pthread_mutex_lock(&x264_open_lock);
+    x264_t *h = x264_encoder_open(param);
+    pthread_mutex_unlock(&x264_open_lock);
+    return h;
+#else
+    global_init();
+    return x264_encoder_open(param);
+#endif
+}
+
+static void close_encoder(x264_t *h) {
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_lock(&x264_open_lock);
+    x264_encoder_close(h);
+    pthread_mutex_unlock(&x264_open_lock);
+#else
+    x264_encoder_close(h);
+#endif
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void stats_lock(session_t *s) {
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_lock(&s->stats.lock);
+#endif
+}
+
+static void stats_unlock(session_t *s) {
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_unlock(&s->stats.lock);
+#endif
+}
+
+// Muxing can fail on the mux thread, so the flag is read and written under the stats lock.
+static void session_set_failed(session_t *s) {
+    stats_lock(s);
+    s->b_failed = 1;
+    stats_unlock(s);
+}
+
+static int session_failed(session_t *s) {
+    stats_lock(s);
+    int b_failed = s->b_failed;
+    stats_unlock(s);
+    return b_failed;
+}
+
+// Sample table entries lsmash keeps for every sample until the movie, or fragment, is written:
+// stts, ctts, stsz and the sync and roll group entries, each in a list node of its own.
+#define MEMORY_TABLE_BYTES_PER_SAMPLE 128
+
+// With the stats lock held: the total held, which is also checked against the peak.
+static uint64_t memory_total_locked(session_t *s) {
+    uint64_t i_total = 0;
+    for (int i = 0; i < MEMORY_KINDS; i++) {
+        i_total += s->stats.memory[i];
+    }
+    if (i_total > s->stats.i_memory_peak) {
+        s->stats.i_memory_peak = i_total;
+    }
+    return i_total;
+}
+
+// Memory accounting goes through the stats lock, since the mux thread counts samples and output.
+static void memory_add(session_t *s, memory_kind_t kind, int64_t i_bytes) {
+    stats_lock(s);
+    s->stats.memory[kind] += i_bytes;
+    memory_total_locked(s);
+    stats_unlock(s);
+}
+
+static void memory_set(session_t *s, memory_kind_t kind, uint64_t i_bytes) {
+    stats_lock(s);
+    s->stats.memory[kind] = i_bytes;
+    memory_total_locked(s);
+    stats_unlock(s);
+}
+
+static uint64_t memory_total(session_t *s) {
+    stats_lock(s);
+    uint64_t i_total = memory_total_locked(s);
+    stats_unlock(s);
+    return i_total;
+}
+
+// Copies the counters out and fills in the fields derived from them.
+static void stats_snapshot(session_t *s, compression_stats_t *stats) {
+    stats_lock(s);
+    *stats = s->stats.counters;
+    uint64_t i_x264_frames_out = s->stats.i_x264_frames_out;
+    double f_qp_sum = s->stats.f_qp_sum;
+    uint64_t i_latency_sum_us = s->stats.i_latency_sum_us;
+    uint64_t i_latency_frames = s->stats.i_latency_frames;
+    stats_unlock(s);
+    
+    stats->i_encoder_delay = (int)(stats->i_frames_encoded - i_x264_frames_out);
+    stats->f_bytes_per_frame = stats->i_frames_out ? (double)stats->i_bytes_out / stats->i_frames_out : 0;
+    stats->f_average_qp = stats->i_frames_out ? f_qp_sum / stats->i_frames_out : 0;
+    stats->f_average_latency_us = i_latency_frames ? (double)i_latency_sum_us / i_latency_frames : 0;
+}
+
+static void stats_log(session_t *s) {
+    compression_stats_t st;
+    stats_snapshot(s, &st);
+    compression_memory_t memory;
+    session_get_memory(s, &memory);
+    char last_type[2] = { st.c_last_type, 0 };
+    fprintf(stderr,
+            "{\"frames_in\":%llu,\"frames_encoded\":%llu,\"frames_out\":%llu,\"duplicates\":%llu,"
+            "\"encoder_delay\":%d,\"bytes_out\":%llu,\"bytes_per_frame\":%.1f,"
+            "\"frames_i\":%llu,\"frames_p\":%llu,\"frames_b\":%llu,\"last_type\":\"%s\","
+            "\"last_qp\":%.2f,\"average_qp\":%.2f,"
+            "\"convert_us\":%llu,\"encode_us\":%llu,\"mux_us\":%llu,\"finish_us\":%llu,"
+            "\"finish_moved_bytes\":%llu,\"finish_buffer_bytes\":%llu,"
+            "\"buffer_allocs\":%llu,\"sample_allocs\":%llu,\"preset\":\"%s\",\"preset_changes\":%llu,"
+            "\"encoder_threads\":%d,\"last_latency_us\":%llu,\"average_latency_us\":%.0f,\"max_latency_us\":%llu,"
+            "\"memory_bytes\":%llu,\"peak_memory_bytes\":%llu}\n",
+            (unsigned long long)st.i_frames_in, (unsigned long long)st.i_frames_encoded,
+            (unsigned long long)st.i_frames_out, (unsigned long long)st.i_duplicates,
+            st.i_encoder_delay, (unsigned long long)st.i_bytes_out, st.f_bytes_per_frame,
+            (unsigned long long)st.i_frames_i, (unsigned long long)st.i_frames_p,
+            (unsigned long long)st.i_frames_b, last_type,
+            st.f_last_qp, st.f_average_qp,
+            (unsigned long long)st.i_convert_us, (unsigned long long)st.i_encode_us,
+            (unsigned long long)st.i_mux_us, (unsigned long long)st.i_finish_us,
+            (unsigned long long)st.i_finish_moved_bytes, (unsigned long long)st.i_finish_buffer_bytes,
+            (unsigned long long)st.i_buffer_allocs, (unsigned long long)st.i_sample_allocs,
+            st.preset ? st.preset : "", (unsigned long long)st.i_preset_changes, st.i_encoder_threads,
+            (unsigned long long)st.i_last_latency_us, st.f_average_latency_us, (unsigned long long)st.i_max_latency_us,
+            (unsigned long long)memory.i_total, (unsigned long long)memory.i_peak);
+}
+
+// A frame taken in by an AddFrame function, after i_convert_us of conversion or copying.
+static void stats_frame_in(session_t *s, uint64_t i_convert_us, int b_duplicate) {
+    stats_lock(s);
+    s->stats.counters.i_frames_in++;
+    s->stats.counters.i_duplicates += b_duplicate;
+    s->stats.counters.i_convert_us += i_convert_us;
+    stats_unlock(s);
+}
+
+// One x264_encoder_encode call, with a picture or flushing, which took i_encode_us.
+static void stats_encoded(session_t *s, int b_input, int b_output, uint64_t i_encode_us) {
+    stats_lock(s);
+    s->stats.counters.i_frames_encoded += b_input;
+    s->stats.i_x264_frames_out += b_output;
+    s->stats.counters.i_encode_us += i_encode_us;
+    stats_unlock(s);
+}
+
+// Remembers that the frame given i_pts was passed in at i_in_us.
+static void stats_frame_timed(session_t *s, int64_t i_pts, uint64_t i_in_us) {
+    int i = (int)(i_pts % LATENCY_FRAMES);
+    stats_lock(s);
+    s->stats.input_pts[i] = i_pts;
+    s->stats.input_us[i] = i_in_us;
+    stats_unlock(s);
+}
+
+// Time since the frame given i_pts was passed in, or -1 if it wasn't timed.
+static int64_t stats_latency(session_t *s, int64_t i_pts) {
+    int i = (int)(i_pts % LATENCY_FRAMES);
+    int64_t i_latency_us = -1;
+    uint64_t i_now = now_us();
+    stats_lock(s);
+    if (s->stats.input_pts[i] == i_pts) {
+        i_latency_us = (int64_t)(i_now - s->stats.input_us[i]);
+    }
+    stats_unlock(s);
+    return i_latency_us;
+}
+
+// A sample of i_size bytes appended to the mp4 in i_mux_us, i_latency_us after its frame came in
+// (-1 if unknown). Logs every i_interval frames.
+static void stats_muxed(session_t *s, const x264_picture_t *pic_out, int i_size, uint64_t i_mux_us, int64_t i_latency_us) {
+    compression_stats_t *c = &s->stats.counters;
+    double f_qp = pic_out->i_qpplus1 - 1;
+    
+    stats_lock(s);
+    c->i_frames_out++;
+    c->i_bytes_out += i_size;
+    if (IS_X264_TYPE_I(pic_out->i_type)) {
+        c->i_frames_i++;
+        c->c_last_type = 'I';
+    } else if (IS_X264_TYPE_B(pic_out->i_type)) {
+        c->i_frames_b++;
+        c->c_last_type = 'B';
+    } else {
+        c->i_frames_p++;
+        c->c_last_type = 'P';
+    }
+    c->f_last_qp = f_qp;
+    s->stats.f_qp_sum += f_qp;
+    c->i_mux_us += i_mux_us;
+    if (i_latency_us >= 0) {
+        c->i_last_latency_us = i_latency_us;
+        if ((uint64_t)i_latency_us > c->i_max_latency_us) {
+            c->i_max_latency_us = i_latency_us;
+        }
+        s->stats.i_latency_sum_us += i_latency_us;
+        s->stats.i_latency_frames++;
+    }
+    // the in memory output only grows while muxing, on this thread
+    c->i_buffer_allocs = s->mp4.i_memory_reallocs;
+    int b_log = s->stats.i_interval && c->i_frames_out % s->stats.i_interval == 0;
+    stats_unlock(s);
+    
+    if (b_log) {
+        stats_log(s);
+    }
+}
+
+// Switches the encoder to governor_presets[i_level]. Only what the preset decides about analysis
+// is taken from it; rate control, GOP structure and anything the profile restricted stay as they
+// were opened. x264 applies the change from the next frame, and rejects it as a whole if it can't.
+static void governor_apply(session_t *s, int i_level) {
+    governor_t *g = &s->governor;
+    
+    x264_param_t preset;
+    if (x264_param_default_preset(&preset, governor_presets[i_level], g->tune) < 0) {
+        return;
+    }
+    x264_param_t param = g->param;
+    int b_transform_8x8 = param.analyse.b_transform_8x8;
+    int i_weighted_pred = param.analyse.i_weighted_pred;
+    param.analyse = preset.analyse;
+    param.analyse.b_transform_8x8 = b_transform_8x8;
+    param.analyse.i_weighted_pred = i_weighted_pred;
+    param.analyse.b_psnr = g->param.analyse.b_psnr;
+    param.analyse.b_ssim = g->param.analyse.b_ssim;
+    if (x264_encoder_reconfig(s->encoder.h, &param) != 0) {
+        return;
+    }
+    g->param = param;
+    g->i_level = i_level;
+    
+    stats_lock(s);
+    s->stats.counters.preset = governor_presets[i_level];
+    s->stats.counters.i_preset_changes++;
+    stats_unlock(s);
+}
+
+// Called after each frame x264 encodes. Every GOVERNOR_WINDOW frames, moves one preset faster when
+// the average is over budget, or one slower when it's under half of it; each step roughly doubles
+// or halves the cost, so the gap keeps it from flapping between two presets.
+static void governor_update(session_t *s, uint64_t i_encode_us) {
+    governor_t *g = &s->governor;
+    
+    if (g->i_level < 0) {
+        return;
+    }
+    g->i_window_us += i_encode_us;
+    if (++g->i_window_frames < GOVERNOR_WINDOW) {
+        return;
+    }
+    double f_average_us = (double)g->i_window_us / g->i_window_frames;
+    g->i_window_us = 0;
+    g->i_window_frames = 0;
+    
+    if (f_average_us > g->f_budget_us && g->i_level > 0) {
+        governor_apply(s, g->i_level - 1);
+    } else if (f_average_us < g->f_budget_us / 2 && g->i_level < GOVERNOR_PRESETS - 1) {
+        governor_apply(s, g->i_level + 1);
+    }
+}
+
+static void pool_lock(session_pool_t *pool) {
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_lock(&pool->lock);
+#endif
+}
+
+static void pool_unlock(session_pool_t *pool) {
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+session_pool_t *session_pool_create(int i_max_idle) {
+    session_pool_t *pool = calloc(1, sizeof(session_pool_t));
+    if (!pool) {
+        return NULL;
+    }
+    pool->i_max_idle = i_max_idle > 0 ? i_max_idle : 1;
+    pool->idle = calloc(pool->i_max_idle, sizeof(session_buffers_t));
+    if (!pool->idle) {
+        free(pool);
+        return NULL;
+    }
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_init(&pool->lock, NULL);
+#endif
+    return pool;
+}
+
+static void buffers_free(session_buffers_t *buffers) {
+    for (int i = 0; i < buffers->i_pics; i++) {
+        x264_picture_clean(&buffers->pics[i]);
+    }
+    free(buffers->pics);
+    free(buffers->packets);
+    free(buffers->inputs[0]);
+    free(buffers->inputs[1]);
+    workers_destroy(buffers->workers);
+    memset(buffers, 0, sizeof(session_buffers_t));
+}
+
+void session_pool_destroy(session_pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    for (int i = 0; i < pool->i_idle; i++) {
+        buffers_free(&pool->idle[i]);
+    }
+    free(pool->idle);
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_destroy(&pool->lock);
+#endif
+    free(pool);
+}
+
+// Takes the idle buffers for a w x h session out of the pool, if it has any.
+static void pool_take(session_pool_t *pool, int w, int h, session_buffers_t *buffers) {
+    pool_lock(pool);
+    for (int i = pool->i_idle - 1; i >= 0; i--) {
+        if (pool->idle[i].i_width == w && pool->idle[i].i_height == h) {
+            *buffers = pool->idle[i];
+            pool->idle[i] = pool->idle[--pool->i_idle];
+            break;
+        }
+    }
+    pool_unlock(pool);
+}
+
+// Parks a session's buffers in the pool, evicting the oldest idle set when full.
+static void pool_give(session_pool_t *pool, session_buffers_t *buffers) {
+    session_buffers_t evicted = { 0 };
+    
+    pool_lock(pool);
+    if (pool->i_idle == pool->i_max_idle) {
+        evicted = pool->idle[0];
+        memmove(&pool->idle[0], &pool->idle[1], (pool->i_idle - 1) * sizeof(session_buffers_t));
+        pool->i_idle--;
+    }
+    pool->idle[pool->i_idle++] = *buffers;
+    pool_unlock(pool);
+    
+    buffers_free(&evicted);
+    memset(buffers, 0, sizeof(session_buffers_t));
+}
+
+// Makes sure the session has i_pics pictures, i_packets packet buffers and an i_threads worker
+// pool, keeping whatever it got from the pool.
+static int buffers_prepare(session_t *s, int i_pics, int i_packets, int i_threads) {
+    session_buffers_t *buffers = &s->buffers;
+    x264_param_t *param = &s->encoder.param;
+    
+    buffers->i_width = param->i_width;
+    buffers->i_height = param->i_height;
+    
+    if (buffers->i_pics < i_pics) {
+        x264_picture_t *pics = realloc(buffers->pics, i_pics * sizeof(x264_picture_t));
+        CHK_RETURN(pics != NULL, "out of memory for pictures");
+        buffers->pics = pics;
+        for (; buffers->i_pics < i_pics; buffers->i_pics++) {
+            CHK_RETURN(x264_picture_alloc(&pics[buffers->i_pics], param->i_csp, param->i_width, param->i_height) == 0, "out of memory for pictures");
+        }
+    }
+    
+    if (buffers->i_packets < i_packets) {
+        encoded_packet_t *packets = realloc(buffers->packets, i_packets * sizeof(encoded_packet_t));
+        CHK_RETURN(packets != NULL, "out of memory for packets");
+        memset(&packets[buffers->i_packets], 0, (i_packets - buffers->i_packets) * sizeof(encoded_packet_t));
+        buffers->packets = packets;
+        buffers->i_packets = i_packets;
+    }
+    
+    if (i_threads <= 0) {
+        i_threads = workers_cpu_count();
+    }
+    if (workers_count(buffers->workers) != i_threads) {
+        workers_destroy(buffers->workers);
+        buffers->workers = NULL;
+        if (i_threads > 1) {
+            buffers->workers = workers_create(i_threads);
+            CHK_RETURN(buffers->workers != NULL, "can't start %d conversion threads", i_threads);
+        }
+    }
+    return 0;
+}
+
+// The session's own pictures: the serial picture or the pipeline ring, a pipelined session's
+// incremental picture and session_acquire_input's frames.
+static void memory_count_pictures(session_t *s) {
+    uint64_t i_picture = (uint64_t)s->encoder.param.i_width * s->encoder.param.i_height * 3 / 2;
+    uint64_t i_bytes = s->buffers.i_pics * i_picture + 2 * (uint64_t)s->buffers.i_input_size;
+    if (s->tiles.pic.img.plane[0]) {
+        i_bytes += i_picture;
+    }
+    memory_set(s, MEMORY_PICTURES, i_bytes);
+}
+
+// x264 pads its planes by 32 pixels on each side of the macroblock aligned size.
+#define ENCODER_PAD 32
+
+// What x264 allocates for param with i_threads threads. It has an allocator of its own, so this
+// is estimated from the frames it can hold. Frames it encodes from hold the picture and the half
+// size planes the lookahead analyses; frames it reconstructs into, which become references, hold
+// the luma plane, its three half-pel interpolations and chroma. Both carry per macroblock data.
+static uint64_t encoder_memory_estimate(const x264_param_t *param, int i_threads) {
+    uint64_t i_mbs = (uint64_t)((param->i_width + 15) / 16) * ((param->i_height + 15) / 16);
+    uint64_t i_luma = (uint64_t)(((param->i_width + 15) & ~15) + 2 * ENCODER_PAD)
+                    * (((param->i_height + 15) & ~15) + 2 * ENCODER_PAD);
+    uint64_t i_fenc = i_luma * 3 / 2 + i_luma + i_mbs * 64;
+    uint64_t i_fdec = i_luma * 4 + i_luma / 2 + i_mbs * 256;
+    // x264's automatic sync lookahead is a frame per B-frame for frame threads
+    int i_sync_lookahead = param->i_sync_lookahead >= 0 ? param->i_sync_lookahead
+                         : i_threads > 1 && !param->b_sliced_threads ? param->i_bframe + 1 : 0;
+    int i_lookahead = param->rc.i_lookahead > 0 ? param->rc.i_lookahead : 0;
+    uint64_t n_fenc = i_lookahead + i_sync_lookahead + param->i_bframe + i_threads + 1;
+    uint64_t n_fdec = param->i_frame_reference + i_threads + 1;
+    // plus each thread's macroblock caches and bitstream buffer
+    return n_fenc * i_fenc + n_fdec * i_fdec + i_threads * (i_mbs * 512 + (1 << 20));
+}
+
+// Cuts param down until x264 fits in i_budget, in the order compression_options_t gives. Returns 0
+// once it does, or non-zero if it can't. Automatic threads count as one here, since what x264 makes
+// of them depends on how it was built; session_init checks again once it knows.
+static int encoder_fit_memory(x264_param_t *param, uint64_t i_budget) {
+    for (;;) {
+        int i_threads = param->i_threads > 0 ? param->i_threads : 1;
+        if (encoder_memory_estimate(param, i_threads) <= i_budget) {
+            return 0;
+        }
+        if (param->i_sync_lookahead != 0) {
+            param->i_sync_lookahead = 0;
+        } else if (param->rc.i_lookahead > 0) {
+            param->rc.i_lookahead /= 2;
+            // mbtree works from the lookahead
+            param->rc.b_mb_tree = param->rc.b_mb_tree && param->rc.i_lookahead > 0;
+        } else if (param->i_bframe > 0) {
+            param->i_bframe--;
+        } else if (param->i_frame_reference > 1) {
+            param->i_frame_reference--;
+        } else if (i_threads > 1) {
+            param->i_threads = i_threads / 2;
+        } else {
+            return 1;
+        }
+    }
+}
+
+void CompressionSessionDefaultOptions(compression_options_t *opts) {
+    memset(opts, 0, sizeof(compression_options_t));
+    opts->preset = "veryfast";
+    opts->tune = NULL;
+    opts->profile = "main";
+    opts->i_fps_num = 15;
+    opts->i_fps_den = 1;
+    opts->f_crf = 23;
+    opts->i_bitrate = 0;
+    opts->i_keyint = 0;
+    opts->i_output_width = 0;
+    opts->i_output_height = 0;
+    opts->f_target_fps = 0;
+    opts->i_encoder_threads = 1;
+    opts->b_sliced_threads = 0;
+    opts->i_lookahead_threads = 0;
+    opts->i_convert_threads = 1;
+    opts->b_pipeline = 0;
+    opts->i_queue_depth = 3;
+    opts->pool = NULL;
+    opts->b_fragmented = 0;
+    opts->write = NULL;
+    opts->write_opaque = NULL;
+    opts->b_memory_output = 0;
+    opts->b_fast_start = 0;
+    opts->i_fast_start_buffer = 0;
+    opts->on_finish_progress = NULL;
+    opts->finish_opaque = NULL;
+    opts->b_skip_duplicates = 0;
+    opts->b_incremental_convert = 0;
+    opts->i_stats_interval = 0;
+    opts->b_live = 0;
+    opts->on_sample = NULL;
+    opts->sample_opaque = NULL;
+    opts->i_memory_budget = 0;
+}
+
+static int mp4_sink_write(void *opaque, uint8_t *buf, int size) {
+    mp4_state_t *p_mp4 = &((session_t *)opaque)->mp4;
+    return p_mp4->write(p_mp4->write_opaque, buf, size);
+}
+
+// The in memory file grows geometrically so a long clip costs O(log n) reallocs. Under a memory
+// budget it doesn't grow past what the budget has left unless it has to.
+static int mp4_memory_write(void *opaque, uint8_t *buf, int size) {
+    session_t *s = opaque;
+    mp4_state_t *p_mp4 = &s->mp4;
+    size_t end = p_mp4->i_memory_pos + size;
+    
+    if (end > p_mp4->i_memory_alloc) {
+        size_t alloc = p_mp4->i_memory_alloc ? p_mp4->i_memory_alloc : 1024 * 1024;
+        while (alloc < end) {
+            alloc *= 2;
+        }
+        uint64_t i_budget = s->stats.memory_settings.i_budget;
+        if (i_budget) {
+            uint64_t i_others = memory_total(s) - p_mp4->i_memory_alloc;
+            uint64_t i_room = i_budget > i_others ? i_budget - i_others : 0;
+            if (alloc > i_room) {
+                alloc = end > i_room ? end : (size_t)i_room;
+            }
+        }
+        uint8_t *p = realloc(p_mp4->p_memory, alloc);
+        if (!p) {
+            fprintf(stderr, "out of memory growing the mp4 output to %zu bytes\n", alloc);
+            return -1;
+        }
+        memory_add(s, MEMORY_OUTPUT, (int64_t)alloc - (int64_t)p_mp4->i_memory_alloc);
+        p_mp4->p_memory = p;
+        p_mp4->i_memory_alloc = alloc;
+        p_mp4->i_memory_reallocs++;
+    }
+    if (p_mp4->i_memory_pos > p_mp4->i_memory_size) {
+        // seeked past the end; the gap reads back as zeros like it would in a file
+        memset(p_mp4->p_memory + p_mp4->i_memory_size, 0, p_mp4->i_memory_pos - p_mp4->i_memory_size);
+    }
+    memcpy(p_mp4->p_memory + p_mp4->i_memory_pos, buf, size);
+    p_mp4->i_memory_pos = end;
+    if (end > p_mp4->i_memory_size) {
+        p_mp4->i_memory_size = end;
+    }
+    return size;
+}
+
+static int mp4_memory_read(void *opaque, uint8_t *buf, int size) {
+    mp4_state_t *p_mp4 = &((session_t *)opaque)->mp4;
+    size_t available = p_mp4->i_memory_pos < p_mp4->i_memory_size ? p_mp4->i_memory_size - p_mp4->i_memory_pos : 0;
+    if ((size_t)size > available) {
+        size = (int)available;
+    }
+    memcpy(buf, p_mp4->p_memory + p_mp4->i_memory_pos, size);
+    p_mp4->i_memory_pos += size;
+    return size;
+}
+
+static int64_t mp4_memory_seek(void *opaque, int64_t offset, int whence) {
+    mp4_state_t *p_mp4 = &((session_t *)opaque)->mp4;
+    int64_t base = whence == SEEK_CUR ? (int64_t)p_mp4->i_memory_pos
+                 : whence == SEEK_END ? (int64_t)p_mp4->i_memory_size
+                 : 0;
+    if (base + offset < 0) {
+        return -1;
+    }
+    p_mp4->i_memory_pos = (size_t)(base + offset);
+    return base + offset;
+}
+
+// Sets up file_param the way lsmash_open_file would, but for the caller's callback or the in
+// memory buffer. The callback can't seek, so that movie has to be fragmented.
+static void mp4_open_sink(session_t *s, const compression_options_t *opts) {
+    mp4_state_t *p_mp4 = &s->mp4;
+    lsmash_file_parameters_t *file_param = &p_mp4->file_param;
+    memset(file_param, 0, sizeof(lsmash_file_parameters_t));
+    file_param->mode = LSMASH_FILE_MODE_WRITE | LSMASH_FILE_MODE_BOX
+                     | LSMASH_FILE_MODE_INITIALIZATION | LSMASH_FILE_MODE_MEDIA;
+    file_param->opaque = s;
+    file_param->max_chunk_duration = 0.5;
+    file_param->max_async_tolerance = 2.0;
+    file_param->max_chunk_size = 4 * 1024 * 1024;
+    file_param->max_read_size = 4 * 1024 * 1024;
+    
+    if (opts->write) {
+        file_param->mode |= LSMASH_FILE_MODE_FRAGMENTED;
+        file_param->write = mp4_sink_write;
+        p_mp4->write = opts->write;
+        p_mp4->write_opaque = opts->write_opaque;
+    } else {
+        if (p_mp4->b_fragments) {
+            file_param->mode |= LSMASH_FILE_MODE_FRAGMENTED;
+        }
+        file_param->write = mp4_memory_write;
+        file_param->read = mp4_memory_read;
+        file_param->seek = mp4_memory_seek;
+        p_mp4->b_memory = 1;
+    }
+}
+
+// Files opened by lsmash_open_file are closed with lsmash_close_file; our own sinks have nothing
+// to close.
+static void mp4_close_output(mp4_state_t *p_mp4) {
+    if (!p_mp4->write && !p_mp4->b_memory) {
+        lsmash_close_file(&p_mp4->file_param);
+    }
+}
+
+static int session_init(session_t *s, const char *output_path, int w, int h, const compression_options_t *opts) {
+    encoder_state_t *encoder = &s->encoder;
+    mp4_state_t *p_mp4 = &s->mp4;
+    
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_init(&s->stats.lock, NULL);
+#endif
+    s->stats.i_interval = opts->i_stats_interval > 0 ? opts->i_stats_interval : 0;
+    for (int i = 0; i < LATENCY_FRAMES; i++) {
+        s->stats.input_pts[i] = -1;
+    }
+    s->on_sample = opts->on_sample;
+    s->sample_opaque = opts->sample_opaque;
+    
+    CHK_RETURN(w > 0 && h > 0, "can't encode %dx%d frames", w, h);
+    
+    // Frames are scaled down to the output size while they're converted, keeping the aspect ratio
+    // when only one side is given.
+    int i_out_w = opts->i_output_width > 0 ? opts->i_output_width : 0;
+    int i_out_h = opts->i_output_height > 0 ? opts->i_output_height : 0;
+    if (!i_out_w && i_out_h) {
+        i_out_w = (int)((int64_t)w * i_out_h / h) & ~1;
+    } else if (i_out_w && !i_out_h) {
+        i_out_h = (int)((int64_t)h * i_out_w / w) & ~1;
+    } else if (!i_out_w) {
+        i_out_w = w;
+        i_out_h = h;
+    }
+    int b_scaled = i_out_w != w || i_out_h != h;
+    if (b_scaled) {
+        CHK_RETURN(i_out_w > 0 && i_out_h > 0 && i_out_w <= w && i_out_h <= h && !(i_out_w & 1) && !(i_out_h & 1),
+            "can't scale %dx%d frames to %dx%d", w, h, i_out_w, i_out_h);
+    } else {
+        // 4:2:0 chroma is half size both ways
+        CHK_RETURN(!(w & 1) && !(h & 1), "can't encode %dx%d frames, the width and height have to be even", w, h);
+    }
+    encoder->i_src_width = w;
+    encoder->i_src_height = h;
+    
     // Configure x264 encoder
-    x264_param_default_preset(&encoder_state.param, "veryfast", NULL);
-    encoder_state.param.i_bitdepth = 8;
-    encoder_state.param.i_csp = X264_CSP_I420;
-    encoder_state.param.i_width  = w;
-    encoder_state.param.i_height = h;
-    encoder_state.param.b_vfr_input = 1;
-    encoder_state.param.i_fps_num = 15;
-    encoder_state.param.i_fps_den = 1;
-    encoder_state.param.i_timebase_num = encoder_state.param.i_fps_den;
-    encoder_state.param.i_timebase_den = encoder_state.param.i_fps_num;
-    encoder_state.param.b_repeat_headers = 0;
-    encoder_state.param.b_annexb = 0;
-    
-    CHK(x264_param_apply_profile(&encoder_state.param, "main") == 0, "apply profile");
+    const char *preset = opts->preset ? opts->preset : "veryfast";
+    const char *profile = opts->profile ? opts->profile : "main";
+    CHK_RETURN(x264_param_default_preset(&encoder->param, preset, opts->tune) == 0,
+        "unknown preset %s or tune %s", preset, opts->tune ? opts->tune : "(none)");
+    encoder->param.i_bitdepth = 8;
+    encoder->param.i_csp = X264_CSP_I420;
+    encoder->param.i_width  = i_out_w;
+    encoder->param.i_height = i_out_h;
+    encoder->param.b_vfr_input = 1;
+    encoder->param.i_fps_num = opts->i_fps_num > 0 ? opts->i_fps_num : 15;
+    encoder->param.i_fps_den = opts->i_fps_den > 0 ? opts->i_fps_den : 1;
+    encoder->param.i_timebase_num = encoder->param.i_fps_den;
+    encoder->param.i_timebase_den = encoder->param.i_fps_num;
+    encoder->param.b_repeat_headers = 0;
+    encoder->param.b_annexb = 0;
+    encoder->param.vui.b_fullrange = 1; // convert.c produces full range (JFIF) YUV
+    if (opts->i_bitrate > 0) {
+        encoder->param.rc.i_rc_method = X264_RC_ABR;
+        encoder->param.rc.i_bitrate = opts->i_bitrate;
+    } else {
+        encoder->param.rc.i_rc_method = X264_RC_CRF;
+        encoder->param.rc.f_rf_constant = opts->f_crf > 0 ? opts->f_crf : 23;
+    }
+    if (opts->i_keyint > 0) {
+        encoder->param.i_keyint_max = opts->i_keyint;
+    }
+    encoder->param.i_threads = opts->i_encoder_threads > 0 ? opts->i_encoder_threads : X264_THREADS_AUTO;
+    // tune zerolatency turns sliced threads on by itself
+    if (opts->b_sliced_threads) {
+        encoder->param.b_sliced_threads = 1;
+    }
+    if (opts->i_lookahead_threads > 0) {
+        encoder->param.i_lookahead_threads = opts->i_lookahead_threads;
+    }
+    // Live mode: nothing that makes x264 hold frames back. B-frames wait for the frame after them,
+    // the lookahead and mbtree for a window of frames, and frame threads for each other.
+    if (opts->b_live) {
+        encoder->param.i_bframe = 0;
+        encoder->param.rc.i_lookahead = 0;
+        encoder->param.i_sync_lookahead = 0;
+        encoder->param.rc.b_mb_tree = 0;
+        encoder->param.b_intra_refresh = 1;
+        if (encoder->param.i_threads != 1) {
+            encoder->param.b_sliced_threads = 1;
+        }
+    }
+    
+    CHK_RETURN(x264_param_apply_profile(&encoder->param, profile) == 0, "x264 can't apply profile %s to these settings", profile);
+    
+    // Fit the session to its memory budget before anything big is allocated, so one that can't fit
+    // fails to open rather than aborting part way through. Our pictures and tiles are fixed by the
+    // size and options; x264 gets what's left after them, lsmash's pool and any output's share.
+    s->stats.memory_settings.i_budget = opts->i_memory_budget;
+    uint64_t i_encoder_budget = 0;
+    if (opts->i_memory_budget) {
+        uint64_t i_budget = opts->i_memory_budget;
+        uint64_t i_picture = (uint64_t)i_out_w * i_out_h * 3 / 2;
+        uint64_t i_pictures = i_picture;
+#if RAW2MP4_HAVE_THREADS
+        if (opts->b_pipeline) {
+            int i_depth = opts->i_queue_depth < 1 ? 1 : opts->i_queue_depth;
+            i_pictures = i_depth * i_picture + (opts->b_incremental_convert ? i_picture : 0);
+        }
+#endif
+        uint64_t i_tiles = opts->b_skip_duplicates || opts->b_incremental_convert
+                         ? (uint64_t)tiles_across(w) * tiles_down(h) * (2 * sizeof(uint64_t) + 1) : 0;
+        uint64_t i_pool = i_budget / 16;
+        p_mp4->i_pool_limit = i_pool < 256 * 1024 ? 256 * 1024 : i_pool > 4 * 1024 * 1024 ? 4 * 1024 * 1024 : (uint32_t)i_pool;
+        uint64_t i_fixed = i_pictures + i_tiles + p_mp4->i_pool_limit + (opts->b_memory_output ? i_budget / 4 : 0);
+        i_encoder_budget = i_fixed < i_budget ? i_budget - i_fixed : 0;
+        if (!i_encoder_budget || encoder_fit_memory(&encoder->param, i_encoder_budget) != 0) {
+            fprintf(stderr, "A %dx%d session doesn't fit in a memory budget of %.1f MB\n",
+                    i_out_w, i_out_h, i_budget / 1048576.0);
+            return 1;
+        }
+    }
+    
+    s->governor.i_level = -1;
+    if (opts->f_target_fps > 0) {
+        for (int i = 0; i < GOVERNOR_PRESETS; i++) {
+            if (strcmp(preset, governor_presets[i]) == 0) {
+                s->governor.i_level = i;
+            }
+        }
+        CHK_RETURN(s->governor.i_level >= 0, "the governor can't start from preset %s", preset);
+        s->governor.f_budget_us = 1e6 / opts->f_target_fps;
+        s->governor.param = encoder->param;
+        if (opts->tune) {
+            s->governor.tune = strdup(opts->tune);
+            CHK_RETURN(s->governor.tune != NULL, "out of memory for the governor");
+        }
+    }
+    for (int i = 0; x264_preset_names[i]; i++) {
+        if (strcmp(preset, x264_preset_names[i]) == 0) {
+            s->stats.counters.preset = x264_preset_names[i];
+        }
+    }
         
-    CHK(x264_picture_alloc(&encoder_state.pic,  encoder_state.param.i_csp, encoder_state.param.i_width, encoder_state.param.i_height) == 0, "picture alloc");
+    encoder->h = open_encoder(&encoder->param);
+    CHK_RETURN(encoder->h != NULL, "x264 couldn't open a %dx%d encoder", i_out_w, i_out_h);
+    // x264 resolves automatic thread counts, and drops to one without thread support
+    x264_param_t actual;
+    x264_encoder_parameters(encoder->h, &actual);
+    // automatic threads may have come to more than the budget allowed for, so fit again with them
+    if (i_encoder_budget && encoder_memory_estimate(&actual, actual.i_threads) > i_encoder_budget) {
+        close_encoder(encoder->h);
+        encoder->h = NULL;
+        encoder->param.i_threads = actual.i_threads;
+        if (encoder_fit_memory(&encoder->param, i_encoder_budget) != 0) {
+            fprintf(stderr, "A %dx%d session doesn't fit in a memory budget of %.1f MB\n",
+                    i_out_w, i_out_h, opts->i_memory_budget / 1048576.0);
+            return 1;
+        }
+        if (s->governor.i_level >= 0) {
+            s->governor.param = encoder->param;
+        }
+        encoder->h = open_encoder(&encoder->param);
+        CHK_RETURN(encoder->h != NULL, "x264 couldn't open a %dx%d encoder", i_out_w, i_out_h);
+        x264_encoder_parameters(encoder->h, &actual);
+    }
+    s->stats.counters.i_encoder_threads = actual.i_threads;
+    memory_set(s, MEMORY_ENCODER, encoder_memory_estimate(&actual, actual.i_threads > 0 ? actual.i_threads : 1));
+    s->stats.memory_settings.i_lookahead = actual.rc.i_lookahead;
+    s->stats.memory_settings.i_bframe = actual.i_bframe;
+    s->stats.memory_settings.i_frame_reference = actual.i_frame_reference;
+    s->stats.memory_settings.i_threads = actual.i_threads;
+    
+    s->pool = opts->pool;
+    if (s->pool) {
+        pool_take(s->pool, i_out_w, i_out_h, &s->buffers);
+    }
+    
+#if RAW2MP4_HAVE_THREADS
+    if (opts->b_pipeline) {
+        int i_depth = opts->i_queue_depth < 1 ? 1 : opts->i_queue_depth;
+        if (buffers_prepare(s, i_depth, i_depth, opts->i_convert_threads) != 0 || pipeline_start(s, i_depth) != 0) {
+            return 1;
+        }
+    } else
+#endif
+    {
+        if (buffers_prepare(s, 1, 0, opts->i_convert_threads) != 0) {
+            return 1;
+        }
+        encoder->pic = &s->buffers.pics[0];
+    }
     
-    encoder_state.h = x264_encoder_open(&encoder_state.param);
-    CHK(encoder_state.h != NULL, "encoder open");
+    if (opts->b_skip_duplicates || opts->b_incremental_convert) {
+        frame_tiles_t *tiles = &s->tiles;
+        tiles->i_tiles = tiles_across(w) * tiles_down(h);
+        tiles->hashes = malloc(tiles->i_tiles * sizeof(uint64_t));
+        tiles->prev_hashes = malloc(tiles->i_tiles * sizeof(uint64_t));
+        tiles->dirty = malloc(tiles->i_tiles);
+        CHK_RETURN(tiles->hashes != NULL && tiles->prev_hashes != NULL && tiles->dirty != NULL, "out of memory for tile hashes");
+        memory_set(s, MEMORY_TILES, tiles->i_tiles * (2 * sizeof(uint64_t) + 1));
+        tiles->b_skip_duplicates = opts->b_skip_duplicates;
+        // tiles are in source pixels, which don't map onto whole tiles of a scaled picture
+        tiles->b_incremental = opts->b_incremental_convert && !b_scaled;
+#if RAW2MP4_HAVE_THREADS
+        if (tiles->b_incremental && s->pipeline.b_enabled) {
+            CHK_RETURN(x264_picture_alloc(&tiles->pic, encoder->param.i_csp, i_out_w, i_out_h) == 0, "out of memory for the incremental picture");
+        }
+#endif
+    }
+    memory_count_pictures(s);
     
-    // Configure lsmash
-    mp4_state.b_dts_compress = 0;
-    mp4_state.b_use_recovery = 0;
-    mp4_state.b_fragments = 0;
-    mp4_state.b_stdout = 0;
+    // Configure lsmash. stdout and callback sinks can't seek back to patch the moov, which is what
+    // b_stdout tells mp4_close_file.
+    p_mp4->b_dts_compress = 0;
+    // intra refresh keyframes aren't IDRs, so the mp4 needs roll groups to say where they're clean
+    p_mp4->b_use_recovery = encoder->param.b_intra_refresh;
+    if (p_mp4->b_use_recovery) {
+        // the recovery_frame_cnt x264 writes into the recovery point SEI
+        int i_mb_width = (encoder->param.i_width + 15) / 16;
+        int i_recovery = (i_mb_width - 1 < encoder->param.i_keyint_max ? i_mb_width - 1 : encoder->param.i_keyint_max)
+                       + encoder->param.i_bframe - 1;
+        p_mp4->i_recovery_frames = i_recovery > 0 ? i_recovery : 0;
+    }
+    p_mp4->b_stdout = opts->write != NULL || (!opts->b_memory_output && strcmp(output_path, "-") == 0);
+    p_mp4->b_fragments = opts->b_fragmented || p_mp4->b_stdout;
+    p_mp4->b_fast_start = opts->b_fast_start && !p_mp4->b_fragments;
+    p_mp4->i_fast_start_buffer = opts->i_fast_start_buffer ? opts->i_fast_start_buffer : 4 * 1024 * 1024;
+    p_mp4->on_finish_progress = opts->on_finish_progress;
+    p_mp4->finish_opaque = opts->finish_opaque;
     
-    mp4_state.p_root = lsmash_create_root();
+    p_mp4->p_root = lsmash_create_root();
+    CHK_RETURN(p_mp4->p_root != NULL, "failed to create an lsmash root");
     
-    CHK(lsmash_open_file(output_path, 0, &mp4_state.file_param) == 0, "Unable to open file %s", output_path);
+    if (opts->write || opts->b_memory_output) {
+        mp4_open_sink(s, opts);
+    } else {
+        CHK_RETURN(lsmash_open_file(output_path, 0, &p_mp4->file_param) == 0, "Unable to open file %s", output_path);
+        if (p_mp4->b_fragments) {
+            p_mp4->file_param.mode |= LSMASH_FILE_MODE_FRAGMENTED;
+        }
+    }
+    // under a memory budget, lsmash writes its pooled samples out in smaller chunks
+    if (p_mp4->i_pool_limit && p_mp4->file_param.max_chunk_size > p_mp4->i_pool_limit) {
+        p_mp4->file_param.max_chunk_size = p_mp4->i_pool_limit;
+    }
     
-    mp4_state.summary = (lsmash_video_summary_t *)lsmash_create_summary(LSMASH_SUMMARY_TYPE_VIDEO);
+    p_mp4->summary = (lsmash_video_summary_t *)lsmash_create_summary(LSMASH_SUMMARY_TYPE_VIDEO);
+    CHK_RETURN(p_mp4->summary != NULL, "failed to create a video summary");
     
-    mp4_state.summary->sample_type = ISOM_CODEC_TYPE_AVC1_VIDEO;
+    p_mp4->summary->sample_type = ISOM_CODEC_TYPE_AVC1_VIDEO;
     
-    mp4_state.i_delay_frames = 0;
-    mp4_state.i_dts_compress_multiplier = 1;
+    p_mp4->i_delay_frames = 0;
+    p_mp4->i_dts_compress_multiplier = 1;
     
     uint64_t i_media_timescale;
-    i_media_timescale = (uint64_t)encoder_state.param.i_timebase_den;
-    mp4_state.i_time_inc = (uint64_t)encoder_state.param.i_timebase_num;
+    i_media_timescale = (uint64_t)encoder->param.i_timebase_den;
+    p_mp4->i_time_inc = (uint64_t)encoder->param.i_timebase_num;
     
     lsmash_brand_type brands[6] = { 0 };
     uint32_t brand_count = 0;
@@ -117,42 +1150,42 @@ int CompressionSessionOpen(const char *output_path, int w, int h) {
     brands[brand_count++] = ISOM_BRAND_TYPE_MP41;
     brands[brand_count++] = ISOM_BRAND_TYPE_ISOM;
     
-    lsmash_file_parameters_t *file_param = &mp4_state.file_param;
+    lsmash_file_parameters_t *file_param = &p_mp4->file_param;
     file_param->major_brand     = brands[0];
     file_param->brands              = brands;
     file_param->brand_count     = brand_count;
     file_param->minor_version = 0;
-    CHK(lsmash_set_file(mp4_state.p_root, file_param) != NULL, "failed to add output file");
+    CHK_RETURN(lsmash_set_file(p_mp4->p_root, file_param) != NULL, "failed to add output file");
     
     lsmash_movie_parameters_t movie_param;
     lsmash_initialize_movie_parameters( &movie_param );
-    CHK(lsmash_set_movie_parameters(mp4_state.p_root, &movie_param) == 0, "failed to set movie parameters");
+    CHK_RETURN(lsmash_set_movie_parameters(p_mp4->p_root, &movie_param) == 0, "failed to set movie parameters");
     
-    mp4_state.i_movie_timescale = lsmash_get_movie_timescale( mp4_state.p_root );
-    CHK(mp4_state.i_movie_timescale, "movie timescale");
+    p_mp4->i_movie_timescale = lsmash_get_movie_timescale( p_mp4->p_root );
+    CHK_RETURN(p_mp4->i_movie_timescale, "movie timescale is broken");
 
-    mp4_state.i_track = lsmash_create_track(mp4_state.p_root, ISOM_MEDIA_HANDLER_TYPE_VIDEO_TRACK);
-    CHK(mp4_state.i_track != 0, "failed to create a video track");
+    p_mp4->i_track = lsmash_create_track(p_mp4->p_root, ISOM_MEDIA_HANDLER_TYPE_VIDEO_TRACK);
+    CHK_RETURN(p_mp4->i_track != 0, "failed to create a video track");
     
-    mp4_state.summary->width = encoder_state.param.i_width;
-    mp4_state.summary->height = encoder_state.param.i_height;
-    uint32_t i_display_width = encoder_state.param.i_width << 16;
-    uint32_t i_display_height = encoder_state.param.i_height << 16;
+    p_mp4->summary->width = encoder->param.i_width;
+    p_mp4->summary->height = encoder->param.i_height;
+    uint32_t i_display_width = encoder->param.i_width << 16;
+    uint32_t i_display_height = encoder->param.i_height << 16;
     
-    if (encoder_state.param.vui.i_sar_width && encoder_state.param.vui.i_sar_height) {
-        double sar = (double)encoder_state.param.vui.i_sar_width / encoder_state.param.vui.i_sar_height;
+    if (encoder->param.vui.i_sar_width && encoder->param.vui.i_sar_height) {
+        double sar = (double)encoder->param.vui.i_sar_width / encoder->param.vui.i_sar_height;
         if (sar > 1.0) {
             i_display_width *= sar;
         } else {
             i_display_height /= sar;
         }
-        mp4_state.summary->par_h = encoder_state.param.vui.i_sar_width;
-        mp4_state.summary->par_v = encoder_state.param.vui.i_sar_height;
+        p_mp4->summary->par_h = encoder->param.vui.i_sar_width;
+        p_mp4->summary->par_v = encoder->param.vui.i_sar_height;
     }
-    mp4_state.summary->color.primaries_index = encoder_state.param.vui.i_colorprim;
-    mp4_state.summary->color.transfer_index = encoder_state.param.vui.i_transfer;
-    mp4_state.summary->color.matrix_index        = encoder_state.param.vui.i_colmatrix >= 0 ? encoder_state.param.vui.i_colmatrix : ISOM_MATRIX_INDEX_UNSPECIFIED;
-    mp4_state.summary->color.full_range          = encoder_state.param.vui.b_fullrange >= 0 ? encoder_state.param.vui.b_fullrange : 0;
+    p_mp4->summary->color.primaries_index = encoder->param.vui.i_colorprim;
+    p_mp4->summary->color.transfer_index = encoder->param.vui.i_transfer;
+    p_mp4->summary->color.matrix_index        = encoder->param.vui.i_colmatrix >= 0 ? encoder->param.vui.i_colmatrix : ISOM_MATRIX_INDEX_UNSPECIFIED;
+    p_mp4->summary->color.full_range          = encoder->param.vui.b_fullrange >= 0 ? encoder->param.vui.b_fullrange : 0;
 
         /* Set video track parameters. */
     lsmash_track_parameters_t track_param;
@@ -161,38 +1194,40 @@ int CompressionSessionOpen(const char *output_path, int w, int h) {
     track_param.mode = track_mode;
     track_param.display_width = i_display_width;
     track_param.display_height = i_display_height;
-    CHK( lsmash_set_track_parameters( mp4_state.p_root, mp4_state.i_track, &track_param ) == 0,
-                                     "failed to set track parameters for video.\n" );
+    CHK_RETURN( lsmash_set_track_parameters( p_mp4->p_root, p_mp4->i_track, &track_param ) == 0,
+                                     "failed to set track parameters for video." );
     
     /* Set video media parameters. */
     lsmash_media_parameters_t media_param;
     lsmash_initialize_media_parameters( &media_param );
     media_param.timescale = (uint32_t)i_media_timescale;
     media_param.media_handler_name = "L-SMASH Video Media Handler";
-    if( mp4_state.b_use_recovery )
+    if( p_mp4->b_use_recovery )
     {
-            media_param.roll_grouping = encoder_state.param.b_intra_refresh;
-            media_param.rap_grouping = encoder_state.param.b_open_gop;
+            media_param.roll_grouping = encoder->param.b_intra_refresh;
+            media_param.rap_grouping = encoder->param.b_open_gop;
     }
-    CHK( lsmash_set_media_parameters( mp4_state.p_root, mp4_state.i_track, &media_param ) == 0,
-                                     "failed to set media parameters for video.\n" );
-    mp4_state.i_video_timescale = lsmash_get_media_timescale( mp4_state.p_root, mp4_state.i_track );
-    CHK( mp4_state.i_video_timescale != 0, "media timescale for video is broken.\n" );
+    CHK_RETURN( lsmash_set_media_parameters( p_mp4->p_root, p_mp4->i_track, &media_param ) == 0,
+                                     "failed to set media parameters for video." );
+    p_mp4->i_video_timescale = lsmash_get_media_timescale( p_mp4->p_root, p_mp4->i_track );
+    CHK_RETURN( p_mp4->i_video_timescale != 0, "media timescale for video is broken." );
     
     /* headers */
     x264_nal_t *headers;
     int i_nal;
-    CHK(x264_encoder_headers(encoder_state.h, &headers, &i_nal) > 0, "x264_encoder_headers");
-    mp4_write_headers(headers);    
+    CHK_RETURN(x264_encoder_headers(encoder->h, &headers, &i_nal) > 0, "x264 didn't give its headers");
+    if (mp4_write_headers(s, headers) < 0) {
+        return 1;
+    }
     
     return 0;
 }
 
-static int mp4_write_headers(x264_nal_t *p_nal)
+static int mp4_write_headers(session_t *s, x264_nal_t *p_nal)
 {
     #define H264_NALU_LENGTH_SIZE 4
     
-    mp4_state_t *p_mp4 = &mp4_state;
+    mp4_state_t *p_mp4 = &s->mp4;
 
     uint32_t sps_size = p_nal[0].i_payload - H264_NALU_LENGTH_SIZE;
     uint32_t pps_size = p_nal[1].i_payload - H264_NALU_LENGTH_SIZE;
@@ -204,6 +1239,11 @@ static int mp4_write_headers(x264_nal_t *p_nal)
 
     lsmash_codec_specific_t *cs = lsmash_create_codec_specific_data( LSMASH_CODEC_SPECIFIC_DATA_TYPE_ISOM_VIDEO_H264,
                                                                      LSMASH_CODEC_SPECIFIC_FORMAT_STRUCTURED );
+    if( !cs )
+    {
+        fprintf( stderr, "failed to create H.264 specific info.\n" );
+        return -1;
+    }
 
     lsmash_h264_specific_parameters_t *param = (lsmash_h264_specific_parameters_t *)cs->data.structured;
     param->lengthSizeMinusOne = H264_NALU_LENGTH_SIZE - 1;
@@ -212,17 +1252,23 @@ static int mp4_write_headers(x264_nal_t *p_nal)
      * The remaining parameters are automatically set by SPS. */
     if( lsmash_append_h264_parameter_set( param, H264_PARAMETER_SET_TYPE_SPS, sps, sps_size ) )
     {
+        fprintf( stderr, "failed to append SPS.\n" );
+        lsmash_destroy_codec_specific_data( cs );
         return -1;
     }
 
     /* PPS */
     if( lsmash_append_h264_parameter_set( param, H264_PARAMETER_SET_TYPE_PPS, pps, pps_size ) )
     {
+        fprintf( stderr, "failed to append PPS.\n" );
+        lsmash_destroy_codec_specific_data( cs );
         return -1;
     }
 
     if( lsmash_add_codec_specific_data( (lsmash_summary_t *)p_mp4->summary, cs ) )
     {
+        fprintf( stderr, "failed to add H.264 specific info.\n" );
+        lsmash_destroy_codec_specific_data( cs );
         return -1;
     }
 
@@ -237,22 +1283,73 @@ static int mp4_write_headers(x264_nal_t *p_nal)
     lsmash_destroy_codec_specific_data( cs );
 
     p_mp4->i_sample_entry = lsmash_add_sample_entry( p_mp4->p_root, p_mp4->i_track, p_mp4->summary );
-    CHK( p_mp4->i_sample_entry != 0,
-                     "failed to add sample entry for video.\n" );
+    if( !p_mp4->i_sample_entry )
+    {
+        fprintf( stderr, "failed to add sample entry for video.\n" );
+        return -1;
+    }
 
     /* SEI */
     p_mp4->p_sei_buffer = malloc( sei_size );
-    CHK( p_mp4->p_sei_buffer != NULL,
-                     "failed to allocate sei transition buffer.\n" );
+    if( !p_mp4->p_sei_buffer )
+    {
+        fprintf( stderr, "failed to allocate sei transition buffer.\n" );
+        return -1;
+    }
     memcpy( p_mp4->p_sei_buffer, sei, sei_size );
     p_mp4->i_sei_size = sei_size;
 
     return sei_size + sps_size + pps_size;
 }
 
-static int mp4_write_frame(uint8_t *p_nalu, int i_size, x264_picture_t *p_picture) {
-    mp4_state_t *p_mp4 = &mp4_state;
+// Wraps one encoded frame in a sample, after i_prefix_size bytes of p_prefix. lsmash takes
+// ownership of samples and frees them once they're written, so this is the one allocation and the
+// one copy each frame costs.
+static lsmash_sample_t *mp4_create_sample_prefixed(session_t *s, const uint8_t *p_prefix, uint32_t i_prefix_size,
+                                                   const uint8_t *p_nalu, int i_size)
+{
+    lsmash_sample_t *p_sample = lsmash_create_sample( i_size + i_prefix_size );
+    if( !p_sample )
+        return NULL;
+    stats_lock( s );
+    s->stats.counters.i_sample_allocs++;
+    s->stats.memory[MEMORY_MUX] += i_size + i_prefix_size;
+    memory_total_locked( s );
+    stats_unlock( s );
+
+    if( i_prefix_size )
+        memcpy( p_sample->data, p_prefix, i_prefix_size );
+    memcpy( p_sample->data + i_prefix_size, p_nalu, i_size );
+    return p_sample;
+}
+
+// The SEI from the headers goes in front of the first sample.
+static lsmash_sample_t *mp4_create_sample(session_t *s, const uint8_t *p_nalu, int i_size)
+{
+    mp4_state_t *p_mp4 = &s->mp4;
+
+    lsmash_sample_t *p_sample = mp4_create_sample_prefixed( s, p_mp4->p_sei_buffer, p_mp4->i_sei_size, p_nalu, i_size );
+    if( p_sample )
+        p_mp4->i_sei_size = 0;
+    return p_sample;
+}
+
+// lsmash has written out the samples it pooled, and with b_fragment, dropped their table entries.
+static void mp4_pool_written(session_t *s, int b_fragment) {
+    mp4_state_t *p_mp4 = &s->mp4;
+    uint64_t i_freed = p_mp4->i_pooled_bytes;
+    if (b_fragment) {
+        i_freed += p_mp4->i_table_samples * MEMORY_TABLE_BYTES_PER_SAMPLE;
+        p_mp4->i_table_samples = 0;
+    }
+    p_mp4->i_pooled_bytes = 0;
+    memory_add(s, MEMORY_MUX, -(int64_t)i_freed);
+}
+
+static int mp4_write_frame(session_t *s, lsmash_sample_t *p_sample, x264_picture_t *p_picture) {
+    mp4_state_t *p_mp4 = &s->mp4;
     uint64_t dts, cts;
+    int i_size = p_sample->length;
 
     if( !p_mp4->i_numframe )
     {
@@ -264,25 +1361,15 @@ static int mp4_write_frame(uint8_t *p_nalu, int i_size, x264_picture_t *p_pictur
             edit.duration   = ISOM_EDIT_DURATION_UNKNOWN32;     /* QuickTime doesn't support 64bit duration. */
             edit.start_time = p_mp4->i_first_cts;
             edit.rate       = ISOM_EDIT_MODE_NORMAL;
-            CHK( lsmash_create_explicit_timeline_map( p_mp4->p_root, p_mp4->i_track, edit ) == 0,
-                            "failed to set timeline map for video.\n" );
-        }
-    }
-
-    lsmash_sample_t *p_sample = lsmash_create_sample( i_size + p_mp4->i_sei_size );
-    CHK( p_sample != NULL,
-                     "failed to create a video sample data.\n" );
-
-    if( p_mp4->p_sei_buffer )
-    {
-        memcpy( p_sample->data, p_mp4->p_sei_buffer, p_mp4->i_sei_size );
-        free( p_mp4->p_sei_buffer );
-        p_mp4->p_sei_buffer = NULL;
+            if( lsmash_create_explicit_timeline_map( p_mp4->p_root, p_mp4->i_track, edit ) )
+            {
+                fprintf( stderr, "failed to set timeline map for video.\n" );
+                lsmash_delete_sample( p_sample );
+                return 1;
+            }
+        }
     }
 
-    memcpy( p_sample->data + p_mp4->i_sei_size, p_nalu, i_size );
-    p_mp4->i_sei_size = 0;
-
     if( p_mp4->b_dts_compress )
     {
         if( p_mp4->i_numframe == 1 )
@@ -302,89 +1389,976 @@ static int mp4_write_frame(uint8_t *p_nalu, int i_size, x264_picture_t *p_pictur
     p_sample->cts = cts;
     p_sample->index = p_mp4->i_sample_entry;
     p_sample->prop.ra_flags = p_picture->b_keyframe ? ISOM_SAMPLE_RANDOM_ACCESS_FLAG_SYNC : ISOM_SAMPLE_RANDOM_ACCESS_FLAG_NONE;
+    if( p_mp4->b_use_recovery )
+    {
+        /* Keyframes other than IDRs start an intra refresh; the picture is only whole once it's done.
+         * lsmash closes the roll group at the sample whose identifier is the start's complete. */
+        p_sample->prop.post_roll.identifier = p_mp4->i_numframe;
+        if( p_picture->b_keyframe && p_picture->i_type != X264_TYPE_IDR )
+        {
+            p_sample->prop.ra_flags = ISOM_SAMPLE_RANDOM_ACCESS_FLAG_POST_ROLL_START;
+            p_sample->prop.post_roll.complete = p_mp4->i_numframe + p_mp4->i_recovery_frames;
+        }
+    }
 
-    if( p_mp4->b_fragments && p_mp4->i_numframe && p_sample->prop.ra_flags != ISOM_SAMPLE_RANDOM_ACCESS_FLAG_NONE )
+    /* A fragment holds all its samples until it's flushed, so under a memory budget one is also
+     * started once the pool would go over its limit. */
+    int b_pool_full = p_mp4->i_pool_limit && p_mp4->i_pooled_bytes + i_size > p_mp4->i_pool_limit;
+    if( p_mp4->b_fragments && p_mp4->i_numframe
+        && (p_sample->prop.ra_flags != ISOM_SAMPLE_RANDOM_ACCESS_FLAG_NONE || b_pool_full) )
     {
-        CHK( lsmash_flush_pooled_samples( p_mp4->p_root, p_mp4->i_track, (uint32_t)(p_sample->dts - p_mp4->i_prev_dts) ) == 0,
-                         "failed to flush the rest of samples.\n" );
-        CHK( lsmash_create_fragment_movie( p_mp4->p_root ) == 0,
-                         "failed to create a movie fragment.\n" );
+        if( lsmash_flush_pooled_samples( p_mp4->p_root, p_mp4->i_track, (uint32_t)(p_sample->dts - p_mp4->i_prev_dts) )
+         || lsmash_create_fragment_movie( p_mp4->p_root ) )
+        {
+            fprintf( stderr, "failed to flush the rest of samples into a new movie fragment.\n" );
+            lsmash_delete_sample( p_sample );
+            return 1;
+        }
+        mp4_pool_written( s, 1 );
     }
+    else if( !p_mp4->b_fragments && p_mp4->i_pooled_bytes + i_size > p_mp4->file_param.max_chunk_size )
+        mp4_pool_written( s, 0 );   /* lsmash starts a chunk with this sample and writes out the last one */
 
-    /* Append data per sample. */
-    CHK( lsmash_append_sample( p_mp4->p_root, p_mp4->i_track, p_sample ) == 0,
-                     "failed to append a video frame.\n" );
+    /* Append data per sample. lsmash takes the sample; whether it frees it on failure depends on
+     * where it failed, and leaking it then beats freeing it twice. */
+    CHK_RETURN( lsmash_append_sample( p_mp4->p_root, p_mp4->i_track, p_sample ) == 0,
+                "failed to append a video frame." );
+    p_mp4->i_pooled_bytes += i_size;
+    p_mp4->i_table_samples++;
+    memory_add( s, MEMORY_MUX, MEMORY_TABLE_BYTES_PER_SAMPLE );
 
     p_mp4->i_prev_dts = dts;
     p_mp4->i_numframe++;
 
-    return i_size;
+    return 0;
+}
+
+// Muxes an encoded frame, taking ownership of sample. Returns non-zero, and marks the session failed,
+// if it can't be; once it has, later frames are dropped.
+static int write_encoded(session_t *s, lsmash_sample_t *sample, x264_picture_t *pic_out) {
+    encoder_state_t *encoder = &s->encoder;
+    
+    if (session_failed(s)) {
+        lsmash_delete_sample(sample);
+        return 1;
+    }
+    if (!sample) {
+        fprintf(stderr, "failed to create a video sample\n");
+        session_set_failed(s);
+        return 1;
+    }
+    int i_size = sample->length;
+    int64_t i_latency_us = stats_latency(s, pic_out->i_pts);
+    if (s->on_sample) {
+        // lsmash owns the sample once it's appended, and may free it straight away
+        compression_sample_t out = { sample->data, i_size, pic_out->i_pts, pic_out->i_dts, pic_out->b_keyframe,
+                                     i_latency_us > 0 ? (uint64_t)i_latency_us : 0 };
+        s->on_sample(s->sample_opaque, &out);
+    }
+    uint64_t i_start = now_us();
+    if (mp4_write_frame(s, sample, pic_out) != 0) {
+        session_set_failed(s);
+        return 1;
+    }
+    stats_muxed(s, pic_out, i_size, now_us() - i_start, i_latency_us);
+    encoder->last_dts = pic_out->i_dts;
+    if (encoder->i_frames_written == 0) {        
+        encoder->first_dts = pic_out->i_dts;
+        encoder->largest_pts = encoder->second_largest_pts = pic_out->i_pts;
+    } else {
+        encoder->second_largest_pts = encoder->largest_pts;
+        encoder->largest_pts = pic_out->i_pts;
+    }
+    encoder->i_frames_written++;
+    return 0;
 }
 
-static int encode_frame(x264_picture_t *pic) {
+static int encode_frame(session_t *s, x264_picture_t *pic) {
     x264_picture_t pic_out;
     x264_nal_t *nal;
     int i_nal;
     int i_frame_size = 0;
     
-    i_frame_size = x264_encoder_encode(encoder_state.h, &nal, &i_nal, pic, &pic_out);
+    // after a muxing failure there's nowhere for the frame to go
+    if (session_failed(s)) {
+        return -1;
+    }
+    uint64_t i_start = now_us();
+    i_frame_size = x264_encoder_encode(s->encoder.h, &nal, &i_nal, pic, &pic_out);
+    uint64_t i_encode_us = now_us() - i_start;
+    stats_encoded(s, pic != NULL, i_frame_size > 0, i_encode_us);
+    if (pic) {
+        governor_update(s, i_encode_us);
+    }
     
-    if (i_frame_size) {
-        mp4_write_frame(nal[0].p_payload, i_frame_size, &pic_out);
-        encoder_state.last_dts = pic_out.i_dts;
-        if (encoder_state.i_frames_written == 0) {        
-            encoder_state.first_dts = pic_out.i_dts;
-            encoder_state.largest_pts = encoder_state.second_largest_pts = pic_out.i_pts;
-        } else {
-            encoder_state.second_largest_pts = encoder_state.largest_pts;
-            encoder_state.largest_pts = pic_out.i_pts;
+    if (i_frame_size > 0 && write_encoded(s, mp4_create_sample(s, nal[0].p_payload, i_frame_size), &pic_out) != 0) {
+        return -1;
+    }
+    
+    // a frame x264 holds on to for now is a success too
+    return i_frame_size < 0 ? -1 : 0;
+}
+
+#if RAW2MP4_HAVE_THREADS
+
+static int pipeline_push_packet(session_t *s, x264_nal_t *nal, int i_frame_size, x264_picture_t *pic_out) {
+    pipeline_state_t *p = &s->pipeline;
+    
+    pthread_mutex_lock(&p->lock);
+    while (p->i_packet_count == p->i_depth) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    encoded_packet_t *packet = &p->packets[(p->i_packet_head + p->i_packet_count) % p->i_depth];
+    pthread_mutex_unlock(&p->lock);
+    
+    packet->sample = mp4_create_sample(s, nal[0].p_payload, i_frame_size);
+    packet->pic_out = *pic_out;
+    
+    pthread_mutex_lock(&p->lock);
+    p->i_packet_count++;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+static void *pipeline_encode_main(void *arg) {
+    session_t *s = arg;
+    pipeline_state_t *p = &s->pipeline;
+    x264_picture_t pic_out;
+    x264_nal_t *nal;
+    int i_nal;
+    int i_frame_size;
+    
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->i_pic_count == 0 && !p->b_input_done) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->i_pic_count == 0) {
+            break;
+        }
+        x264_picture_t *pic = &p->pics[p->i_pic_head];
+        pthread_mutex_unlock(&p->lock);
+        
+        uint64_t i_start = now_us();
+        i_frame_size = x264_encoder_encode(s->encoder.h, &nal, &i_nal, pic, &pic_out);
+        uint64_t i_encode_us = now_us() - i_start;
+        stats_encoded(s, 1, i_frame_size > 0, i_encode_us);
+        governor_update(s, i_encode_us);
+        if (i_frame_size < 0) {
+            session_set_failed(s);
+        }
+        
+        pthread_mutex_lock(&p->lock);
+        p->i_pic_head = (p->i_pic_head + 1) % p->i_depth;
+        p->i_pic_count--;
+        pthread_cond_broadcast(&p->cond);
+        
+        if (i_frame_size > 0) {
+            pthread_mutex_unlock(&p->lock);
+            pipeline_push_packet(s, nal, i_frame_size, &pic_out);
+            pthread_mutex_lock(&p->lock);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    
+    while (x264_encoder_delayed_frames(s->encoder.h)) {
+        uint64_t i_start = now_us();
+        i_frame_size = x264_encoder_encode(s->encoder.h, &nal, &i_nal, NULL, &pic_out);
+        stats_encoded(s, 0, i_frame_size > 0, now_us() - i_start);
+        if (i_frame_size < 0) {
+            session_set_failed(s);
+            break;
+        }
+        if (i_frame_size > 0) {
+            pipeline_push_packet(s, nal, i_frame_size, &pic_out);
+        }
+    }
+    
+    pthread_mutex_lock(&p->lock);
+    p->b_encode_done = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void *pipeline_mux_main(void *arg) {
+    session_t *s = arg;
+    pipeline_state_t *p = &s->pipeline;
+    
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->i_packet_count == 0 && !p->b_encode_done) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->i_packet_count == 0) {
+            break;
+        }
+        encoded_packet_t *packet = &p->packets[p->i_packet_head];
+        pthread_mutex_unlock(&p->lock);
+        
+        write_encoded(s, packet->sample, &packet->pic_out);
+        packet->sample = NULL;
+        
+        pthread_mutex_lock(&p->lock);
+        p->i_packet_head = (p->i_packet_head + 1) % p->i_depth;
+        p->i_packet_count--;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static int pipeline_start(session_t *s, int i_depth) {
+    pipeline_state_t *p = &s->pipeline;
+    
+    memset(p, 0, sizeof(pipeline_state_t));
+    p->i_depth = i_depth;
+    p->pics = s->buffers.pics;
+    p->packets = s->buffers.packets;
+    
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    int b_encode_started = pthread_create(&p->encode_thread, NULL, pipeline_encode_main, s) == 0;
+    if (!b_encode_started || pthread_create(&p->mux_thread, NULL, pipeline_mux_main, s) != 0) {
+        fprintf(stderr, "can't start the pipeline's threads\n");
+        // with no input the encode thread has nothing to flush, and exits
+        if (b_encode_started) {
+            pthread_mutex_lock(&p->lock);
+            p->b_input_done = 1;
+            pthread_cond_broadcast(&p->cond);
+            pthread_mutex_unlock(&p->lock);
+            pthread_join(p->encode_thread, NULL);
         }
-        encoder_state.i_frames_written++;
-   }
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        memset(p, 0, sizeof(pipeline_state_t));
+        return 1;
+    }
+    p->b_enabled = 1;
+    return 0;
+}
+
+// Blocks while the ring is full; that is the backpressure on the caller.
+static x264_picture_t *pipeline_acquire_picture(session_t *s) {
+    pipeline_state_t *p = &s->pipeline;
     
-    encoder_state.i_frame++;
+    pthread_mutex_lock(&p->lock);
+    while (p->i_pic_count == p->i_depth) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    x264_picture_t *pic = &p->pics[(p->i_pic_head + p->i_pic_count) % p->i_depth];
+    pthread_mutex_unlock(&p->lock);
+    return pic;
+}
+
+static void pipeline_submit_picture(session_t *s) {
+    pipeline_state_t *p = &s->pipeline;
     
-    return i_frame_size > 0;
+    pthread_mutex_lock(&p->lock);
+    p->i_pic_count++;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
 }
 
-static uint8_t clampToU8(double v) {
-    if (v < 0.0) v = 0;
-    if (v > 1.0) v = 1.0;
-    return (uint8_t)(v * 255.0);
+// Drains both stages and tears the pipeline down.
+static void pipeline_finish(session_t *s) {
+    pipeline_state_t *p = &s->pipeline;
+    
+    pthread_mutex_lock(&p->lock);
+    p->b_input_done = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    
+    pthread_join(p->encode_thread, NULL);
+    pthread_join(p->mux_thread, NULL);
+    
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    memset(p, 0, sizeof(pipeline_state_t));
 }
 
-int CompressionSessionAddFrame(uint8_t *rgba) {
-    int w = encoder_state.param.i_width;
-    int h = encoder_state.param.i_height;
-    
-    uint8_t *yPtr = encoder_state.pic.img.plane[0];
-    uint8_t *uPtr = encoder_state.pic.img.plane[1];
-    uint8_t *vPtr = encoder_state.pic.img.plane[2];
-    
-    for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            size_t px = (y * w * 4) + x * 4;
-            double r = rgba[px] / 255.0;
-            double g = rgba[px+1] / 255.0;
-            double b = rgba[px+2] / 255.0;
-            
-            double dy = 0.299*r + 0.578*g + 0.114*b;
-            
-            *yPtr++ = clampToU8(dy);
-            if (y%2 == 0 && x%2 == 0) {
-                *uPtr++ = clampToU8((b - dy) * 0.565 + 0.5);
-                *vPtr++ = clampToU8((r - dy) * 0.713 + 0.5);
+#endif // RAW2MP4_HAVE_THREADS
+
+// Bands are whole row pairs so that each one owns its chroma rows outright.
+#define CONVERT_MIN_BAND_ROWS 32
+
+typedef struct {
+    const uint8_t *src;
+    int src_stride;
+    convert_format_t format;
+    int src_w;
+    int src_h;
+    x264_picture_t *pic;
+    int w;
+    int h;
+    int band_rows;
+} convert_band_t;
+
+// Bands are in output rows; a scaled band reads whichever source rows are under it.
+static void convert_band(void *ctx, int job) {
+    convert_band_t *band = ctx;
+    x264_image_t *img = &band->pic->img;
+    int y = job * band->band_rows;
+    int rows = band->h - y < band->band_rows ? band->h - y : band->band_rows;
+    
+    convert_scaled_to_i420(band->src, band->src_stride, band->format, band->src_w, band->src_h,
+                           img->plane, img->i_stride, band->w, band->h, y, y + rows);
+}
+
+static void convert_picture(session_t *s, const uint8_t *src, int src_stride, convert_format_t format, x264_picture_t *pic) {
+    encoder_state_t *encoder = &s->encoder;
+    int w = encoder->param.i_width;
+    int h = encoder->param.i_height;
+    
+    convert_band_t band = { src, src_stride, format, encoder->i_src_width, encoder->i_src_height, pic, w, h, h };
+    int n_bands = workers_count(s->buffers.workers);
+    if (n_bands > h / CONVERT_MIN_BAND_ROWS) {
+        n_bands = h / CONVERT_MIN_BAND_ROWS;
+    }
+    if (n_bands > 1) {
+        band.band_rows = ((h / 2 + n_bands - 1) / n_bands) * 2;
+        n_bands = (h + band.band_rows - 1) / band.band_rows;
+    } else {
+        n_bands = 1;
+    }
+    workers_run(s->buffers.workers, convert_band, &band, n_bands);
+}
+
+static convert_format_t convert_format(compression_format_t format) {
+    switch (format) {
+        case COMPRESSION_FORMAT_BGRA: return CONVERT_FORMAT_BGRA;
+        case COMPRESSION_FORMAT_ARGB: return CONVERT_FORMAT_ARGB;
+        case COMPRESSION_FORMAT_RGB24: return CONVERT_FORMAT_RGB24;
+        default: return CONVERT_FORMAT_RGBA;
+    }
+}
+
+// i_in_us is when the caller handed the frame over, for its latency.
+static int64_t next_pts(session_t *s, uint64_t i_in_us) {
+    encoder_state_t *encoder = &s->encoder;
+    stats_frame_timed(s, encoder->i_frame, i_in_us);
+    encoder->i_last_input_pts = encoder->i_frame;
+    return encoder->i_frame++;
+}
+
+// Splits n_tile_rows into at most one band per conversion thread. Returns the number of bands.
+static int plan_tile_bands(session_t *s, int n_tile_rows, int *band_tile_rows) {
+    int n_bands = workers_count(s->buffers.workers);
+    if (n_bands > n_tile_rows) {
+        n_bands = n_tile_rows;
+    }
+    if (n_bands <= 1) {
+        *band_tile_rows = n_tile_rows;
+        return 1;
+    }
+    *band_tile_rows = (n_tile_rows + n_bands - 1) / n_bands;
+    return (n_tile_rows + *band_tile_rows - 1) / *band_tile_rows;
+}
+
+typedef struct {
+    session_t *s;
+    const uint8_t *src;
+    int stride;
+    compression_format_t format;
+    x264_picture_t *pic;
+    int band_tile_rows;
+} tile_band_t;
+
+static int bytes_per_pixel(compression_format_t format) {
+    return format == COMPRESSION_FORMAT_RGB24 ? 3 : 4;
+}
+
+static void hash_band(void *ctx, int job) {
+    tile_band_t *band = ctx;
+    int w = band->s->encoder.i_src_width;
+    int h = band->s->encoder.i_src_height;
+    int ty0 = job * band->band_tile_rows;
+    int ty1 = ty0 + band->band_tile_rows < tiles_down(h) ? ty0 + band->band_tile_rows : tiles_down(h);
+    tiles_hash(band->src, band->stride, bytes_per_pixel(band->format), w, h, ty0, ty1, band->s->tiles.hashes);
+}
+
+// Converts each horizontal run of dirty tiles in the band with one call, leaving clean tiles'
+// Y, U and V as they were.
+static void convert_dirty_band(void *ctx, int job) {
+    tile_band_t *band = ctx;
+    frame_tiles_t *tiles = &band->s->tiles;
+    x264_image_t *img = &band->pic->img;
+    int w = band->s->encoder.param.i_width;
+    int h = band->s->encoder.param.i_height;
+    int n_across = tiles_across(w);
+    int ty0 = job * band->band_tile_rows;
+    int ty1 = ty0 + band->band_tile_rows < tiles_down(h) ? ty0 + band->band_tile_rows : tiles_down(h);
+    int bpp = bytes_per_pixel(band->format);
+    
+    for (int ty = ty0; ty < ty1; ty++) {
+        const uint8_t *dirty = tiles->dirty + (size_t)ty * n_across;
+        int y = ty * TILE_SIZE;
+        int rows = h - y < TILE_SIZE ? h - y : TILE_SIZE;
+        for (int tx = 0; tx < n_across; tx++) {
+            if (!dirty[tx]) {
+                continue;
+            }
+            int tx_end = tx + 1;
+            while (tx_end < n_across && dirty[tx_end]) {
+                tx_end++;
+            }
+            int x = tx * TILE_SIZE;
+            int cols = (tx_end * TILE_SIZE < w ? tx_end * TILE_SIZE : w) - x;
+            uint8_t *planes[3] = {
+                img->plane[0] + (size_t)y * img->i_stride[0] + x,
+                img->plane[1] + (size_t)(y / 2) * img->i_stride[1] + x / 2,
+                img->plane[2] + (size_t)(y / 2) * img->i_stride[2] + x / 2,
+            };
+            convert_packed_to_i420(band->src + (size_t)y * band->stride + (size_t)x * bpp, band->stride,
+                                   convert_format(band->format), planes, img->i_stride, cols, rows);
+            tx = tx_end;
+        }
+    }
+}
+
+// Hashes the frame on the conversion threads and marks the tiles that differ from the last frame
+// converted. Returns the number of dirty tiles, or -1 if there's nothing to compare with.
+static int diff_tiles(session_t *s, const uint8_t *src, int stride, compression_format_t format) {
+    frame_tiles_t *tiles = &s->tiles;
+    
+    tile_band_t band = { s, src, stride, format, NULL, 0 };
+    int n_bands = plan_tile_bands(s, tiles_down(s->encoder.i_src_height), &band.band_tile_rows);
+    workers_run(s->buffers.workers, hash_band, &band, n_bands);
+    
+    int i_dirty = -1;
+    if (tiles->b_hashes_valid) {
+        i_dirty = 0;
+        for (int i = 0; i < tiles->i_tiles; i++) {
+            tiles->dirty[i] = tiles->hashes[i] != tiles->prev_hashes[i];
+            i_dirty += tiles->dirty[i];
+        }
+    }
+    uint64_t *swap = tiles->prev_hashes;
+    tiles->prev_hashes = tiles->hashes;
+    tiles->hashes = swap;
+    tiles->b_hashes_valid = 1;
+    return i_dirty;
+}
+
+// Marks the tiles the caller's rectangles touch. The hashes no longer describe the picture after
+// this, so the next hashed frame is compared with nothing and converted in full.
+static int dirty_from_rects(session_t *s, const compression_rect_t *rects, int n_rects) {
+    frame_tiles_t *tiles = &s->tiles;
+    int w = s->encoder.i_src_width;
+    int h = s->encoder.i_src_height;
+    int n_across = tiles_across(w);
+    
+    memset(tiles->dirty, 0, tiles->i_tiles);
+    int i_dirty = 0;
+    for (int i = 0; i < n_rects; i++) {
+        int x0 = rects[i].x < 0 ? 0 : rects[i].x;
+        int y0 = rects[i].y < 0 ? 0 : rects[i].y;
+        int x1 = rects[i].x + rects[i].w > w ? w : rects[i].x + rects[i].w;
+        int y1 = rects[i].y + rects[i].h > h ? h : rects[i].y + rects[i].h;
+        for (int ty = y0 / TILE_SIZE; y0 < y1 && ty <= (y1 - 1) / TILE_SIZE; ty++) {
+            for (int tx = x0 / TILE_SIZE; x0 < x1 && tx <= (x1 - 1) / TILE_SIZE; tx++) {
+                i_dirty += !tiles->dirty[ty * n_across + tx];
+                tiles->dirty[ty * n_across + tx] = 1;
             }
         }
     }
+    tiles->b_hashes_valid = 0;
+    return i_dirty;
+}
+
+// Brings target up to date with src: a full conversion when the target doesn't hold the previous
+// frame, otherwise just the dirty tiles.
+static void convert_incremental(session_t *s, const uint8_t *src, int stride, compression_format_t format,
+                                int i_dirty, x264_picture_t *target) {
+    frame_tiles_t *tiles = &s->tiles;
+    
+    if (i_dirty < 0 || !tiles->b_picture_valid) {
+        convert_picture(s, src, stride, convert_format(format), target);
+    } else if (i_dirty > 0) {
+        tile_band_t band = { s, src, stride, format, target, 0 };
+        int n_bands = plan_tile_bands(s, tiles_down(s->encoder.param.i_height), &band.band_tile_rows);
+        workers_run(s->buffers.workers, convert_dirty_band, &band, n_bands);
+    }
+    tiles->b_picture_valid = 1;
+}
+
+// Where incremental conversion keeps the previous frame: the encoder's picture in serial mode,
+// since x264 copies its input, or a picture of its own in pipelined mode, where a ring slot holds a
+// frame from i_depth frames ago.
+static x264_picture_t *incremental_picture(session_t *s) {
+#if RAW2MP4_HAVE_THREADS
+    if (s->pipeline.b_enabled) {
+        return &s->tiles.pic;
+    }
+#endif
+    return s->encoder.pic;
+}
+
+// A repeat of the previous frame isn't encoded at all. Its pts is used up, so the gap stretches
+// the previous sample's duration (the input is VFR) rather than adding a sample.
+static int skip_duplicate(session_t *s, uint64_t i_start) {
+    s->encoder.i_frame++;
+    stats_frame_in(s, now_us() - i_start, 1);
+    return 0;
+}
+
+// Encodes the frame incremental_picture has been brought up to date with; in pipelined mode, a
+// ring slot gets a copy of its planes. i_start is when the caller handed the frame over.
+static int submit_incremental(session_t *s, uint64_t i_start) {
+    encoder_state_t *encoder = &s->encoder;
     
-    encoder_state.pic.i_pts = encoder_state.i_frame;
-    return encode_frame(&encoder_state.pic);
+#if RAW2MP4_HAVE_THREADS
+    if (s->pipeline.b_enabled) {
+        x264_picture_t *src = &s->tiles.pic;
+        // waiting for a free slot isn't conversion
+        uint64_t i_convert_us = now_us() - i_start;
+        x264_picture_t *pic = pipeline_acquire_picture(s);
+        uint64_t i_slot_start = now_us();
+        convert_copy_i420((const uint8_t *const *)src->img.plane, src->img.i_stride,
+                          pic->img.plane, pic->img.i_stride, encoder->param.i_width, encoder->param.i_height);
+        pic->i_pts = next_pts(s, i_start);
+        stats_frame_in(s, i_convert_us + now_us() - i_slot_start, 0);
+        pipeline_submit_picture(s);
+        // the mux thread's failures show up a few frames late
+        return session_failed(s) ? -1 : 0;
+    }
+#endif
+    
+    encoder->pic->i_pts = next_pts(s, i_start);
+    stats_frame_in(s, now_us() - i_start, 0);
+    return encode_frame(s, encoder->pic);
+}
+
+// i_dirty is the number of dirty tiles from diff_tiles or dirty_from_rects, or -1 to convert the
+// whole frame. i_start is when the caller handed the frame over, for the conversion time.
+static int add_frame_packed(session_t *s, const uint8_t *data, int stride, compression_format_t format, int i_dirty,
+                            uint64_t i_start) {
+    encoder_state_t *encoder = &s->encoder;
+    frame_tiles_t *tiles = &s->tiles;
+    
+    if (i_dirty == 0 && tiles->b_skip_duplicates) {
+        return skip_duplicate(s, i_start);
+    }
+    if (tiles->b_incremental) {
+        convert_incremental(s, data, stride, format, i_dirty, incremental_picture(s));
+        return submit_incremental(s, i_start);
+    }
+    
+#if RAW2MP4_HAVE_THREADS
+    if (s->pipeline.b_enabled) {
+        // hashing for duplicates counts as conversion, waiting for a free slot doesn't
+        uint64_t i_convert_us = now_us() - i_start;
+        x264_picture_t *pic = pipeline_acquire_picture(s);
+        uint64_t i_slot_start = now_us();
+        convert_picture(s, data, stride, convert_format(format), pic);
+        pic->i_pts = next_pts(s, i_start);
+        stats_frame_in(s, i_convert_us + now_us() - i_slot_start, 0);
+        pipeline_submit_picture(s);
+        // the mux thread's failures show up a few frames late
+        return session_failed(s) ? -1 : 0;
+    }
+#endif
+    
+    convert_picture(s, data, stride, convert_format(format), encoder->pic);
+    encoder->pic->i_pts = next_pts(s, i_start);
+    stats_frame_in(s, now_us() - i_start, 0);
+    return encode_frame(s, encoder->pic);
+}
+
+int session_add_frame_packed(session_t *s, const uint8_t *data, int stride, compression_format_t format) {
+    uint64_t i_start = now_us();
+    int i_dirty = -1;
+    if (s->tiles.b_skip_duplicates || s->tiles.b_incremental) {
+        i_dirty = diff_tiles(s, data, stride, format);
+    }
+    return add_frame_packed(s, data, stride, format, i_dirty, i_start);
+}
+
+int session_add_frame_rects(session_t *s, const uint8_t *data, int stride, compression_format_t format,
+                            const compression_rect_t *rects, int n_rects) {
+    uint64_t i_start = now_us();
+    int i_dirty = -1;
+    if (s->tiles.b_incremental) {
+        i_dirty = dirty_from_rects(s, rects, n_rects);
+    }
+    return add_frame_packed(s, data, stride, format, i_dirty, i_start);
+}
+
+typedef struct {
+    const compression_region_t *regions;
+    convert_format_t format;
+    x264_picture_t *pic;
+} region_band_t;
+
+static void convert_region(void *ctx, int job) {
+    region_band_t *band = ctx;
+    const compression_region_t *region = &band->regions[job];
+    x264_image_t *img = &band->pic->img;
+    int x = region->rect.x;
+    int y = region->rect.y;
+    uint8_t *planes[3] = {
+        img->plane[0] + (size_t)y * img->i_stride[0] + x,
+        img->plane[1] + (size_t)(y / 2) * img->i_stride[1] + x / 2,
+        img->plane[2] + (size_t)(y / 2) * img->i_stride[2] + x / 2,
+    };
+    convert_packed_to_i420(region->data, region->stride, band->format, planes, img->i_stride,
+                           region->rect.w, region->rect.h);
+}
+
+// Regions go straight into the picture incremental conversion keeps, one per conversion job.
+// Returns -1, leaving the picture alone, if they aren't a valid update for it.
+static int apply_regions(session_t *s, const compression_region_t *regions, int n_regions,
+                         compression_format_t format) {
+    frame_tiles_t *tiles = &s->tiles;
+    int w = s->encoder.param.i_width;
+    int h = s->encoder.param.i_height;
+    
+    if (!tiles->b_incremental || n_regions < 0) {
+        return -1;
+    }
+    uint64_t i_area = 0;
+    for (int i = 0; i < n_regions; i++) {
+        const compression_rect_t *r = &regions[i].rect;
+        if (r->x < 0 || r->y < 0 || r->w <= 0 || r->h <= 0 || r->x + r->w > w || r->y + r->h > h
+            || (r->x | r->y | r->w | r->h) & 1) {
+            return -1;
+        }
+        i_area += (uint64_t)r->w * r->h;
+    }
+    // with nothing to build on, the regions have to be the whole frame
+    if (!tiles->b_picture_valid && i_area < (uint64_t)w * h) {
+        return -1;
+    }
+    // the hashes no longer describe the picture, as with dirty_from_rects
+    tiles->b_hashes_valid = 0;
+    
+    region_band_t band = { regions, convert_format(format), incremental_picture(s) };
+    workers_run(s->buffers.workers, convert_region, &band, n_regions);
+    tiles->b_picture_valid = 1;
+    return 0;
+}
+
+int session_add_frame_regions(session_t *s, const compression_region_t *regions, int n_regions,
+                              compression_format_t format) {
+    uint64_t i_start = now_us();
+    if (apply_regions(s, regions, n_regions, format) != 0) {
+        return -1;
+    }
+    if (n_regions == 0 && s->tiles.b_skip_duplicates) {
+        return skip_duplicate(s, i_start);
+    }
+    return submit_incremental(s, i_start);
+}
+
+int session_add_capture(session_t *s, capture_t *capture, int i_first, int n_frames) {
+    int w, h, i_fps_num, i_fps_den;
+    compression_format_t format;
+    capture_info(capture, &w, &h, &format, &i_fps_num, &i_fps_den);
+    int n_total = capture_frame_count(capture);
+    if (w != s->encoder.i_src_width || h != s->encoder.i_src_height || i_first < 0 || i_first > n_total) {
+        return 1;
+    }
+    int i_end = n_frames < 0 || n_frames > n_total - i_first ? n_total : i_first + n_frames;
+    
+    // decoding starts at a keyframe; the frames from there to i_first only bring the picture up to date
+    int i_key = i_first < n_total ? capture_keyframe_before(capture, i_first) : i_end;
+    for (int i = i_key; i < i_end; i++) {
+        const compression_region_t *regions;
+        int n_regions;
+        if (capture_read_frame(capture, i, &regions, &n_regions) != 0) {
+            return 1;
+        }
+        int result;
+        if (i < i_first) {
+            result = apply_regions(s, regions, n_regions, format);
+        } else if (i == i_first && i_first > i_key) {
+            // the picture isn't what was last encoded any more, so this can't be skipped as a duplicate
+            uint64_t i_start = now_us();
+            result = apply_regions(s, regions, n_regions, format);
+            if (result == 0) {
+                result = submit_incremental(s, i_start);
+            }
+        } else {
+            result = session_add_frame_regions(s, regions, n_regions, format);
+        }
+        if (result != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int session_add_frame(session_t *s, uint8_t *rgba) {
+    return session_add_frame_packed(s, rgba, s->encoder.i_src_width * 4, COMPRESSION_FORMAT_RGBA);
+}
+
+// The two input buffers alternate, so the frame last committed stays as it was until the next
+// commit, and neither is allocated again once the session (or its pool) has them.
+uint8_t *session_acquire_input(session_t *s) {
+    session_buffers_t *buffers = &s->buffers;
+    size_t size = (size_t)s->encoder.i_src_width * s->encoder.i_src_height * 4;
+    
+    if (buffers->i_input_size < size) {
+        for (int i = 0; i < 2; i++) {
+            uint8_t *input = realloc(buffers->inputs[i], size);
+            if (!input) {
+                return NULL;
+            }
+            buffers->inputs[i] = input;
+        }
+        buffers->i_input_size = size;
+        memory_count_pictures(s);
+    }
+    s->b_input_acquired = 1;
+    return buffers->inputs[s->i_input];
+}
+
+int session_commit_input(session_t *s) {
+    if (!s->b_input_acquired) {
+        return 1;
+    }
+    const uint8_t *data = s->buffers.inputs[s->i_input];
+    s->b_input_acquired = 0;
+    s->i_input ^= 1;
+    return session_add_frame_packed(s, data, s->encoder.i_src_width * 4, COMPRESSION_FORMAT_RGBA);
+}
+
+// YUV input goes to x264 as is: x264_encoder_encode copies the planes into its own frame before
+// returning, so in the serial case the picture can point straight at the caller's memory. The
+// pipeline returns before x264 sees the frame, so there the planes are copied into a ring slot.
+static int add_frame_yuv(session_t *s, int i_csp, uint8_t *const planes[3], const int strides[3]) {
+    encoder_state_t *encoder = &s->encoder;
+    uint64_t i_in_us = now_us();
+    
+    // only packed frames are hashed and converted, so the next one can't build on this
+    s->tiles.b_hashes_valid = 0;
+    s->tiles.b_picture_valid = 0;
+    
+#if RAW2MP4_HAVE_THREADS
+    if (s->pipeline.b_enabled) {
+        x264_picture_t *pic = pipeline_acquire_picture(s);
+        uint64_t i_start = now_us();
+        if (i_csp == X264_CSP_NV12) {
+            convert_nv12_to_i420(planes[0], strides[0], planes[1], strides[1], pic->img.plane, pic->img.i_stride,
+                                 encoder->param.i_width, encoder->param.i_height);
+        } else {
+            convert_copy_i420((const uint8_t *const *)planes, strides, pic->img.plane, pic->img.i_stride,
+                              encoder->param.i_width, encoder->param.i_height);
+        }
+        pic->i_pts = next_pts(s, i_in_us);
+        stats_frame_in(s, now_us() - i_start, 0);
+        pipeline_submit_picture(s);
+        // the mux thread's failures show up a few frames late
+        return session_failed(s) ? -1 : 0;
+    }
+#endif
+    
+    x264_picture_t pic;
+    x264_picture_init(&pic);
+    pic.img.i_csp = i_csp;
+    pic.img.i_plane = i_csp == X264_CSP_NV12 ? 2 : 3;
+    for (int i = 0; i < pic.img.i_plane; i++) {
+        pic.img.plane[i] = planes[i];
+        pic.img.i_stride[i] = strides[i];
+    }
+    pic.i_pts = next_pts(s, i_in_us);
+    stats_frame_in(s, 0, 0);
+    return encode_frame(s, &pic);
+}
+
+int session_add_frame_i420(session_t *s, const uint8_t *const planes[3], const int strides[3]) {
+    // x264 only reads input planes, the casts just match its struct
+    uint8_t *p[3] = { (uint8_t *)planes[0], (uint8_t *)planes[1], (uint8_t *)planes[2] };
+    return add_frame_yuv(s, X264_CSP_I420, p, strides);
+}
+
+int session_add_frame_nv12(session_t *s, const uint8_t *y, int y_stride, const uint8_t *uv, int uv_stride) {
+    uint8_t *p[3] = { (uint8_t *)y, (uint8_t *)uv, NULL };
+    int strides[3] = { y_stride, uv_stride, 0 };
+    return add_frame_yuv(s, X264_CSP_NV12, p, strides);
+}
+
+// Chunked encoding. The frames are cut into chunks of at most a GOP, each encoded from an IDR by
+// an x264 instance of its own on a worker thread, and the samples are muxed in order once a round
+// of chunks is done. Every instance is opened with the session's parameters, so its SPS and PPS
+// are the ones already in the mp4's sample entry. Frames keep their pts from the whole input,
+// which, with a constant frame rate, makes each chunk's dts carry on from the last chunk's.
+
+// Chunks shorter than this cost an IDR each for little gain, so short inputs get fewer threads.
+#define CHUNK_MIN_FRAMES 32
+
+typedef struct {
+    int i_first;
+    int i_frames;
+    encoded_packet_t *packets; // decode order
+    int i_packets;
+    int b_failed;
+} chunk_t;
+
+typedef struct {
+    session_t *s;
+    int (*read_frame)(void *opaque, int i_frame, uint8_t *rgba);
+    void *opaque;
+    chunk_t *chunks;
+    // the SEI from the headers, for the very first sample
+    const uint8_t *p_sei;
+    uint32_t i_sei_size;
+} chunk_round_t;
+
+static void chunk_encode(chunk_round_t *round, chunk_t *chunk, x264_t *h, x264_picture_t *pic) {
+    x264_picture_t pic_out;
+    x264_nal_t *nal;
+    int i_nal;
+
+    uint64_t i_start = now_us();
+    int i_frame_size = x264_encoder_encode(h, &nal, &i_nal, pic, &pic_out);
+    stats_encoded(round->s, pic != NULL, i_frame_size > 0, now_us() - i_start);
+    if (i_frame_size < 0 || (i_frame_size > 0 && chunk->i_packets == chunk->i_frames)) {
+        chunk->b_failed = 1;
+        return;
+    }
+    if (i_frame_size > 0) {
+        int b_sei = chunk->i_first == 0 && chunk->i_packets == 0;
+        encoded_packet_t *packet = &chunk->packets[chunk->i_packets++];
+        packet->sample = mp4_create_sample_prefixed(round->s, b_sei ? round->p_sei : NULL, b_sei ? round->i_sei_size : 0,
+                                                    nal[0].p_payload, i_frame_size);
+        packet->pic_out = pic_out;
+        chunk->b_failed = packet->sample == NULL;
+    }
+}
+
+static void encode_chunk(void *ctx, int job) {
+    chunk_round_t *round = ctx;
+    chunk_t *chunk = &round->chunks[job];
+    session_t *s = round->s;
+    x264_param_t param = s->encoder.param;
+    int src_w = s->encoder.i_src_width;
+    int src_h = s->encoder.i_src_height;
+    int w = param.i_width;
+    int h = param.i_height;
+    x264_picture_t pic;
+
+    chunk->packets = calloc(chunk->i_frames, sizeof(encoded_packet_t));
+    uint8_t *rgba = malloc((size_t)src_w * src_h * 4);
+    int b_pic = x264_picture_alloc(&pic, param.i_csp, w, h) == 0;
+    x264_t *encoder = open_encoder(&param);
+    chunk->b_failed = !chunk->packets || !rgba || !b_pic || !encoder;
+
+    for (int i = 0; i < chunk->i_frames && !chunk->b_failed; i++) {
+        if (round->read_frame(round->opaque, chunk->i_first + i, rgba) != 0) {
+            chunk->b_failed = 1;
+            break;
+        }
+        uint64_t i_start = now_us();
+        convert_scaled_to_i420(rgba, src_w * 4, CONVERT_FORMAT_RGBA, src_w, src_h, pic.img.plane, pic.img.i_stride,
+                               w, h, 0, h);
+        pic.i_pts = chunk->i_first + i;
+        pic.i_type = i == 0 ? X264_TYPE_IDR : X264_TYPE_AUTO;
+        stats_frame_in(s, now_us() - i_start, 0);
+        chunk_encode(round, chunk, encoder, &pic);
+    }
+    while (!chunk->b_failed && x264_encoder_delayed_frames(encoder)) {
+        chunk_encode(round, chunk, encoder, NULL);
+    }
+
+    if (encoder) {
+        close_encoder(encoder);
+    }
+    if (b_pic) {
+        x264_picture_clean(&pic);
+    }
+    free(rgba);
 }
 
-static int mp4_close_file(int64_t largest_pts, int64_t second_largest_pts )
+int session_encode_frames(session_t *s, int n_frames, int i_threads,
+                          int (*read_frame)(void *opaque, int i_frame, uint8_t *rgba), void *opaque) {
+    encoder_state_t *encoder = &s->encoder;
+
+    if (s->b_finished || encoder->i_frame != 0 || n_frames < 0) {
+        return 1;
+    }
+#if RAW2MP4_HAVE_THREADS
+    if (s->pipeline.b_enabled) {
+        return 1;
+    }
+#endif
+
+    workers_t *workers = workers_create(i_threads);
+    CHK_RETURN(workers != NULL, "can't start %d chunk encoding threads", i_threads);
+    i_threads = workers_count(workers);
+
+    // A chunk per GOP adds no keyframes x264 wasn't going to place anyway, but when that leaves
+    // threads idle, shorter chunks buy the parallelism with a few more.
+    int i_chunk = encoder->param.i_keyint_max;
+    int i_per_thread = (n_frames + i_threads - 1) / i_threads;
+    if (i_chunk > i_per_thread) {
+        i_chunk = i_per_thread > CHUNK_MIN_FRAMES ? i_per_thread : CHUNK_MIN_FRAMES;
+    }
+    // spread the frames evenly so the last chunk isn't a stub
+    int n_chunks = n_frames ? (int)(((int64_t)n_frames + i_chunk - 1) / i_chunk) : 0;
+    // two chunks per thread in flight keeps the threads busy while bounding what's held in memory
+    int i_round = 2 * i_threads;
+
+    chunk_round_t round = { s, read_frame, opaque, NULL, s->mp4.p_sei_buffer, s->mp4.i_sei_size };
+    round.chunks = calloc(i_round, sizeof(chunk_t));
+    if (!round.chunks) {
+        fprintf(stderr, "out of memory for chunks\n");
+        workers_destroy(workers);
+        return 1;
+    }
+    s->mp4.i_sei_size = 0;
+
+    int b_failed = 0;
+    for (int c0 = 0; c0 < n_chunks && !b_failed; c0 += i_round) {
+        int n = n_chunks - c0 < i_round ? n_chunks - c0 : i_round;
+        for (int c = 0; c < n; c++) {
+            chunk_t *chunk = &round.chunks[c];
+            memset(chunk, 0, sizeof(chunk_t));
+            chunk->i_first = (int)((int64_t)n_frames * (c0 + c) / n_chunks);
+            chunk->i_frames = (int)((int64_t)n_frames * (c0 + c + 1) / n_chunks) - chunk->i_first;
+        }
+        workers_run(workers, encode_chunk, &round, n);
+
+        for (int c = 0; c < n; c++) {
+            chunk_t *chunk = &round.chunks[c];
+            b_failed |= chunk->b_failed;
+            for (int i = 0; i < chunk->i_packets; i++) {
+                if (b_failed) {
+                    lsmash_delete_sample(chunk->packets[i].sample);
+                } else {
+                    b_failed = write_encoded(s, chunk->packets[i].sample, &chunk->packets[i].pic_out) != 0;
+                }
+            }
+            free(chunk->packets);
+            if (!b_failed) {
+                // as if the frames had gone through next_pts
+                encoder->i_frame = chunk->i_first + chunk->i_frames;
+                encoder->i_last_input_pts = encoder->i_frame - 1;
+            }
+        }
+    }
+
+    free(round.chunks);
+    workers_destroy(workers);
+    return b_failed;
+}
+
+// lsmash's progress callback while it moves the moov to the front.
+static int mp4_finish_progress(void *param, uint64_t i_done, uint64_t i_total) {
+    session_t *s = param;
+    stats_lock(s);
+    s->stats.counters.i_finish_moved_bytes = i_done;
+    stats_unlock(s);
+    if (s->mp4.on_finish_progress) {
+        s->mp4.on_finish_progress(s->mp4.finish_opaque, i_done, i_total);
+    }
+    return 0;
+}
+
+static int mp4_close_file(session_t *s, int64_t largest_pts, int64_t second_largest_pts, int64_t i_trailing_frames )
 {
-    mp4_state_t *p_mp4 = &mp4_state;
+    mp4_state_t *p_mp4 = &s->mp4;
 
     if( !p_mp4 )
         return 0;
@@ -396,12 +2370,15 @@ static int mp4_close_file(int64_t largest_pts, int64_t second_largest_pts )
         {
             /* Flush the rest of samples and add the last sample_delta. */
             int64_t last_delta = largest_pts - second_largest_pts;
-            lsmash_flush_pooled_samples( p_mp4->p_root, p_mp4->i_track, (uint32_t)((last_delta ? last_delta : 1) * p_mp4->i_time_inc));
+            /* Duplicate frames skipped at the very end extend the last sample, which can then be the only one. */
+            if( !last_delta )
+                last_delta = 1;
+            last_delta += i_trailing_frames;
+            CHK_RETURN( lsmash_flush_pooled_samples( p_mp4->p_root, p_mp4->i_track, (uint32_t)(last_delta * p_mp4->i_time_inc) ) == 0,
+                        "failed to flush the rest of samples." );
 
-            if( p_mp4->i_movie_timescale != 0 && p_mp4->i_video_timescale != 0 )    /* avoid zero division */
-                actual_duration = ((double)((largest_pts + last_delta) * p_mp4->i_time_inc) / p_mp4->i_video_timescale) * p_mp4->i_movie_timescale;
-            else
-                CHK(0, "timescale is broken.\n" );
+            CHK_RETURN( p_mp4->i_movie_timescale != 0 && p_mp4->i_video_timescale != 0, "timescale is broken." );    /* avoid zero division */
+            actual_duration = ((double)((largest_pts + last_delta) * p_mp4->i_time_inc) / p_mp4->i_video_timescale) * p_mp4->i_movie_timescale;
 
             /*
              * Declare the explicit time-line mapping.
@@ -421,48 +2398,554 @@ static int mp4_close_file(int64_t largest_pts, int64_t second_largest_pts )
             edit.rate       = ISOM_EDIT_MODE_NORMAL;
             if( !p_mp4->b_fragments )
             {
-                CHK( lsmash_create_explicit_timeline_map( p_mp4->p_root, p_mp4->i_track, edit ) == 0,
-                                "failed to set timeline map for video.\n" );
+                CHK_RETURN( lsmash_create_explicit_timeline_map( p_mp4->p_root, p_mp4->i_track, edit ) == 0,
+                            "failed to set timeline map for video." );
             }
             else if( !p_mp4->b_stdout )
-                CHK( lsmash_modify_explicit_timeline_map( p_mp4->p_root, p_mp4->i_track, 1, edit ) == 0,
-                                "failed to update timeline map for video.\n" );
+                CHK_RETURN( lsmash_modify_explicit_timeline_map( p_mp4->p_root, p_mp4->i_track, 1, edit ) == 0,
+                            "failed to update timeline map for video." );
         }
 
-        CHK( lsmash_finish_movie( p_mp4->p_root, NULL ) == 0, "failed to finish movie.\n" );
+        /* With fast start, lsmash writes the moov at the end as usual, then shifts everything after
+         * the ftyp forward by the moov's size through the buffer and writes the moov in the gap. */
+        lsmash_adhoc_remux_t moov_to_front;
+        moov_to_front.buffer_size = p_mp4->i_fast_start_buffer;
+        moov_to_front.func        = mp4_finish_progress;
+        moov_to_front.param       = s;
+        /* Finishing writes the moov, and with fast start allocates the move's buffer: either can run
+         * out of memory or disk. The root is left for session_destroy to drop. */
+        uint64_t i_start = now_us();
+        if( lsmash_finish_movie( p_mp4->p_root, p_mp4->b_fast_start ? &moov_to_front : NULL ) )
+        {
+            if( p_mp4->b_fast_start )
+                fprintf( stderr, "failed to finish movie, moving the moov to the front through a %llu byte buffer.\n",
+                         (unsigned long long)moov_to_front.buffer_size );
+            else
+                fprintf( stderr, "failed to finish movie.\n" );
+            return 1;
+        }
+        stats_lock( s );
+        s->stats.counters.i_finish_us += now_us() - i_start;
+        if( p_mp4->b_fast_start )
+            s->stats.counters.i_finish_buffer_bytes = moov_to_front.buffer_size; /* lsmash's, at least twice the moov */
+        s->stats.counters.i_buffer_allocs = p_mp4->i_memory_reallocs;
+        stats_unlock( s );
+        
+        /* the move's buffer was held on top of everything else, if only for the peak */
+        if( p_mp4->b_fast_start )
+        {
+            memory_add( s, MEMORY_MUX, moov_to_front.buffer_size );
+            memory_add( s, MEMORY_MUX, -(int64_t)moov_to_front.buffer_size );
+        }
         
         lsmash_cleanup_summary( (lsmash_summary_t *)p_mp4->summary );
-        lsmash_close_file( &p_mp4->file_param );
+        mp4_close_output( p_mp4 );
         lsmash_destroy_root( p_mp4->p_root );
         free( p_mp4->p_sei_buffer );
+        p_mp4->p_root = NULL;
+        p_mp4->p_sei_buffer = NULL;
+        memory_set( s, MEMORY_MUX, 0 );
+    }
+    
+    return 0;
+}
+
+session_t *session_open(const char *output_path, int w, int h, const compression_options_t *opts) {
+    compression_options_t defaults;
+    if (!opts) {
+        CompressionSessionDefaultOptions(&defaults);
+        opts = &defaults;
     }
     
+    session_t *s = calloc(1, sizeof(session_t));
+    if (!s) {
+        return NULL;
+    }
+    if (session_init(s, output_path, w, h, opts) != 0) {
+        session_destroy(s);
+        return NULL;
+    }
+    return s;
+}
+
+int session_finish(session_t *s) {
+    encoder_state_t *encoder = &s->encoder;
+    
+    if (s->b_finished) {
+        return 0;
+    }
+    s->b_finished = 1;
+    
+#if RAW2MP4_HAVE_THREADS
+    if (s->pipeline.b_enabled) {
+        pipeline_finish(s);
+    }
+#endif
+    while (x264_encoder_delayed_frames(encoder->h)) {
+        if (encode_frame(s, NULL) != 0) {
+            break;
+        }
+    }
+    
+    close_encoder(encoder->h);
+    encoder->h = NULL;
+    memory_set(s, MEMORY_ENCODER, 0);
+    // a movie that's missing frames isn't worth finishing; session_destroy drops what there is
+    int result = 1;
+    if (!session_failed(s)) {
+        int64_t i_trailing_frames = encoder->i_frame ? encoder->i_frame - 1 - encoder->i_last_input_pts : 0;
+        result = mp4_close_file(s, encoder->largest_pts, encoder->second_largest_pts, i_trailing_frames);
+    }
+    if (s->stats.i_interval) {
+        stats_log(s);
+    }
+    return result;
+}
+
+void session_destroy(session_t *s) {
+    if (!s) {
+        return;
+    }
+    
+    // Abandoned without finishing: stop the stages and drop the output without finalising it.
+#if RAW2MP4_HAVE_THREADS
+    if (s->pipeline.b_enabled) {
+        pipeline_finish(s);
+    }
+#endif
+    if (s->encoder.h) {
+        close_encoder(s->encoder.h);
+    }
+    if (s->mp4.p_root) {
+        lsmash_cleanup_summary((lsmash_summary_t *)s->mp4.summary);
+        mp4_close_output(&s->mp4);
+        lsmash_destroy_root(s->mp4.p_root);
+        free(s->mp4.p_sei_buffer);
+    }
+    
+    free(s->mp4.p_memory);
+    free(s->tiles.hashes);
+    free(s->tiles.prev_hashes);
+    free(s->tiles.dirty);
+    if (s->tiles.pic.img.plane[0]) {
+        x264_picture_clean(&s->tiles.pic);
+    }
+    
+    if (s->pool && s->buffers.i_pics) {
+        pool_give(s->pool, &s->buffers);
+    } else {
+        buffers_free(&s->buffers);
+    }
+    free(s->governor.tune);
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_destroy(&s->stats.lock);
+#endif
+    free(s);
+}
+
+int session_get_stats(session_t *s, compression_stats_t *stats) {
+    stats_snapshot(s, stats);
+    return 0;
+}
+
+void session_get_alloc_counts(session_t *s, uint64_t *i_buffer_allocs, uint64_t *i_sample_allocs) {
+    stats_lock(s);
+    *i_buffer_allocs = s->stats.counters.i_buffer_allocs;
+    *i_sample_allocs = s->stats.counters.i_sample_allocs;
+    stats_unlock(s);
+}
+
+int session_get_memory(session_t *s, compression_memory_t *memory) {
+    stats_lock(s);
+    *memory = s->stats.memory_settings;
+    memory->i_encoder = s->stats.memory[MEMORY_ENCODER];
+    memory->i_pictures = s->stats.memory[MEMORY_PICTURES];
+    memory->i_tiles = s->stats.memory[MEMORY_TILES];
+    memory->i_mux = s->stats.memory[MEMORY_MUX];
+    memory->i_output = s->stats.memory[MEMORY_OUTPUT];
+    memory->i_total = memory_total_locked(s);
+    memory->i_peak = s->stats.i_memory_peak;
+    stats_unlock(s);
     return 0;
 }
 
+uint8_t *session_take_output(session_t *s, size_t *size) {
+    if (!s->b_finished || !s->mp4.b_memory || s->mp4.p_root) {
+        *size = 0;
+        return NULL;
+    }
+    uint8_t *data = s->mp4.p_memory;
+    *size = s->mp4.i_memory_size;
+    s->mp4.p_memory = NULL;
+    s->mp4.i_memory_size = s->mp4.i_memory_alloc = s->mp4.i_memory_pos = 0;
+    memory_set(s, MEMORY_OUTPUT, 0);
+    return data;
+}
+
+int CompressionSessionOpen(const char *output_path, int w, int h) {
+    return CompressionSessionOpenWithOptions(output_path, w, h, NULL);
+}
+
+int CompressionSessionOpenWithOptions(const char *output_path, int w, int h, const compression_options_t *opts) {
+    default_session = session_open(output_path, w, h, opts);
+    return default_session == NULL;
+}
+
+int CompressionSessionAddFrame(uint8_t *rgba) {
+    return session_add_frame(default_session, rgba);
+}
+
+int CompressionSessionAddFramePacked(const uint8_t *data, int stride, compression_format_t format) {
+    return session_add_frame_packed(default_session, data, stride, format);
+}
+
+int CompressionSessionAddFrameRects(const uint8_t *data, int stride, compression_format_t format,
+                                    const compression_rect_t *rects, int n_rects) {
+    return session_add_frame_rects(default_session, data, stride, format, rects, n_rects);
+}
+
+int CompressionSessionAddFrameRegions(const compression_region_t *regions, int n_regions,
+                                      compression_format_t format) {
+    return session_add_frame_regions(default_session, regions, n_regions, format);
+}
+
+int CompressionSessionAddCapture(capture_t *capture, int i_first, int n_frames) {
+    return session_add_capture(default_session, capture, i_first, n_frames);
+}
+
+EXPORT uint8_t *CompressionSessionAcquireInputBuffer(void) {
+    return session_acquire_input(default_session);
+}
+
+EXPORT int CompressionSessionCommitInputBuffer(void) {
+    return session_commit_input(default_session);
+}
+
+int CompressionSessionAddFrameI420(const uint8_t *const planes[3], const int strides[3]) {
+    return session_add_frame_i420(default_session, planes, strides);
+}
+
+int CompressionSessionAddFrameNV12(const uint8_t *y, int y_stride, const uint8_t *uv, int uv_stride) {
+    return session_add_frame_nv12(default_session, y, y_stride, uv, uv_stride);
+}
+
+int CompressionSessionEncodeFrames(int n_frames, int i_threads,
+                                   int (*read_frame)(void *opaque, int i_frame, uint8_t *rgba), void *opaque) {
+    return session_encode_frames(default_session, n_frames, i_threads, read_frame, opaque);
+}
+
 int CompressionSessionFinish(void) {
-    while (x264_encoder_delayed_frames(encoder_state.h)) {
-        encode_frame(NULL);
+    int result = session_finish(default_session);
+    b_default_stats_valid = session_get_stats(default_session, &default_stats) == 0;
+    session_get_memory(default_session, &default_memory);
+    free(default_output);
+    default_output = session_take_output(default_session, &default_output_size);
+    session_destroy(default_session);
+    default_session = NULL;
+    return result;
+}
+
+int CompressionSessionGetStats(compression_stats_t *stats) {
+    if (default_session) {
+        return session_get_stats(default_session, stats);
+    }
+    if (!b_default_stats_valid) {
+        return 1;
+    }
+    *stats = default_stats;
+    return 0;
+}
+
+int CompressionSessionGetMemory(compression_memory_t *memory) {
+    if (default_session) {
+        return session_get_memory(default_session, memory);
     }
+    if (!b_default_stats_valid) {
+        return 1;
+    }
+    *memory = default_memory;
+    return 0;
+}
+
+EXPORT int CompressionSessionOpenWithMemoryBudget(const char *output_path, int w, int h, size_t i_memory_budget) {
+    compression_options_t opts;
+    CompressionSessionDefaultOptions(&opts);
+    opts.i_memory_budget = i_memory_budget;
+    return CompressionSessionOpenWithOptions(output_path, w, h, &opts);
+}
+
+EXPORT size_t CompressionSessionMemoryUsage(void) {
+    compression_memory_t memory;
+    return CompressionSessionGetMemory(&memory) == 0 ? (size_t)memory.i_total : 0;
+}
+
+EXPORT size_t CompressionSessionPeakMemoryUsage(void) {
+    compression_memory_t memory;
+    return CompressionSessionGetMemory(&memory) == 0 ? (size_t)memory.i_peak : 0;
+}
+
+EXPORT uint8_t *CompressionSessionOutputData(void) {
+    return default_output;
+}
+
+EXPORT size_t CompressionSessionOutputSize(void) {
+    return default_output_size;
+}
+
+EXPORT void CompressionSessionReleaseOutput(void) {
+    free(default_output);
+    default_output = NULL;
+    default_output_size = 0;
+}
+
+// The command line tool. Programs that link the session API themselves, like bench, build with
+// RAW2MP4_NO_MAIN.
+#ifndef RAW2MP4_NO_MAIN
+
+#if __EMSCRIPTEN__
+#define PATH_PREFIX "/working/"
+#else
+#define PATH_PREFIX ""
+#endif
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *prefixed_path(const char *path) {
+    if (strcmp(path, "-") == 0) {
+        return strdup(path);
+    }
+    char *full_path = malloc(strlen(PATH_PREFIX) + strlen(path) + 1);
+    if (full_path) {
+        strcpy(full_path, PATH_PREFIX);
+        strcat(full_path, path);
+    }
+    return full_path;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: raw2mp4 [options] output.mp4 width height image_001.raw image_002.raw ...\n"
+            "       raw2mp4 [options] output.mp4 width height -\n"
+            "       raw2mp4 [options] -B manifest\n"
+            "       raw2mp4 [options] -C capture output.mp4\n"
+            "  -i         convert only the parts of each frame that changed\n"
+            "  -d         skip frames identical to the previous one, showing that one for longer\n"
+            "  -f         write a fragmented mp4; implied when output.mp4 is - (stdout)\n"
+            "  -M         fast start: move the moov in front of the mdat when finishing\n"
+            "  -s         each input is a stream of back to back frames rather than a single frame\n"
+            "  -z         live: no B-frames or lookahead, intra refresh instead of keyframes, so each\n"
+            "             frame is written as soon as it's encoded; -l shows the latency\n"
+            "  -r frames  frames to read ahead of the encoder\n"
+            "  -l frames  log stats as JSON on stderr every so many frames, and at the end\n"
+            "  -p preset  x264 preset, veryfast by default\n"
+            "  -t tune    x264 tune, e.g. stillimage or zerolatency\n"
+            "  -P profile baseline, main (the default) or high\n"
+            "  -F fps     frame rate of the input, as 30 or 30000/1001; 15 by default\n"
+            "  -q crf     constant quality, 23 by default\n"
+            "  -b kbps    average bitrate instead of constant quality\n"
+            "  -k frames  most frames between keyframes\n"
+            "  -S WxH     encode at this size, scaling the frames down; 0 for either side keeps the aspect\n"
+            "  -g fps     move between presets to keep encoding at this many frames a second\n"
+            "  -x threads x264 threads, 0 for one per CPU; needs x264 built with threads\n"
+            "  -y         x264 threads work on slices of each frame rather than whole frames\n"
+            "  -L threads x264 lookahead threads\n"
+            "  -m MB      keep the session within this much memory, cutting x264's lookahead, B-frames\n"
+            "             and references to fit; -l shows the usage\n"
+            "  -j threads encode GOP sized chunks of the clip in parallel, 0 for one per CPU;\n"
+            "             needs one file per frame\n"
+            "  -B file    encode every job in a manifest, one per line as [-s] output.mp4 width height\n"
+            "             input ..., and report each job's time as JSON\n"
+            "  -J jobs    jobs to run at once with -B, 0 (the default) for one per CPU\n"
+            "  -C file    encode a capture file (see capture.h) at its own size and frame rate,\n"
+            "             converting only the tiles it says changed\n"
+            "  -          read a frame stream from stdin\n");
+}
+
+// -M: moving the mdat of a multi-GB file takes a while, so show how far along it is every 10%.
+static void print_finish_progress(void *opaque, uint64_t i_done, uint64_t i_total) {
+    int *i_last_tenth = opaque;
+    int i_tenth = i_total ? (int)(i_done * 10 / i_total) : 10;
+    if (i_tenth > *i_last_tenth) {
+        *i_last_tenth = i_tenth;
+        fprintf(stderr, "moving moov to the front: %d%% of %.1f MB\n", i_tenth * 10, i_total / 1e6);
+    }
+}
+
+typedef struct {
+    char **paths;
+    size_t frame_size;
+} frame_files_t;
+
+// Frame source for -j, called from several threads at once.
+static int read_frame_file(void *opaque, int i_frame, uint8_t *rgba) {
+    frame_files_t *files = opaque;
+    const char *path = files->paths[i_frame];
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return 1;
+    }
+    size_t got = fread(rgba, 1, files->frame_size, f);
+    fclose(f);
+    if (got != files->frame_size) {
+        fprintf(stderr, "Short read (%zu) from %s\n", got, path);
+        return 1;
+    }
+    return 0;
+}
+
+// -B: runs the manifest's jobs and prints a line of JSON for each, then one for the whole batch.
+static int run_batch(const char *manifest_path, const compression_options_t *opts, int i_jobs, int i_read_ahead) {
+    char *full_path = prefixed_path(manifest_path);
+    CHK(full_path != NULL, "manifest path");
+    batch_t *batch = batch_load(full_path, PATH_PREFIX);
+    free(full_path);
+    if (!batch) {
+        return 1;
+    }
+    
+    double start = now_seconds();
+    int n_failed = batch_run(batch, opts, i_jobs, i_read_ahead);
+    double seconds = now_seconds() - start;
+    
+    int n_jobs = batch_count(batch);
+    uint64_t n_frames = 0;
+    for (int i = 0; i < n_jobs; i++) {
+        const batch_result_t *r = batch_result(batch, i);
+        printf("{\"job\":%d,\"output\":", i);
+        json_print_string(stdout, r->output_path);
+        printf(",\"width\":%d,\"height\":%d,\"frames\":%d,\"failed\":%d,"
+               "\"start_ms\":%.1f,\"ms\":%.1f,\"fps\":%.1f}\n",
+               r->w, r->h, r->n_frames, r->b_failed,
+               r->f_start * 1e3, r->f_seconds * 1e3, r->f_seconds > 0 ? r->n_frames / r->f_seconds : 0);
+        n_frames += r->n_frames;
+    }
+    printf("{\"jobs\":%d,\"failed\":%d,\"frames\":%llu,\"seconds\":%.3f,\"jobs_per_second\":%.2f,"
+           "\"frames_per_second\":%.1f}\n",
+           n_jobs, n_failed, (unsigned long long)n_frames, seconds,
+           seconds > 0 ? n_jobs / seconds : 0, seconds > 0 ? n_frames / seconds : 0);
+    
+    batch_free(batch);
+    return n_failed != 0;
+}
+
+// -C: encodes a whole capture file, at the capture's frame rate unless -F was given.
+static int run_capture(const char *capture_path, const char *output_path, compression_options_t *opts, int b_fps) {
+    char *full_path = prefixed_path(capture_path);
+    CHK(full_path != NULL, "capture path");
+    capture_t *capture = capture_open(full_path);
+    free(full_path);
+    if (!capture) {
+        return 1;
+    }
+    int w, h, i_fps_num, i_fps_den;
+    compression_format_t format;
+    capture_info(capture, &w, &h, &format, &i_fps_num, &i_fps_den);
+    if (!b_fps) {
+        opts->i_fps_num = i_fps_num;
+        opts->i_fps_den = i_fps_den;
+    }
+    // regions only go into the picture incremental conversion keeps
+    opts->b_incremental_convert = 1;
     
-    x264_picture_clean(&encoder_state.pic);
-    x264_encoder_close(encoder_state.h);
-    mp4_close_file(encoder_state.largest_pts, encoder_state.second_largest_pts);
+    FILE *log = strcmp(output_path, "-") == 0 ? stderr : stdout;
+    fprintf(log, "writing to %s, w=%d, h=%d, %d frames from %s\n",
+            output_path, w, h, capture_frame_count(capture), capture_path);
     
-    memset(&encoder_state, 0, sizeof(encoder_state_t));
-    memset(&mp4_state, 0, sizeof(mp4_state_t));
+    char *output_full_path = prefixed_path(output_path);
+    CHK(output_full_path != NULL, "output path");
+    double start = now_seconds();
+    session_t *s = session_open(output_full_path, w, h, opts);
+    free(output_full_path);
+    int b_failed = s == NULL;
+    if (s) {
+        b_failed = session_add_capture(s, capture, 0, -1) != 0;
+        b_failed |= session_finish(s) != 0;
+        session_destroy(s);
+    }
+    double seconds = now_seconds() - start;
+    uint64_t bytes = capture_bytes_read(capture);
+    fprintf(log, "read %d frames, %.1f MB in %.2fs: %.1f MB/s end to end\n",
+            capture_frame_count(capture), bytes / 1e6, seconds, seconds > 0 ? bytes / 1e6 / seconds : 0);
+    capture_close(capture);
     
+    if (b_failed) {
+        return 1;
+    }
+    fprintf(log, "Finished!\n");
     return 0;
 }
 
-// usage: raw2mp4 output.mp4 width height image_001.raw image_002.raw ...
+// usage: raw2mp4 [options] output.mp4 width height image_001.raw image_002.raw ...
 int main(int argc, char **argv) {
-    size_t i = 1;
-    char *output_path = argv[i++];
-    int w = atoi(argv[i++]);
-    int h = atoi(argv[i++]);
-    
-    printf("writing to %s, w=%d, h=%d\n", output_path, w, h);
+    int b_stream = 0;
+    int b_fragmented = 0;
+    int b_skip_duplicates = 0;
+    int b_incremental_convert = 0;
+    int i_read_ahead = 0;
+    int i_stats_interval = 0;
+    int i_chunk_threads = -1;
+    const char *manifest_path = NULL;
+    int i_batch_jobs = 0;
+    const char *capture_path = NULL;
+    int b_fps = 0;
+    compression_options_t opts;
+    CompressionSessionDefaultOptions(&opts);
+    int opt;
+    while ((opt = getopt(argc, argv, "difMszr:l:p:t:P:F:q:b:k:g:j:S:x:yL:m:B:J:C:")) != -1) {
+        switch (opt) {
+            case 'd': b_skip_duplicates = 1; break;
+            case 'i': b_incremental_convert = 1; break;
+            case 'f': b_fragmented = 1; break;
+            case 'M': opts.b_fast_start = 1; break;
+            case 's': b_stream = 1; break;
+            case 'z': opts.b_live = 1; break;
+            case 'r': i_read_ahead = atoi(optarg); break;
+            case 'l': i_stats_interval = atoi(optarg); break;
+            case 'p': opts.preset = optarg; break;
+            case 't': opts.tune = optarg; break;
+            case 'P': opts.profile = optarg; break;
+            case 'F':
+                if (sscanf(optarg, "%d/%d", &opts.i_fps_num, &opts.i_fps_den) < 1) {
+                    usage();
+                    return 1;
+                }
+                b_fps = 1;
+                break;
+            case 'q': opts.f_crf = atof(optarg); break;
+            case 'b': opts.i_bitrate = atoi(optarg); break;
+            case 'k': opts.i_keyint = atoi(optarg); break;
+            case 'g': opts.f_target_fps = atof(optarg); break;
+            case 'j': i_chunk_threads = atoi(optarg); break;
+            case 'x': opts.i_encoder_threads = atoi(optarg); break;
+            case 'y': opts.b_sliced_threads = 1; break;
+            case 'L': opts.i_lookahead_threads = atoi(optarg); break;
+            case 'm': opts.i_memory_budget = (size_t)(atof(optarg) * 1024 * 1024); break;
+            case 'B': manifest_path = optarg; break;
+            case 'J': i_batch_jobs = atoi(optarg); break;
+            case 'C': capture_path = optarg; break;
+            case 'S':
+                if (sscanf(optarg, "%dx%d", &opts.i_output_width, &opts.i_output_height) < 1) {
+                    usage();
+                    return 1;
+                }
+                break;
+            default: usage(); return 1;
+        }
+    }
+    opts.b_fragmented = b_fragmented;
+    opts.b_skip_duplicates = b_skip_duplicates;
+    opts.b_incremental_convert = b_incremental_convert;
+    opts.i_stats_interval = i_stats_interval;
+    int i_finish_tenth = -1;
+    if (opts.b_fast_start) {
+        opts.on_finish_progress = print_finish_progress;
+        opts.finish_opaque = &i_finish_tenth;
+    }
     
 #if __EMSCRIPTEN__
     EM_ASM(
@@ -473,38 +2956,128 @@ int main(int argc, char **argv) {
     );
 #endif
     
-#if __EMSCRIPTEN__
-#define PATH_PREFIX "/working/"
-#else
-#define PATH_PREFIX ""
-#endif
-    char output_full_path[255];
-    sprintf(output_full_path, PATH_PREFIX "%s", output_path);
-    
-    printf("opening session\n");
-    CompressionSessionOpen(output_full_path, w, h);
-    printf("opened session\n");
-    size_t rgba_len = w * h * 4;
-    uint8_t *rgba = malloc(rgba_len);
-    for (; i < argc; i++) {
-        char file_path[255];
-        sprintf(file_path, PATH_PREFIX "%s", argv[i]);
-        printf("opening %s\n", file_path);
-        FILE *infile = fopen(file_path, "rb");
-        size_t read = 0;
-        if ((read = fread(rgba, 1, rgba_len, infile)) != rgba_len) {
-            fprintf(stderr, "Short read (%zu) from %s\n", read, file_path);
-            return 1; // short read
-        } else {
-            printf("successfully read %s\n", file_path);
+    if (manifest_path) {
+        if (argc != optind) {
+            usage();
+            return 1;
+        }
+        return run_batch(manifest_path, &opts, i_batch_jobs, i_read_ahead);
+    }
+    if (capture_path) {
+        if (argc - optind != 1 || i_chunk_threads >= 0 || opts.i_output_width || opts.i_output_height) {
+            usage();
+            return 1;
+        }
+        return run_capture(capture_path, argv[optind], &opts, b_fps);
+    }
+    if (argc - optind < 4) {
+        usage();
+        return 1;
+    }
+    
+    int i = optind;
+    char *output_path = argv[i++];
+    int w = atoi(argv[i++]);
+    int h = atoi(argv[i++]);
+    int n_inputs = argc - i;
+    if (n_inputs == 1 && strcmp(argv[i], "-") == 0) {
+        b_stream = 1;
+    }
+    if (b_stream && i_chunk_threads >= 0) {
+        fprintf(stderr, "-j needs one file per frame\n");
+        return 1;
+    }
+    
+    // keep stdout clean when the mp4 is going there
+    FILE *log = strcmp(output_path, "-") == 0 ? stderr : stdout;
+    fprintf(log, "writing to %s, w=%d, h=%d\n", output_path, w, h);
+    
+    char **input_paths = calloc(n_inputs, sizeof(char *));
+    CHK(input_paths != NULL, "input paths");
+    for (int j = 0; j < n_inputs; j++) {
+        input_paths[j] = prefixed_path(argv[i + j]);
+        CHK(input_paths[j] != NULL, "input path");
+    }
+    char *output_full_path = prefixed_path(output_path);
+    CHK(output_full_path != NULL, "output path");
+    
+    fprintf(log, "opening session\n");
+    if (CompressionSessionOpenWithOptions(output_full_path, w, h, &opts) != 0) {
+        // session_init has said why
+        for (int j = 0; j < n_inputs; j++) {
+            free(input_paths[j]);
         }
-        fclose(infile);
-        CompressionSessionAddFrame(rgba);
+        free(input_paths);
+        free(output_full_path);
+        return 1;
     }
-    CompressionSessionFinish();
+    fprintf(log, "opened session\n");
     
-    printf("Finished!\n");
+    size_t frame_size = (size_t)w * h * 4;
+    double start = now_seconds();
+    int n_frames = 0;
+    int b_failed = 0;
+    uint64_t bytes = 0;
+    double load_seconds = 0;
+    if (i_chunk_threads >= 0) {
+        frame_files_t files = { input_paths, frame_size };
+        b_failed = CompressionSessionEncodeFrames(n_inputs, i_chunk_threads, read_frame_file, &files) != 0;
+        n_frames = b_failed ? 0 : n_inputs;
+        bytes = (uint64_t)n_frames * frame_size;
+    } else {
+        for (int j = 0; j < (b_stream ? n_inputs : 1) && !b_failed; j++) {
+            input_t *in = b_stream
+                ? input_open_stream(input_paths[j], frame_size, i_read_ahead)
+                : input_open_files((const char *const *)input_paths, n_inputs, frame_size, i_read_ahead);
+            if (!in) {
+                b_failed = 1;
+                break;
+            }
+            const uint8_t *rgba;
+            // once the session has failed, reading the rest of the input is wasted work
+            while (!b_failed && (rgba = input_next(in))) {
+                // the session only reads the frame
+                b_failed |= CompressionSessionAddFrame((uint8_t *)rgba) != 0;
+                n_frames++;
+            }
+            b_failed |= input_failed(in);
+        
+            uint64_t in_bytes;
+            double in_seconds;
+            input_stats(in, &in_bytes, &in_seconds);
+            bytes += in_bytes;
+            load_seconds += in_seconds;
+            input_close(in);
+        }
+    }
+    b_failed |= CompressionSessionFinish() != 0;
+    
+    double seconds = now_seconds() - start;
+    compression_stats_t stats;
+    if (opts.b_fast_start && CompressionSessionGetStats(&stats) == 0 && stats.i_finish_buffer_bytes) {
+        fprintf(log, "moved %.1f MB for fast start in %.2fs with a %.1f MB buffer\n",
+                stats.i_finish_moved_bytes / 1e6, stats.i_finish_us / 1e6, stats.i_finish_buffer_bytes / 1e6);
+    }
+    fprintf(log, "read %d frames, %.1f MB in %.2fs: %.1f MB/s end to end",
+           n_frames, bytes / 1e6, seconds, seconds > 0 ? bytes / 1e6 / seconds : 0);
+    // chunked encoding reads on many threads at once, so it has no disk time of its own
+    if (load_seconds > 0) {
+        fprintf(log, ", %.1f MB/s from disk", bytes / 1e6 / load_seconds);
+    }
+    fprintf(log, "\n");
+    
+    for (int j = 0; j < n_inputs; j++) {
+        free(input_paths[j]);
+    }
+    free(input_paths);
+    free(output_full_path);
+    
+    if (b_failed) {
+        return 1;
+    }
+    fprintf(log, "Finished!\n");
 
     return 0;
 }
 
+#endif
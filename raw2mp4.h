@@ -0,0 +1,354 @@
+#ifndef RAW2MP4_H
+#define RAW2MP4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// API
+// all API fns return zero on success, non-zero on failure. Once a frame fails to go into the mp4,
+// say the disk is full, the session fails every frame after it and Finish too, leaving the output
+// unfinished; nothing aborts.
+
+typedef struct session_t session_t;
+typedef struct session_pool_t session_pool_t;
+typedef struct capture_t capture_t; // see capture.h
+
+// An encoded frame as handed to on_sample.
+typedef struct {
+    const uint8_t *data;  // the frame's NAL units with 4 byte big endian lengths, as stored in the mp4
+    int i_size;
+    int64_t i_pts;        // in frames, counting from the first one passed in
+    int64_t i_dts;
+    int b_keyframe;       // an IDR, or in live mode the start of an intra refresh
+    uint64_t i_latency_us; // from the frame being passed to an AddFrame function to now
+} compression_sample_t;
+
+typedef struct {
+    // x264 settings. NULL or 0 keeps the default in brackets. preset is any of x264's [veryfast];
+    // tune is x264's too, e.g. "stillimage" for slides or "zerolatency" [none]; profile is
+    // "baseline", "main" or "high" [main].
+    const char *preset;
+    const char *tune;
+    const char *profile;
+    // Frame rate the timestamps count in [15/1]. Skipped duplicates still make the output VFR.
+    int i_fps_num;
+    int i_fps_den;
+    // Constant quality, lower is better [23], unless i_bitrate asks for an average bitrate in kbit/s.
+    float f_crf;
+    int i_bitrate;
+    // Most frames between keyframes [250]; fragmented output starts a fragment at each one.
+    int i_keyint;
+    
+    // Encoded size, for frames that should come out smaller than they're passed in, like HiDPI
+    // captures. Packed frames are scaled down as they're converted, with a box filter for whole
+    // number ratios and bilinear otherwise, and the mp4's track has this size. 0 keeps the frame
+    // size, and with only one set the other follows the aspect ratio; both must be even. YUV frames
+    // skip conversion, so they have to be passed at this size. Turns off b_incremental_convert.
+    int i_output_width;
+    int i_output_height;
+    
+    // Speed governor. With f_target_fps > 0 the session times x264 on every frame and, every 16
+    // frames, moves one preset faster if encoding is over 1 / f_target_fps a frame, or one slower if
+    // it's under half that, so it keeps up in real time with the best quality the machine allows.
+    // The presets run from superfast to slow, and preset must be one of them.
+    double f_target_fps;
+    
+    // x264's own threads, which need an x264 built with them (see the README); a build configured
+    // with --disable-thread runs on one whatever is asked. i_encoder_threads is how many [1], 0 for
+    // x264's choice by CPU count. They encode different frames at once, which adds a frame of delay
+    // per thread, unless b_sliced_threads has them split each frame into slices instead: no added
+    // delay, for some throughput and compression. i_lookahead_threads [x264's choice] splits the
+    // lookahead's analysis too. Chunked encoding gives every chunk these threads.
+    int i_encoder_threads;
+    int b_sliced_threads;
+    int i_lookahead_threads;
+    
+    // Threads used for RGBA -> YUV conversion, counting the caller. 1 converts on the calling
+    // thread only, 0 uses one per CPU. Ignored in builds without pthreads.
+    int i_convert_threads;
+    
+    // Pipelined mode: conversion runs on the caller, x264 and the mp4 muxer each get a thread,
+    // so consecutive frames overlap and CompressionSessionAddFrame returns after conversion.
+    // i_queue_depth bounds the converted frames waiting for x264 and the encoded frames waiting
+    // for the muxer; AddFrame blocks when it's reached. Ignored in builds without pthreads.
+    int b_pipeline;
+    int i_queue_depth;
+    
+    // Optional. Sessions opened with a pool hand their picture buffers and conversion threads to
+    // it when destroyed, and take them back for the next session of the same size.
+    session_pool_t *pool;
+    
+    // Writes a fragmented mp4, one moof/mdat pair per GOP after an initial moov, so the start of
+    // the file can be uploaded or played while the rest is still being encoded. Always on when
+    // the output is stdout ("-") or a write callback.
+    int b_fragmented;
+    
+    // Optional. Sends the mp4 to this callback instead of output_path, which is then ignored. It's
+    // called in file order from whichever thread is muxing, and must return size on success.
+    int (*write)(void *opaque, const uint8_t *data, int size);
+    void *write_opaque;
+    
+    // Writes the mp4 into a buffer in memory instead of output_path, which is then ignored. Meant
+    // for the wasm build: the finished file can be handed to JS straight out of the heap rather
+    // than round tripping through the emscripten file system.
+    int b_memory_output;
+    
+    // Moves the moov box in front of the mdat when the mp4 is finished, so players and CDNs can
+    // start from the first bytes of the file without a range request to its end. lsmash shifts the
+    // mdat forward through a buffer rather than loading it, so the extra memory is
+    // i_fast_start_buffer bytes (4 MB when 0), or twice the moov if that's bigger, whatever the
+    // file's size; the cost is reading and writing the whole file again. Fragmented output already
+    // starts with its moov and ignores this.
+    int b_fast_start;
+    uint32_t i_fast_start_buffer;
+    
+    // Optional. Called as b_fast_start moves the mdat, with the bytes moved so far out of i_total,
+    // from the thread calling finish.
+    void (*on_finish_progress)(void *opaque, uint64_t i_done, uint64_t i_total);
+    void *finish_opaque;
+    
+    // Frames passed to the packed AddFrame functions that are identical to the previous one aren't
+    // converted or encoded; the previous frame is shown for longer instead. Idle stretches of a
+    // screen recording then cost a hash of the frame and nothing in the output.
+    int b_skip_duplicates;
+    
+    // Converts only the 16x16 tiles that changed since the previous frame, leaving the rest of
+    // the YUV picture as it was; worthwhile when little of the screen moves between frames. The
+    // changes come from tile hashes, or from the caller via the AddFrameRects functions.
+    int b_incremental_convert;
+    
+    // Writes the session's stats as one line of JSON to stderr every i_stats_interval frames
+    // written to the mp4, and once more when it's finished. 0 turns the log off.
+    int i_stats_interval;
+    
+    // Live mode, for previews that show frames as they're captured: no B-frames and no lookahead,
+    // so x264 returns each frame from the call it's given in, and (with i_encoder_threads other
+    // than 1) sliced rather than frame threads. Keyframes after the first are replaced by intra
+    // refresh, a column of intra blocks sweeping across i_keyint frames, which the mp4 marks as
+    // roll recovery points. Costs some compression. Outside pipelined mode, on_sample has been
+    // called for a frame by the time the AddFrame function it was passed to returns.
+    int b_live;
+    
+    // Optional. Called with every encoded frame just before it goes into the mp4, from whichever
+    // thread is muxing. The sample is only valid during the call.
+    void (*on_sample)(void *opaque, const compression_sample_t *sample);
+    void *sample_opaque;
+    
+    // Keeps the session within this many bytes, 0 for no limit. Meant for the emscripten builds,
+    // whose heap is fixed at TOTAL_MEMORY: the session is fitted to the budget when it's opened,
+    // cutting x264's sync lookahead, lookahead (and mbtree with it), B-frames, reference frames and
+    // threads in that order, and capping the samples lsmash holds before writing them, so it writes
+    // smaller chunks, or starts fragments early. The open fails, saying so on stderr, if even the
+    // smallest settings don't fit. With b_memory_output a quarter of the budget is kept for the
+    // output. Things that grow later, the output and lsmash's sample tables, and the buffers
+    // session_acquire_input allocates on first use, aren't cut to fit; session_get_memory shows
+    // how close they've got. If they, or fast start's buffer, can't be had, the frame or Finish
+    // fails and says why rather than aborting. Doesn't apply to session_encode_frames' chunk encoders.
+    size_t i_memory_budget;
+} compression_options_t;
+
+// Layouts accepted by the *AddFramePacked functions, named in memory byte order.
+typedef enum {
+    COMPRESSION_FORMAT_RGBA = 0,
+    COMPRESSION_FORMAT_BGRA,
+    COMPRESSION_FORMAT_ARGB,
+    COMPRESSION_FORMAT_RGB24,
+} compression_format_t;
+
+// A region of a frame that changed since the previous one, in pixels.
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+} compression_rect_t;
+
+// The pixels of one changed region of a frame, rows stride bytes apart, starting at rect's top left.
+typedef struct {
+    compression_rect_t rect;
+    const uint8_t *data;
+    int stride;
+} compression_region_t;
+
+// What a session has done so far. Stage times are cumulative wall clock time on whichever thread
+// ran the stage, so in pipelined mode they overlap rather than add up.
+typedef struct {
+    uint64_t i_frames_in;      // frames passed to the AddFrame functions
+    uint64_t i_frames_encoded; // frames handed to x264, i.e. i_frames_in less skipped duplicates
+    uint64_t i_frames_out;     // samples written to the mp4
+    uint64_t i_duplicates;     // frames skipped by b_skip_duplicates
+    int i_encoder_delay;       // frames x264 has been given and not yet returned
+    uint64_t i_bytes_out;      // h264 bytes written, not counting the mp4's own boxes
+    double f_bytes_per_frame;  // i_bytes_out / i_frames_out
+    
+    // frames written by type, and the type ('I', 'P' or 'B') and average QP of the last one
+    uint64_t i_frames_i;
+    uint64_t i_frames_p;
+    uint64_t i_frames_b;
+    char c_last_type;
+    double f_last_qp;
+    double f_average_qp;       // over all frames written
+    
+    uint64_t i_convert_us;     // tile hashing and colour conversion, or copying YUV input
+    uint64_t i_encode_us;      // x264_encoder_encode
+    uint64_t i_mux_us;         // appending samples to the mp4
+    uint64_t i_finish_us;      // lsmash_finish_movie, including moving the moov for b_fast_start
+    
+    // b_fast_start: bytes moved to make room for the moov, and the buffer they went through
+    uint64_t i_finish_moved_bytes;
+    uint64_t i_finish_buffer_bytes;
+    
+    // as session_get_alloc_counts
+    uint64_t i_buffer_allocs;
+    uint64_t i_sample_allocs;
+    
+    // the x264 preset in use, and how often the governor has changed it
+    const char *preset;
+    uint64_t i_preset_changes;
+    
+    int i_encoder_threads;     // threads x264 settled on, 1 if it was built without them
+    
+    // Time from a frame being passed to an AddFrame function to its sample being written, for the
+    // last sample and the average and worst over all of them. Chunked encoding doesn't time frames.
+    uint64_t i_last_latency_us;
+    double f_average_latency_us;
+    uint64_t i_max_latency_us;
+} compression_stats_t;
+
+// Memory a session holds, by what it's for, in bytes. x264 allocates through its own allocator, so
+// its share is estimated from the frames its settings let it hold; the rest is counted as it's
+// allocated and freed.
+typedef struct {
+    uint64_t i_encoder;   // x264's frames and per thread state
+    uint64_t i_pictures;  // the session's own pictures and input buffers
+    uint64_t i_tiles;     // tile hashes for b_skip_duplicates and b_incremental_convert
+    uint64_t i_mux;       // samples on their way into the mp4 or pooled by lsmash, and its sample tables
+    uint64_t i_output;    // the b_memory_output buffer
+    uint64_t i_total;
+    uint64_t i_peak;      // the most i_total has been
+    uint64_t i_budget;    // i_memory_budget, 0 without one
+    
+    // the x264 settings the session ended up with, after fitting to the budget
+    int i_lookahead;
+    int i_bframe;
+    int i_frame_reference;
+    int i_threads;
+} compression_memory_t;
+
+// Fills in the defaults CompressionSessionOpen uses.
+extern void CompressionSessionDefaultOptions(compression_options_t *opts);
+
+extern int CompressionSessionOpen(const char *output_path, int w, int h);
+extern int CompressionSessionOpenWithOptions(const char *output_path, int w, int h, const compression_options_t *opts);
+extern int CompressionSessionAddFrame(uint8_t *rgba); // len must be w * h * 4
+// stride is the distance in bytes between rows and may include padding, so a crop of a larger
+// buffer can be passed without repacking.
+extern int CompressionSessionAddFramePacked(const uint8_t *data, int stride, compression_format_t format);
+// For capture sources that already know what changed: only the tiles touched by rects are
+// converted, with no hashing. n_rects == 0 means the frame is unchanged. Needs
+// b_incremental_convert; without it the whole frame is converted.
+extern int CompressionSessionAddFrameRects(const uint8_t *data, int stride, compression_format_t format,
+                                           const compression_rect_t *rects, int n_rects);
+// For capture sources that hand over only what changed, as pixels of its own rather than within a
+// whole frame: each region is converted straight into the picture holding the previous frame. The
+// regions mustn't overlap, and their x, y, w and h must be even. Needs b_incremental_convert (so
+// not a scaled session), and the first frame, or one after YUV input, has to cover the whole frame;
+// otherwise the frame is refused with -1.
+extern int CompressionSessionAddFrameRegions(const compression_region_t *regions, int n_regions,
+                                             compression_format_t format);
+// Frames written straight into the session's memory, for the wasm build: JS fills the w * h * 4
+// byte RGBA buffer Acquire returns (a HEAPU8 view of it, taken after Acquire since the heap may
+// grow), then Commit encodes it as AddFrame would, without copying it into a buffer of its own
+// first. Acquiring again before committing returns the same buffer. See session_acquire_input.
+extern uint8_t *CompressionSessionAcquireInputBuffer(void);
+extern int CompressionSessionCommitInputBuffer(void);
+// Frames already in YUV 4:2:0 skip colour conversion and, outside pipelined mode, are read by
+// x264 in place.
+extern int CompressionSessionAddFrameI420(const uint8_t *const planes[3], const int strides[3]);
+extern int CompressionSessionAddFrameNV12(const uint8_t *y, int y_stride, const uint8_t *uv, int uv_stride);
+// See session_add_capture.
+extern int CompressionSessionAddCapture(capture_t *capture, int i_first, int n_frames);
+// See session_encode_frames.
+extern int CompressionSessionEncodeFrames(int n_frames, int i_threads,
+                                          int (*read_frame)(void *opaque, int i_frame, uint8_t *rgba), void *opaque);
+extern int CompressionSessionFinish(void);
+
+// With b_memory_output, the finished mp4 stays available after CompressionSessionFinish until
+// CompressionSessionReleaseOutput or the next Finish. From JS it's
+// HEAPU8.subarray(ptr, ptr + size); take the view after Finish, since the heap may have grown.
+extern uint8_t *CompressionSessionOutputData(void);
+extern size_t CompressionSessionOutputSize(void);
+extern void CompressionSessionReleaseOutput(void);
+// Stats of the built-in session, or after CompressionSessionFinish, of the one it finished.
+extern int CompressionSessionGetStats(compression_stats_t *stats);
+// Memory of the built-in session, or after CompressionSessionFinish, of the one it finished. From
+// JS, CompressionSessionOpenWithMemoryBudget opens with the defaults and i_memory_budget, and
+// Usage and PeakUsage are i_total and i_peak.
+extern int CompressionSessionGetMemory(compression_memory_t *memory);
+extern int CompressionSessionOpenWithMemoryBudget(const char *output_path, int w, int h, size_t i_memory_budget);
+extern size_t CompressionSessionMemoryUsage(void);
+extern size_t CompressionSessionPeakMemoryUsage(void);
+
+// Handle based API. The CompressionSession* functions above drive a single built-in session;
+// these can run any number at once. Different sessions may be used from different threads
+// concurrently, but each session must only be used by one thread at a time.
+
+// opts may be NULL for the defaults. Returns NULL, saying why on stderr, if the session can't be
+// opened: odd or zero dimensions, settings x264 rejects, an output that can't be created, or a
+// memory budget too small for the size.
+extern session_t *session_open(const char *output_path, int w, int h, const compression_options_t *opts);
+extern int session_add_frame(session_t *s, uint8_t *rgba); // len must be w * h * 4
+extern int session_add_frame_packed(session_t *s, const uint8_t *data, int stride, compression_format_t format);
+extern int session_add_frame_rects(session_t *s, const uint8_t *data, int stride, compression_format_t format,
+                                   const compression_rect_t *rects, int n_rects);
+// A session owned input buffer for the next frame, or NULL if it can't be allocated. There are two,
+// used in turn, so the previous frame stays readable while the next one is written. Commit returns
+// what session_add_frame_packed does for the frame, or non-zero if no buffer was acquired.
+extern uint8_t *session_acquire_input(session_t *s);
+extern int session_commit_input(session_t *s);
+extern int session_add_frame_regions(session_t *s, const compression_region_t *regions, int n_regions,
+                                     compression_format_t format);
+// Encodes n_frames frames of a capture file from i_first, or all of them from there with -1,
+// through session_add_frame_regions, so the frames are never put back together in full. Decoding
+// has to start at a keyframe, so the frames from the one before i_first are converted into the
+// picture without being encoded; the output starts at i_first. The session must be the capture's
+// size, with b_incremental_convert.
+extern int session_add_capture(session_t *s, capture_t *capture, int i_first, int n_frames);
+extern int session_add_frame_i420(session_t *s, const uint8_t *const planes[3], const int strides[3]);
+extern int session_add_frame_nv12(session_t *s, const uint8_t *y, int y_stride, const uint8_t *uv, int uv_stride);
+// Offline encoding of a whole clip on i_threads threads, 0 for one per CPU. The frames are split
+// into chunks of up to a GOP (i_keyint frames) that each start with an IDR and are encoded at once
+// by separate x264 instances, then written to the mp4 in order, timed exactly as a serial encode
+// would be. With i_bitrate each chunk averages the bitrate on its own. read_frame fills rgba
+// (w * h * 4 bytes) with frame i_frame and returns zero on success; it's called from several
+// threads at once, for frames in no particular order. Only for a session that hasn't been given
+// any frames and isn't pipelined; duplicate skipping, incremental conversion and the governor
+// don't apply. Finish the session as usual afterwards.
+extern int session_encode_frames(session_t *s, int n_frames, int i_threads,
+                                 int (*read_frame)(void *opaque, int i_frame, uint8_t *rgba), void *opaque);
+// Flushes the encoder and writes out the mp4.
+extern int session_finish(session_t *s);
+// With b_memory_output, hands over the finished mp4. Free it with free(). Returns NULL if the
+// session isn't finished or didn't write to memory.
+extern uint8_t *session_take_output(session_t *s, size_t *size);
+// Frees the session, returning its buffers to its pool if it has one. Destroying a session that
+// wasn't finished abandons its output.
+extern void session_destroy(session_t *s);
+
+// Can be called at any time, from any thread, including while pipelined stages are running.
+extern int session_get_stats(session_t *s, compression_stats_t *stats);
+
+// Allocations made while encoding, for checking the per frame path stays allocation free.
+// i_buffer_allocs counts growth of the session's own buffers (the in memory output), which stops
+// once they've reached their working size. i_sample_allocs counts the one buffer per frame that
+// lsmash requires: it takes ownership of every sample appended to it and frees it once written, so
+// those can't be recycled.
+extern void session_get_alloc_counts(session_t *s, uint64_t *i_buffer_allocs, uint64_t *i_sample_allocs);
+// Can be called from any thread, like session_get_stats.
+extern int session_get_memory(session_t *s, compression_memory_t *memory);
+
+// A pool keeps the buffers of up to i_max_idle destroyed sessions. Thread safe.
+extern session_pool_t *session_pool_create(int i_max_idle);
+extern void session_pool_destroy(session_pool_t *pool);
+
+#endif
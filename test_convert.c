@@ -0,0 +1,269 @@
+// Checks that every conversion backend this build and CPU have gives byte for byte the output of
+// the scalar kernel, for each packed format, plain and scaled, on random, saturated and flat
+// images. The scalar kernel is itself checked against the formulas in convert.h. Sizes are small
+// ones and odd multiples of 16, which leave the SIMD kernels a tail to hand to the scalar code,
+// and rows are padded by odd amounts so no load or store is aligned. Exits non-zero on a mismatch.
+//
+//     make test-convert
+
+#include "convert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bytes past the end of each output row that the conversion mustn't touch.
+#define GUARD 19
+#define GUARD_BYTE 0xa5
+
+typedef enum {
+    IMAGE_RANDOM = 0,
+    IMAGE_SATURATED, // every byte 0 or 255, which drives chroma to its limits
+    IMAGE_WHITE,
+    IMAGE_BLACK,
+    IMAGE_KINDS
+} image_kind_t;
+
+static const char *image_names[IMAGE_KINDS] = { "random", "saturated", "white", "black" };
+static const char *format_names[] = { "rgba", "bgra", "argb", "rgb24" };
+
+typedef struct {
+    uint8_t *data;
+    uint8_t *plane[3];
+    int stride[3];
+    int w;
+    int h;
+} i420_t;
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dull;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)(rng_state >> 32);
+}
+
+static int bytes_per_pixel(convert_format_t format) {
+    return format == CONVERT_FORMAT_RGB24 ? 3 : 4;
+}
+
+static uint8_t *make_image(image_kind_t kind, int stride, int h) {
+    size_t size = (size_t)stride * h;
+    uint8_t *p = malloc(size);
+    if (!p) {
+        return NULL;
+    }
+    for (size_t i = 0; i < size; i++) {
+        switch (kind) {
+            case IMAGE_RANDOM: p[i] = (uint8_t)rng(); break;
+            case IMAGE_SATURATED: p[i] = rng() & 1 ? 255 : 0; break;
+            case IMAGE_WHITE: p[i] = 255; break;
+            default: p[i] = 0; break;
+        }
+    }
+    return p;
+}
+
+// Planes with odd padding after every row, filled with the guard byte.
+static int i420_alloc(i420_t *pic, int w, int h) {
+    pic->w = w;
+    pic->h = h;
+    pic->stride[0] = w + GUARD;
+    pic->stride[1] = pic->stride[2] = w / 2 + GUARD;
+    size_t luma = (size_t)pic->stride[0] * h;
+    size_t chroma = (size_t)pic->stride[1] * (h / 2);
+    pic->data = malloc(luma + 2 * chroma);
+    if (!pic->data) {
+        return 1;
+    }
+    memset(pic->data, GUARD_BYTE, luma + 2 * chroma);
+    pic->plane[0] = pic->data;
+    pic->plane[1] = pic->data + luma;
+    pic->plane[2] = pic->data + luma + chroma;
+    return 0;
+}
+
+static void i420_reset(i420_t *pic) {
+    memset(pic->data, GUARD_BYTE, (size_t)pic->stride[0] * pic->h + 2 * (size_t)pic->stride[1] * (pic->h / 2));
+}
+
+// Compares every row of the three planes, guard bytes included. Returns 0 if they match, or says
+// where the first difference is.
+static int i420_compare(const i420_t *got, const i420_t *want, const char *what) {
+    static const char *plane_names[3] = { "Y", "U", "V" };
+    for (int p = 0; p < 3; p++) {
+        int rows = p ? want->h / 2 : want->h;
+        int row_bytes = (p ? want->w / 2 : want->w) + GUARD;
+        for (int y = 0; y < rows; y++) {
+            const uint8_t *a = got->plane[p] + (size_t)y * got->stride[p];
+            const uint8_t *b = want->plane[p] + (size_t)y * want->stride[p];
+            if (memcmp(a, b, row_bytes) != 0) {
+                int x = 0;
+                while (a[x] == b[x]) {
+                    x++;
+                }
+                fprintf(stderr, "%s: %s differs at %d,%d: %d, expected %d%s\n", what, plane_names[p], x, y, a[x], b[x],
+                        x >= row_bytes - GUARD ? " (past the end of the row)" : "");
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// The arithmetic convert.h documents, written out independently of convert.c.
+static int check_formulas(const uint8_t *src, int src_stride, convert_format_t format, const i420_t *pic,
+                          const char *what) {
+    int bpp = bytes_per_pixel(format);
+    int r_off = format == CONVERT_FORMAT_BGRA ? 2 : format == CONVERT_FORMAT_ARGB ? 1 : 0;
+    int g_off = format == CONVERT_FORMAT_ARGB ? 2 : 1;
+    int b_off = format == CONVERT_FORMAT_BGRA ? 0 : format == CONVERT_FORMAT_ARGB ? 3 : 2;
+    for (int y = 0; y < pic->h; y += 2) {
+        for (int x = 0; x < pic->w; x += 2) {
+            int r = 0, g = 0, b = 0;
+            for (int i = 0; i < 4; i++) {
+                int px = x + (i & 1);
+                int py = y + (i >> 1);
+                const uint8_t *p = src + (size_t)py * src_stride + (size_t)px * bpp;
+                int luma = (77 * p[r_off] + 150 * p[g_off] + 29 * p[b_off] + 128) >> 8;
+                int got = pic->plane[0][(size_t)py * pic->stride[0] + px];
+                if (got != luma) {
+                    fprintf(stderr, "%s: Y at %d,%d is %d, the formula gives %d\n", what, px, py, got, luma);
+                    return 1;
+                }
+                r += p[r_off];
+                g += p[g_off];
+                b += p[b_off];
+            }
+            r = (r + 2) >> 2;
+            g = (g + 2) >> 2;
+            b = (b + 2) >> 2;
+            int u = (64 * b - 22 * r - 42 * g + (128 << 7) + 64) >> 7;
+            int v = (64 * r - 54 * g - 10 * b + (128 << 7) + 64) >> 7;
+            u = u > 255 ? 255 : u;
+            v = v > 255 ? 255 : v;
+            size_t c = (size_t)(y / 2) * pic->stride[1] + x / 2;
+            if (pic->plane[1][c] != u || pic->plane[2][c] != v) {
+                fprintf(stderr, "%s: UV at %d,%d is %d,%d, the formula gives %d,%d\n", what, x / 2, y / 2,
+                        pic->plane[1][c], pic->plane[2][c], u, v);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static convert_backend_t backends[CONVERT_BACKEND_COUNT];
+static int n_backends;
+static int n_checks;
+
+// Converts src to w x h, or scales it there when it's bigger, with every backend, in one call and
+// in two bands, and compares each result with the scalar kernel's. Returns the number of failures.
+static int check_case(const uint8_t *src, int src_stride, convert_format_t format, int src_w, int src_h,
+                      int w, int h, const char *what) {
+    int b_scaled = src_w != w || src_h != h;
+    i420_t want, got;
+    if (i420_alloc(&want, w, h) != 0 || i420_alloc(&got, w, h) != 0) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    int n_failed = 0;
+    char name[256];
+    convert_set_backend(CONVERT_BACKEND_SCALAR);
+    if (b_scaled) {
+        convert_scaled_to_i420(src, src_stride, format, src_w, src_h, want.plane, want.stride, w, h, 0, h);
+    } else {
+        convert_packed_to_i420(src, src_stride, format, want.plane, want.stride, w, h);
+        n_failed += check_formulas(src, src_stride, format, &want, what);
+    }
+
+    for (int i = 0; i < n_backends; i++) {
+        convert_set_backend(backends[i]);
+        for (int b_banded = 0; b_banded < 2; b_banded++) {
+            i420_reset(&got);
+            // bands split on an even row, as the session's convert workers do
+            int split = b_banded ? (h / 4) * 2 : h;
+            convert_scaled_to_i420(src, src_stride, format, src_w, src_h, got.plane, got.stride, w, h, 0, split);
+            if (split < h) {
+                convert_scaled_to_i420(src, src_stride, format, src_w, src_h, got.plane, got.stride, w, h, split, h);
+            }
+            snprintf(name, sizeof(name), "%s, %s%s", what, convert_backend_name(backends[i]), b_banded ? ", banded" : "");
+            n_failed += i420_compare(&got, &want, name);
+            n_checks++;
+        }
+        if (!b_scaled) {
+            i420_reset(&got);
+            convert_packed_to_i420(src, src_stride, format, got.plane, got.stride, w, h);
+            snprintf(name, sizeof(name), "%s, %s, packed", what, convert_backend_name(backends[i]));
+            n_failed += i420_compare(&got, &want, name);
+            n_checks++;
+        }
+    }
+
+    free(want.data);
+    free(got.data);
+    return n_failed;
+}
+
+int main(void) {
+    for (int b = CONVERT_BACKEND_SCALAR; b < CONVERT_BACKEND_COUNT; b++) {
+        if (convert_backend_available(b)) {
+            backends[n_backends++] = b;
+        }
+    }
+    printf("backends:");
+    for (int i = 0; i < n_backends; i++) {
+        printf(" %s", convert_backend_name(backends[i]));
+    }
+    printf("\n");
+
+    // small sizes, where everything is tail, and odd multiples of 16 with and without a bit more
+    static const int sizes[][2] = {
+        { 2, 2 }, { 4, 2 }, { 6, 4 }, { 10, 6 }, { 14, 2 }, { 18, 4 }, { 30, 8 }, { 34, 2 },
+        { 16, 16 }, { 48, 6 }, { 80, 10 }, { 112, 4 }, { 144, 2 }, { 240, 8 }, { 50, 4 }, { 530, 6 },
+        { 1296, 4 },
+    };
+    // source sizes for each output size: 2:1 (the box2 path), 3:1, and ratios only bilinear handles
+    static const int ratios[][2] = { { 2, 1 }, { 3, 1 }, { 3, 2 }, { 5, 4 } };
+    int n_failed = 0;
+    char what[128];
+
+    for (int f = CONVERT_FORMAT_RGBA; f <= CONVERT_FORMAT_RGB24; f++) {
+        int bpp = bytes_per_pixel(f);
+        for (int k = 0; k < IMAGE_KINDS; k++) {
+            for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                int w = sizes[s][0];
+                int h = sizes[s][1];
+                int stride = w * bpp + 7;
+                uint8_t *src = make_image(k, stride, h);
+                if (!src) {
+                    fprintf(stderr, "out of memory\n");
+                    return 1;
+                }
+                snprintf(what, sizeof(what), "%s %s %dx%d", image_names[k], format_names[f], w, h);
+                n_failed += check_case(src, stride, f, w, h, w, h, what);
+                free(src);
+
+                for (size_t r = 0; r < sizeof(ratios) / sizeof(ratios[0]); r++) {
+                    int src_w = w * ratios[r][0] / ratios[r][1];
+                    int src_h = h * ratios[r][0] / ratios[r][1];
+                    int src_stride = src_w * bpp + 5;
+                    src = make_image(k, src_stride, src_h);
+                    if (!src) {
+                        fprintf(stderr, "out of memory\n");
+                        return 1;
+                    }
+                    snprintf(what, sizeof(what), "%s %s %dx%d scaled to %dx%d", image_names[k], format_names[f],
+                             src_w, src_h, w, h);
+                    n_failed += check_case(src, src_stride, f, src_w, src_h, w, h, what);
+                    free(src);
+                }
+            }
+        }
+    }
+
+    printf("%d comparisons, %d failed\n", n_checks, n_failed);
+    return n_failed != 0;
+}
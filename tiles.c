@@ -0,0 +1,78 @@
+#include "tiles.h"
+
+#include <string.h>
+
+#define TILE_SEED 0x9e3779b97f4a7c15ull
+#define TILE_MUL_A 0xff51afd7ed558ccdull
+#define TILE_MUL_B 0xc4ceb9fe1a85ec53ull
+
+static inline uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t rotl64(uint64_t v, int r) {
+    return (v << r) | (v >> (64 - r));
+}
+
+// The full 128 bit product of v and m, folded to 64 bits as hi ^ lo. A plain 64 bit multiply only
+// carries a change upwards, so the top bits of two words xored into the same chain could cancel
+// out; the high half brings every bit of v back down into the result.
+static inline uint64_t mix64(uint64_t v, uint64_t m) {
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 r = (unsigned __int128)v * m;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t v_lo = (uint32_t)v, v_hi = v >> 32;
+    uint64_t m_lo = (uint32_t)m, m_hi = m >> 32;
+    uint64_t ll = v_lo * m_lo, lh = v_lo * m_hi, hl = v_hi * m_lo, hh = v_hi * m_hi;
+    uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+    uint64_t lo = (mid << 32) | (uint32_t)ll;
+    uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    return lo ^ hi;
+#endif
+}
+
+// Folds one row of a tile into its hash. Two independent multiply chains keep this from being
+// bound by multiply latency; the row index goes into the seed so swapped rows hash differently.
+static inline uint64_t hash_segment(uint64_t h, const uint8_t *p, int len) {
+    uint64_t a = h;
+    uint64_t b = rotl64(h, 32) ^ TILE_SEED;
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        a = mix64(a ^ load64(p + i), TILE_MUL_A);
+        b = mix64(b ^ load64(p + i + 8), TILE_MUL_B);
+    }
+    if (i < len) {
+        uint8_t tail[16] = { 0 };
+        memcpy(tail, p + i, len - i);
+        a = mix64(a ^ load64(tail), TILE_MUL_A);
+        b = mix64(b ^ load64(tail + 8), TILE_MUL_B);
+    }
+    return a ^ rotl64(b, 31);
+}
+
+void tiles_hash(const uint8_t *src, int stride, int bytes_per_pixel, int w, int h,
+                int tile_y0, int tile_y1, uint64_t *hashes) {
+    int n_across = tiles_across(w);
+    int row_bytes = w * bytes_per_pixel;
+    int tile_bytes = TILE_SIZE * bytes_per_pixel;
+
+    for (int ty = tile_y0; ty < tile_y1; ty++) {
+        uint64_t *row_hashes = hashes + (size_t)ty * n_across;
+        for (int tx = 0; tx < n_across; tx++) {
+            row_hashes[tx] = TILE_SEED * (uint64_t)(ty * n_across + tx + 1);
+        }
+
+        int y_end = (ty + 1) * TILE_SIZE < h ? (ty + 1) * TILE_SIZE : h;
+        for (int y = ty * TILE_SIZE; y < y_end; y++) {
+            const uint8_t *row = src + (size_t)y * stride;
+            for (int tx = 0; tx < n_across; tx++) {
+                int x = tx * tile_bytes;
+                int len = row_bytes - x < tile_bytes ? row_bytes - x : tile_bytes;
+                row_hashes[tx] = hash_segment(row_hashes[tx] + (uint64_t)y, row + x, len);
+            }
+        }
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef RAW2MP4_TILES_H
+#define RAW2MP4_TILES_H
+
+#include <stdint.h>
+
+// Hashes of TILE_SIZE x TILE_SIZE pixel tiles of a packed image, for spotting frames, or parts of
+// frames, that are identical to the previous one without keeping a copy of it. Tiles on the right
+// and bottom edges cover whatever is left of the image.
+
+#define TILE_SIZE 16
+
+static inline int tiles_across(int w) {
+    return (w + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+static inline int tiles_down(int h) {
+    return (h + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+// Hashes tile rows [tile_y0, tile_y1) of a w x h image into hashes, laid out tiles_across(w) to a
+// row. Tile rows are independent, so disjoint ranges can be hashed on different threads.
+void tiles_hash(const uint8_t *src, int stride, int bytes_per_pixel, int w, int h,
+                int tile_y0, int tile_y1, uint64_t *hashes);
+
+#endif
@@ -0,0 +1,147 @@
+#include "workers.h"
+
+#include <stdlib.h>
+
+#if RAW2MP4_HAVE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+struct workers_t {
+    int n_threads;
+#if RAW2MP4_HAVE_THREADS
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    unsigned generation;
+    int quit;
+
+    // current batch, protected by lock
+    workers_fn fn;
+    void *ctx;
+    int n_jobs;
+    int next_job;
+    int n_done;
+#endif
+};
+
+int workers_cpu_count(void) {
+#if RAW2MP4_HAVE_THREADS
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+#if RAW2MP4_HAVE_THREADS
+
+// Claims and runs jobs from the current batch until none are left. Called with lock held.
+static void workers_drain(workers_t *workers) {
+    while (workers->next_job < workers->n_jobs) {
+        int job = workers->next_job++;
+        pthread_mutex_unlock(&workers->lock);
+        workers->fn(workers->ctx, job);
+        pthread_mutex_lock(&workers->lock);
+        if (++workers->n_done == workers->n_jobs) {
+            pthread_cond_signal(&workers->done_cond);
+        }
+    }
+}
+
+static void *workers_main(void *arg) {
+    workers_t *workers = arg;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&workers->lock);
+    for (;;) {
+        while (!workers->quit && workers->generation == seen) {
+            pthread_cond_wait(&workers->work_cond, &workers->lock);
+        }
+        if (workers->quit) {
+            break;
+        }
+        seen = workers->generation;
+        workers_drain(workers);
+    }
+    pthread_mutex_unlock(&workers->lock);
+    return NULL;
+}
+
+#endif
+
+workers_t *workers_create(int n_threads) {
+    workers_t *workers = calloc(1, sizeof(workers_t));
+    if (!workers) {
+        return NULL;
+    }
+    if (n_threads <= 0) {
+        n_threads = workers_cpu_count();
+    }
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_init(&workers->lock, NULL);
+    pthread_cond_init(&workers->work_cond, NULL);
+    pthread_cond_init(&workers->done_cond, NULL);
+    workers->threads = calloc(n_threads, sizeof(pthread_t));
+    workers->n_threads = 1;
+    for (int i = 1; workers->threads && i < n_threads; i++) {
+        if (pthread_create(&workers->threads[i], NULL, workers_main, workers) != 0) {
+            break;
+        }
+        workers->n_threads++;
+    }
+#else
+    workers->n_threads = 1;
+#endif
+    return workers;
+}
+
+void workers_destroy(workers_t *workers) {
+    if (!workers) {
+        return;
+    }
+#if RAW2MP4_HAVE_THREADS
+    pthread_mutex_lock(&workers->lock);
+    workers->quit = 1;
+    pthread_cond_broadcast(&workers->work_cond);
+    pthread_mutex_unlock(&workers->lock);
+    for (int i = 1; i < workers->n_threads; i++) {
+        pthread_join(workers->threads[i], NULL);
+    }
+    free(workers->threads);
+    pthread_cond_destroy(&workers->done_cond);
+    pthread_cond_destroy(&workers->work_cond);
+    pthread_mutex_destroy(&workers->lock);
+#endif
+    free(workers);
+}
+
+int workers_count(const workers_t *workers) {
+    return workers ? workers->n_threads : 1;
+}
+
+void workers_run(workers_t *workers, workers_fn fn, void *ctx, int n_jobs) {
+#if RAW2MP4_HAVE_THREADS
+    if (workers && workers->n_threads > 1 && n_jobs > 1) {
+        pthread_mutex_lock(&workers->lock);
+        workers->fn = fn;
+        workers->ctx = ctx;
+        workers->n_jobs = n_jobs;
+        workers->next_job = 0;
+        workers->n_done = 0;
+        workers->generation++;
+        pthread_cond_broadcast(&workers->work_cond);
+
+        workers_drain(workers);
+        while (workers->n_done < workers->n_jobs) {
+            pthread_cond_wait(&workers->done_cond, &workers->lock);
+        }
+        pthread_mutex_unlock(&workers->lock);
+        return;
+    }
+#endif
+    for (int job = 0; job < n_jobs; job++) {
+        fn(ctx, job);
+    }
+}
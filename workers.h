@@ -0,0 +1,30 @@
+#ifndef RAW2MP4_WORKERS_H
+#define RAW2MP4_WORKERS_H
+
+// A small fork/join pool: workers_run hands out n_jobs indices to the pool threads and the
+// calling thread, and returns once all of them have been processed.
+//
+// Builds without pthreads (the plain emscripten targets) get a pool that runs every job on the
+// calling thread.
+
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define RAW2MP4_HAVE_THREADS 1
+#else
+#define RAW2MP4_HAVE_THREADS 0
+#endif
+
+typedef struct workers_t workers_t;
+typedef void (*workers_fn)(void *ctx, int job);
+
+// n_threads counts the calling thread, so 1 creates no extra threads. 0 means one per online CPU.
+workers_t *workers_create(int n_threads);
+void workers_destroy(workers_t *workers);
+int workers_count(const workers_t *workers);
+
+// Runs fn(ctx, 0) .. fn(ctx, n_jobs - 1) across the pool. Not reentrant.
+void workers_run(workers_t *workers, workers_fn fn, void *ctx, int n_jobs);
+
+// Number of online CPUs, at least 1.
+int workers_cpu_count(void);
+
+#endif